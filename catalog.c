@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <pthread.h>
+#include "catalog.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+struct imagelisthead image_list = TAILQ_HEAD_INITIALIZER(image_list);
+int num_images = 0;
+int catalog_verbose = 0;
+int num_sources = 0;
+
+/* Only the main thread changes image_list, and it can read it freely. Other
+ * threads have to use catalog_filename(), and changes hold this lock. */
+pthread_mutex_t catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Watched directories, by inotify watch descriptor */
+struct watch_s {
+    int wd, source;
+    char *dir;
+    LIST_ENTRY(watch_s) entries;
+};
+LIST_HEAD(watchlisthead, watch_s) watch_list = LIST_HEAD_INITIALIZER(watch_list);
+int inotify_fd = -1;
+
+/* Background scan state. The scanning thread puts images it finds on
+ * scan_found, which the main thread moves onto image_list whenever it polls.
+ * Once done, it leaves the complete, sorted list in scan_final, and the main
+ * thread swaps that in, all at once. */
+pthread_t scan_thread;
+pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+struct imagelisthead scan_found = TAILQ_HEAD_INITIALIZER(scan_found);
+struct imagelisthead scan_final = TAILQ_HEAD_INITIALIZER(scan_final);
+int scanning = 0, scan_finished = 0, scan_final_count = 0;
+char * const *scan_paths;
+int scan_num_paths;
+
+void catalog_init(int verbose) {
+    catalog_verbose = verbose;
+}
+
+int is_directory(const char *name) {
+    struct stat statbuf;
+    if (stat(name, &statbuf) == -1) {
+        perror("Getting information about image file");
+        return 0;
+    }
+
+    return (S_ISDIR(statbuf.st_mode));
+}
+
+/* Put a new image at the end of a list. The TAILQ macros evaluate their
+ * element argument more than once, so it has to be allocated first. */
+static void append_image(struct imagelisthead *head, char *image_file, int source) {
+    struct image_s *img;
+
+    img = (struct image_s *) malloc(sizeof(struct image_s));
+    if (!img) {
+        perror("Couldn't allocate image structure");
+        exit(1);
+    }
+    img->filename = image_file;
+    img->source = source;
+    TAILQ_INSERT_TAIL(head, img, entries);
+}
+
+static void catalog_add(char *image_file, int source) {
+    if (catalog_verbose)
+        fprintf(stderr, "Adding file %s\n", image_file);
+    pthread_mutex_lock(&catalog_lock);
+    append_image(&image_list, image_file, source);
+    num_images++;
+    pthread_mutex_unlock(&catalog_lock);
+}
+
+/* Put a file that's turned up in a watched directory where listing the
+ * directory at startup would have: after everything from earlier paths, in
+ * sorted order among the rest of its directory. Returns its index. */
+static int catalog_insert(char *image_file, int source) {
+    struct image_s *img, *next;
+    int p = 0;
+
+    img = (struct image_s *) malloc(sizeof(struct image_s));
+    if (!img) {
+        perror("Couldn't allocate image structure");
+        exit(1);
+    }
+    img->filename = image_file;
+    img->source = source;
+    TAILQ_FOREACH(next, &image_list, entries) {
+        if (next->source > source || (next->source == source && strcmp(next->filename, image_file) > 0))
+            break;
+        p++;
+    }
+    if (catalog_verbose)
+        fprintf(stderr, "Adding file %s as image %d\n", image_file, p);
+    pthread_mutex_lock(&catalog_lock);
+    if (next)
+        TAILQ_INSERT_BEFORE(next, img, entries);
+    else
+        TAILQ_INSERT_TAIL(&image_list, img, entries);
+    num_images++;
+    pthread_mutex_unlock(&catalog_lock);
+    return p;
+}
+
+static char *join_path(const char *dir, const char *name) {
+    char *image_file;
+    int imgnamelen;
+
+    imgnamelen = strlen(dir) + 2 + strlen(name);
+    image_file = (char *) malloc(imgnamelen);
+    if (!image_file) {
+        perror("Couldn't allocate memory for reconstructed filename");
+        exit(1);
+    }
+    sprintf(image_file, "%s/%s", dir, name);
+    return image_file;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Find every file in a directory, sorted by name, so that every screen on
+ * the wall agrees on the order. readdir() usually says whether an entry is a
+ * directory, which saves a stat() for each one. With found set, each file is
+ * also put on scan_found as soon as it's seen, as coming from source. */
+static int list_directory(const char *path, char ***files, int found, int source) {
+    DIR *dirfd;
+    struct dirent *d;
+    char *image_file;
+    int n = 0, size = 0, isdir;
+
+    *files = NULL;
+    dirfd = opendir(path);
+    if (! dirfd) {
+        perror("Couldn't open directory");
+        return 0;
+    }
+
+    while ((d = readdir(dirfd))) {
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+        image_file = join_path(path, d->d_name);
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (d->d_type != DT_UNKNOWN && d->d_type != DT_LNK)
+            isdir = (d->d_type == DT_DIR);
+        else
+#endif
+            isdir = is_directory(image_file);
+        if (isdir) {
+            if (catalog_verbose)
+                fprintf(stderr, "%s isn't a normal file.\n", image_file);
+            free(image_file);
+            continue;
+        }
+
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            *files = (char **) realloc(*files, sizeof(char *) * size);
+            if (!*files) {
+                perror("Couldn't allocate directory listing");
+                exit(1);
+            }
+        }
+        (*files)[n++] = image_file;
+
+        if (found) {
+            image_file = strdup(image_file);
+            if (!image_file) {
+                perror("Couldn't duplicate filename");
+                exit(1);
+            }
+            pthread_mutex_lock(&scan_lock);
+            append_image(&scan_found, image_file, source);
+            pthread_mutex_unlock(&scan_lock);
+        }
+    }
+    closedir(dirfd);
+
+    qsort(*files, n, sizeof(char *), compare_names);
+    return n;
+}
+
+static void watch_directory(const char *dir, int source) {
+    struct watch_s *w;
+
+    if (inotify_fd == -1) {
+        inotify_fd = inotify_init1(IN_NONBLOCK);
+        if (inotify_fd == -1) {
+            perror("Couldn't start watching directories");
+            return;
+        }
+    }
+    w = (struct watch_s *) malloc(sizeof(struct watch_s));
+    if (!w || !(w->dir = strdup(dir))) {
+        perror("Couldn't allocate directory watch");
+        exit(1);
+    }
+    w->source = source;
+    w->wd = inotify_add_watch(inotify_fd, dir, WATCH_EVENTS);
+    if (w->wd == -1) {
+        perror("Couldn't watch directory");
+        free(w->dir);
+        free(w);
+        return;
+    }
+    if (catalog_verbose)
+        fprintf(stderr, "Watching %s for new images\n", dir);
+    LIST_INSERT_HEAD(&watch_list, w, entries);
+}
+
+/* Add an image, or every file in a directory */
+void catalog_add_path(const char *path, int watch) {
+    char *image_file, **files;
+    int i, n, source = num_sources++;
+
+    if (is_directory(path)) {
+        /* Read through this directory and load all files */
+        n = list_directory(path, &files, 0, source);
+        for (i = 0; i < n; i++)
+            catalog_add(files[i], source);
+        free(files);
+        if (watch)
+            watch_directory(path, source);
+    }
+    else {
+        /* This is apparently a single image */
+        image_file = strdup(path);
+        if (!image_file) {
+            perror("Couldn't allocate memory for image name");
+            exit(1);
+        }
+        catalog_add(image_file, source);
+    }
+}
+
+static void *scan_main(void *arg) {
+    struct imagelisthead final = TAILQ_HEAD_INITIALIZER(final);
+    char *image_file, **files;
+    int i, j, n, count = 0;
+
+    for (i = 0; i < scan_num_paths; i++) {
+        if (is_directory(scan_paths[i])) {
+            n = list_directory(scan_paths[i], &files, 1, i);
+            for (j = 0; j < n; j++)
+                append_image(&final, files[j], i);
+            free(files);
+            count += n;
+        }
+        else {
+            /* catalog_scan_start() already put these on image_list */
+            image_file = strdup(scan_paths[i]);
+            if (!image_file) {
+                perror("Couldn't allocate memory for image name");
+                exit(1);
+            }
+            append_image(&final, image_file, i);
+            count++;
+        }
+    }
+
+    pthread_mutex_lock(&scan_lock);
+    TAILQ_CONCAT(&scan_final, &final, entries);
+    scan_final_count = count;
+    scan_finished = 1;
+    pthread_mutex_unlock(&scan_lock);
+    return NULL;
+}
+
+/* Like calling catalog_add_path() on each path, but directories are read on
+ * a background thread, so the first image can go up before the scan
+ * finishes. Single files are added right away. Directories are watched from
+ * the start, but their events are left queued until the scan is done. */
+void catalog_scan_start(char * const *paths, int n, int watch) {
+    char *image_file;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (is_directory(paths[i])) {
+            if (watch)
+                watch_directory(paths[i], i);
+        }
+        else {
+            image_file = strdup(paths[i]);
+            if (!image_file) {
+                perror("Couldn't allocate memory for image name");
+                exit(1);
+            }
+            catalog_add(image_file, i);
+        }
+    }
+
+    num_sources = n;
+    scan_paths = paths;
+    scan_num_paths = n;
+    scanning = 1;
+    if (pthread_create(&scan_thread, NULL, scan_main, NULL) != 0) {
+        perror("Couldn't start directory scan thread");
+        exit(1);
+    }
+}
+
+int catalog_scanning(void) {
+    return scanning;
+}
+
+struct name_index_s {
+    const char *filename;
+    int idx;
+};
+
+static int compare_name_index(const void *a, const void *b) {
+    return strcmp(((const struct name_index_s *) a)->filename, ((const struct name_index_s *) b)->filename);
+}
+
+/* Called from the main loop while a background scan runs. Appends whatever
+ * the scan has found since last time, and returns how many that was. Once
+ * the scan is done, replaces the whole list with the final sorted one; then
+ * *remap is set to a malloc()ed array giving, for each old index, the same
+ * image's new index, or -1 if it's gone. The caller frees it. */
+int catalog_scan_poll(int **remap) {
+    struct imagelisthead old = TAILQ_HEAD_INITIALIZER(old);
+    struct image_s *img;
+    struct name_index_s *sorted, key, *found;
+    int added = 0, i, old_count;
+
+    *remap = NULL;
+    if (!scanning)
+        return 0;
+
+    pthread_mutex_lock(&scan_lock);
+    pthread_mutex_lock(&catalog_lock);
+    while ((img = TAILQ_FIRST(&scan_found))) {
+        TAILQ_REMOVE(&scan_found, img, entries);
+        TAILQ_INSERT_TAIL(&image_list, img, entries);
+        num_images++;
+        added++;
+    }
+    if (!scan_finished) {
+        pthread_mutex_unlock(&catalog_lock);
+        pthread_mutex_unlock(&scan_lock);
+        return added;
+    }
+
+    /* Publish the final list, and work out where each image went */
+    old_count = num_images;
+    TAILQ_CONCAT(&old, &image_list, entries);
+    TAILQ_CONCAT(&image_list, &scan_final, entries);
+    num_images = scan_final_count;
+    pthread_mutex_unlock(&catalog_lock);
+    pthread_mutex_unlock(&scan_lock);
+    pthread_join(scan_thread, NULL);
+    scanning = 0;
+
+    sorted = (struct name_index_s *) malloc(sizeof(struct name_index_s) * (num_images + 1));
+    *remap = (int *) malloc(sizeof(int) * (old_count + 1));
+    if (!sorted || !*remap) {
+        perror("Couldn't allocate image index map");
+        exit(1);
+    }
+    i = 0;
+    TAILQ_FOREACH(img, &image_list, entries) {
+        sorted[i].filename = img->filename;
+        sorted[i].idx = i;
+        i++;
+    }
+    qsort(sorted, num_images, sizeof(struct name_index_s), compare_name_index);
+
+    i = 0;
+    while ((img = TAILQ_FIRST(&old))) {
+        TAILQ_REMOVE(&old, img, entries);
+        key.filename = img->filename;
+        found = (struct name_index_s *) bsearch(&key, sorted, num_images, sizeof(struct name_index_s), compare_name_index);
+        (*remap)[i++] = found ? found->idx : -1;
+        free(img->filename);
+        free(img);
+    }
+    free(sorted);
+
+    if (catalog_verbose)
+        fprintf(stderr, "Directory scan finished with %d images\n", num_images);
+    return added;
+}
+
+char *image_at(int i) {
+    struct image_s *image;
+    int p = 0;
+
+    TAILQ_FOREACH(image, &image_list, entries) {
+        if (p == i) break;
+        p++;
+    }
+
+    printf("Returning %s for image file %d\n", image->filename, i);
+    return (image->filename);
+}
+
+/* A copy of image i's filename, or NULL if there's no such image. Safe to
+ * call from any thread; the caller frees it. */
+char *catalog_filename(int i) {
+    struct image_s *image;
+    char *filename = NULL;
+    int p = 0;
+
+    pthread_mutex_lock(&catalog_lock);
+    TAILQ_FOREACH(image, &image_list, entries) {
+        if (p == i) {
+            filename = strdup(image->filename);
+            break;
+        }
+        p++;
+    }
+    pthread_mutex_unlock(&catalog_lock);
+    return filename;
+}
+
+/* Filenames of images first through first + count - 1, or as many of them
+ * as there are, in one walk of the list. Main thread only; the names
+ * belong to the catalog. Returns how many there were. */
+int catalog_range(int first, int count, const char **names) {
+    struct image_s *image;
+    int p = 0, n = 0;
+
+    TAILQ_FOREACH(image, &image_list, entries) {
+        if (p >= first + count)
+            break;
+        if (p >= first)
+            names[n++] = image->filename;
+        p++;
+    }
+    return n;
+}
+
+int catalog_index_of(const char *filename) {
+    struct image_s *image;
+    int p = 0;
+
+    TAILQ_FOREACH(image, &image_list, entries) {
+        if (!strcmp(image->filename, filename))
+            return p;
+        p++;
+    }
+    return -1;
+}
+
+static void catalog_remove(int idx) {
+    struct image_s *image;
+    int p = 0;
+
+    TAILQ_FOREACH(image, &image_list, entries) {
+        if (p == idx) break;
+        p++;
+    }
+    pthread_mutex_lock(&catalog_lock);
+    TAILQ_REMOVE(&image_list, image, entries);
+    num_images--;
+    pthread_mutex_unlock(&catalog_lock);
+    free(image->filename);
+    free(image);
+}
+
+/* Apply whatever has changed in the watched directories since last time,
+ * telling cb about each change once the list reflects it. For a removal, idx
+ * is where the image used to be; for an addition, where it went, with every
+ * image from there on moved along one. Returns the number of changes. */
+int catalog_watch_events(catalog_callback cb) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    struct watch_s *w;
+    char *image_file;
+    ssize_t len;
+    char *p;
+    int idx, changes = 0;
+
+    if (inotify_fd == -1 || scanning)
+        return 0;
+
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *) p;
+            if (ev->len == 0 || (ev->mask & IN_ISDIR) || ev->name[0] == '.')
+                continue;
+            LIST_FOREACH(w, &watch_list, entries) {
+                if (w->wd == ev->wd)
+                    break;
+            }
+            if (!w)
+                continue;
+
+            image_file = join_path(w->dir, ev->name);
+            idx = catalog_index_of(image_file);
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (idx != -1) {
+                    if (catalog_verbose)
+                        fprintf(stderr, "Image %s went away\n", image_file);
+                    catalog_remove(idx);
+                    cb(CATALOG_REMOVED, idx);
+                    changes++;
+                }
+                free(image_file);
+            }
+            else if (idx != -1) {
+                if (catalog_verbose)
+                    fprintf(stderr, "Image %s changed\n", image_file);
+                cb(CATALOG_MODIFIED, idx);
+                changes++;
+                free(image_file);
+            }
+            else {
+                idx = catalog_insert(image_file, w->source);
+                cb(CATALOG_ADDED, idx);
+                changes++;
+            }
+        }
+    }
+    return changes;
+}
@@ -0,0 +1,44 @@
+#ifndef _catalog_h_
+#define _catalog_h_
+
+#include <sys/queue.h>
+
+/* The list of images to show, built from the files and directories given on
+ * the command line. Directories can be watched with inotify, so files
+ * dropped into them, or removed, show up without a restart. New files go
+ * where a fresh start would have put them, so a screen that's been running
+ * agrees with one that's just started on which image is which. Images after
+ * them move along one.
+ *
+ * Directories are listed in sorted order. They can also be read on a
+ * background thread, in which case images are appended in whatever order
+ * they're found, and the sorted list replaces that in one go at the end. */
+
+#define CATALOG_ADDED 0
+#define CATALOG_REMOVED 1
+#define CATALOG_MODIFIED 2
+
+struct image_s {
+    char *filename;
+    int source;                 /* Which path on the command line it came from */
+    TAILQ_ENTRY(image_s) entries;
+};
+TAILQ_HEAD(imagelisthead, image_s);
+
+extern struct imagelisthead image_list;
+extern int num_images;
+
+typedef void (*catalog_callback)(int change, int idx);
+
+void catalog_init(int verbose);
+void catalog_add_path(const char *path, int watch);
+void catalog_scan_start(char * const *paths, int n, int watch);
+int catalog_scanning(void);
+int catalog_scan_poll(int **remap);
+char *image_at(int);
+char *catalog_filename(int);
+int catalog_index_of(const char *filename);
+int catalog_range(int first, int count, const char **names);
+int catalog_watch_events(catalog_callback);
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "clock-sync.h"
+
+#define PING_INTERVAL_MS 1000
+#define NUM_SAMPLES 8               /* Exchanges we choose the best of */
+#define REPORT_EVERY 30             /* Pings between reports, when verbose */
+
+struct sample_s {
+    double offset, delay;
+} samples[NUM_SAMPLES];
+int num_samples = 0, next_sample = 0;
+
+/* Only the control side pings and hears answers, but draw() reads the
+ * statistics for acknowledgements */
+pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+double best_offset = 0, best_delay = 0, offset_jitter = 0;
+
+unsigned int ping_id = 0;
+double last_ping_ms = 0;
+int clock_verbose = 0;
+
+/* Monotonic, so stepping the wall clock doesn't make anything measured
+ * with this jump; every module times things with it */
+double clock_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Answer a slave's ping, straight back to where it came from */
+void clock_sync_answer(int sock, const clock_ping *ping, const struct sockaddr_in *from, double received) {
+    clock_ping pong;
+
+    pong = *ping;
+    pong.flag = PONG_FLAG;
+    pong.received = received;
+    pong.replied = clock_now_ms();
+    if (sendto(sock, &pong, sizeof(pong), 0, (const struct sockaddr *) from, sizeof(*from)) != (ssize_t) sizeof(pong))
+        perror("Couldn't answer clock ping");
+}
+
+void clock_sync_init(int verbose) {
+    clock_verbose = verbose;
+}
+
+/* Ping the master, if it's been long enough since the last time */
+void clock_sync_ping(int sock, uint32_t master_addr, unsigned int port) {
+    struct sockaddr_in addr;
+    clock_ping ping;
+    double now = clock_now_ms();
+
+    if (now - last_ping_ms < PING_INTERVAL_MS)
+        return;
+    last_ping_ms = now;
+
+    memset(&ping, 0, sizeof(ping));
+    ping.flag = PING_FLAG;
+    ping.id = ++ping_id;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = master_addr;
+    addr.sin_port = htons(port);
+    ping.sent = clock_now_ms();
+    if (sendto(sock, &ping, sizeof(ping), 0, (struct sockaddr *) &addr, sizeof(addr)) != (ssize_t) sizeof(ping) &&
+        clock_verbose)
+        perror("Couldn't ping master");
+}
+
+/* The master answered; add what the exchange says to what we know */
+void clock_sync_pong(const clock_ping *pong) {
+    double now = clock_now_ms(), mean = 0, var = 0;
+    struct sample_s s;
+    int i, best = 0;
+
+    /* Answers to old pings are as good as new ones, but not to ones from
+     * before a restart */
+    if (pong->id > ping_id || pong->id == 0)
+        return;
+    s.offset = ((pong->received - pong->sent) + (pong->replied - now)) / 2;
+    s.delay = (now - pong->sent) - (pong->replied - pong->received);
+    if (s.delay < 0)
+        s.delay = 0;
+
+    pthread_mutex_lock(&clock_lock);
+    samples[next_sample] = s;
+    next_sample = (next_sample + 1) % NUM_SAMPLES;
+    if (num_samples < NUM_SAMPLES)
+        num_samples++;
+    for (i = 0; i < num_samples; i++) {
+        if (samples[i].delay < samples[best].delay)
+            best = i;
+        mean += samples[i].offset;
+    }
+    mean /= num_samples;
+    for (i = 0; i < num_samples; i++)
+        var += (samples[i].offset - mean) * (samples[i].offset - mean);
+    best_offset = samples[best].offset;
+    best_delay = samples[best].delay;
+    offset_jitter = sqrt(var / num_samples);
+    pthread_mutex_unlock(&clock_lock);
+
+    if (clock_verbose && (pong->id % REPORT_EVERY == 1 || clock_verbose > 1))
+        fprintf(stderr, "Master's clock is %+0.2f ms from ours, give or take %0.2f; jitter %0.2f ms\n",
+            best_offset, best_delay / 2, offset_jitter);
+}
+
+/* Master's clock less ours, if we've heard enough to say */
+int clock_sync_offset(double *offset) {
+    int valid;
+
+    pthread_mutex_lock(&clock_lock);
+    valid = num_samples > 0;
+    *offset = best_offset;
+    pthread_mutex_unlock(&clock_lock);
+    return valid;
+}
+
+/* The offset, how much it wanders between exchanges, and how far off it
+ * could be, all in milliseconds */
+void clock_sync_stats(double *offset, double *jitter, double *residual) {
+    pthread_mutex_lock(&clock_lock);
+    *offset = best_offset;
+    *jitter = offset_jitter;
+    *residual = best_delay / 2;
+    pthread_mutex_unlock(&clock_lock);
+}
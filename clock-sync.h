@@ -0,0 +1,40 @@
+#ifndef _clock_sync_h_
+#define _clock_sync_h_
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* Works out how far each slave's clock is from the master's, so the master
+ * can say when an update should appear, and every screen can show it on the
+ * same frame. Slaves ping the master about once a second, over the same UDP
+ * sockets sync packets and acknowledgements use, and the master answers
+ * with when it got the ping and when it replied. Like NTP, each exchange
+ * gives an offset good to within half its round trip, so of the last few,
+ * the one with the shortest round trip is believed. Every host measures with
+ * its monotonic clock, whose zero is arbitrary, which is fine: only the
+ * offset between them matters. */
+
+#define PING_FLAG 5678
+#define PONG_FLAG 5679
+
+typedef struct {
+    int flag;
+    unsigned int id;
+    double sent,            /* Slave's clock, when it sent the ping */
+           received,        /* Master's clock, when the ping arrived */
+           replied;         /* Master's clock, when it sent the answer */
+} clock_ping;
+
+/* The master's side */
+void clock_sync_answer(int sock, const clock_ping *ping, const struct sockaddr_in *from, double received);
+
+/* The slaves' */
+void clock_sync_init(int verbose);
+void clock_sync_ping(int sock, uint32_t master_addr, unsigned int port);
+void clock_sync_pong(const clock_ping *pong);
+int clock_sync_offset(double *offset);
+void clock_sync_stats(double *offset, double *jitter, double *residual);
+
+double clock_now_ms(void);
+
+#endif
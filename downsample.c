@@ -0,0 +1,46 @@
+#include <stdlib.h>
+#include "downsample.h"
+
+/* Average one pair of source rows into a destination row. The vertical sum
+ * runs over contiguous bytes, so the compiler can vectorize it; the
+ * horizontal pass then only has half as much left to do. */
+static void downsample_row(const unsigned char *a, const unsigned char *b, unsigned int w,
+                           unsigned short *sum, unsigned char *dst) {
+    unsigned int i, x, half = w / 2;
+
+    for (i = 0; i < w * 3; i++)
+        sum[i] = a[i] + b[i];
+    for (x = 0; x < half * 3; x += 3) {
+        dst[x]     = (sum[x * 2]     + sum[x * 2 + 3] + 2) >> 2;
+        dst[x + 1] = (sum[x * 2 + 1] + sum[x * 2 + 4] + 2) >> 2;
+        dst[x + 2] = (sum[x * 2 + 2] + sum[x * 2 + 5] + 2) >> 2;
+    }
+    if (w & 1) {
+        for (i = 0; i < 3; i++)
+            dst[half * 3 + i] = (sum[half * 6 + i] + 1) >> 1;
+    }
+}
+
+void downsample_rgb(const unsigned char *src, unsigned int w, unsigned int h, unsigned int stride, unsigned char *dst) {
+    unsigned int y, dw = (w + 1) / 2;
+    const unsigned char *top;
+    unsigned short *sum;
+
+    sum = (unsigned short *) malloc(sizeof(unsigned short) * w * 3);
+    if (!sum)
+        return;
+
+    /* Rows are stored top down, but pair up from the bottom */
+    y = 0;
+    if (h & 1) {
+        downsample_row(src, src, w, sum, dst);
+        dst += dw * 3;
+        y = 1;
+    }
+    for (; y < h; y += 2) {
+        top = src + (unsigned long) y * stride * 3;
+        downsample_row(top, top + stride * 3, w, sum, dst);
+        dst += dw * 3;
+    }
+    free(sum);
+}
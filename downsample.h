@@ -0,0 +1,10 @@
+#ifndef _downsample_h_
+#define _downsample_h_
+
+/* Halves a packed 8-bit RGB image with a 2x2 box filter. Pixels pair up from
+ * the left and from the bottom, so with an odd width the last column, and
+ * with an odd height the top row, gets averaged with itself. dst is
+ * (w + 1) / 2 by (h + 1) / 2 pixels, packed with no padding. */
+void downsample_rgb(const unsigned char *src, unsigned int w, unsigned int h, unsigned int stride, unsigned char *dst);
+
+#endif
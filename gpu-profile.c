@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <GL/gl.h>
+#include <SDL/SDL.h>
+#include "pixel-kernels.h"
+#include "gpu-profile.h"
+#include "clock-sync.h"
+
+#define PROFILE_VERSION 1           /* Bump when probing changes, to ignore old profiles */
+#define PROBE_MS 150                /* Time spent uploading each tile size */
+#define CLOSE_ENOUGH 0.9            /* Bigger tiles win unless this much slower */
+#define PATH_LEN 600
+
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#define GL_STREAM_DRAW 0x88E0
+#define GL_WRITE_ONLY 0x88B9
+#endif
+
+static const unsigned int probe_sizes[NUM_PROBE_SIZES] = { 256, 512, 1024, 2048 };
+
+/* Buffer objects aren't in GL 1.x headers, so we look them up */
+typedef void (*gen_buffers_fn)(GLsizei, GLuint *);
+typedef void (*bind_buffer_fn)(GLenum, GLuint);
+typedef void (*buffer_data_fn)(GLenum, ptrdiff_t, const void *, GLenum);
+typedef void *(*map_buffer_fn)(GLenum, GLenum);
+typedef GLboolean (*unmap_buffer_fn)(GLenum);
+
+static gen_buffers_fn gen_buffers;
+static bind_buffer_fn bind_buffer;
+static buffer_data_fn buffer_data;
+static map_buffer_fn map_buffer;
+static unmap_buffer_fn unmap_buffer;
+static GLuint unpack_buffer = 0;
+
+/* Whether name is one of the space separated extensions, and not just the
+ * start of a longer one */
+static int has_extension(const char *extensions, const char *name) {
+    const char *p = extensions;
+    size_t len = strlen(name);
+
+    while (p && (p = strstr(p, name)) != NULL) {
+        if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0'))
+            return 1;
+        p += len;
+    }
+    return 0;
+}
+
+static int load_pbo_functions(void) {
+    gen_buffers = (gen_buffers_fn) SDL_GL_GetProcAddress("glGenBuffers");
+    bind_buffer = (bind_buffer_fn) SDL_GL_GetProcAddress("glBindBuffer");
+    buffer_data = (buffer_data_fn) SDL_GL_GetProcAddress("glBufferData");
+    map_buffer = (map_buffer_fn) SDL_GL_GetProcAddress("glMapBuffer");
+    unmap_buffer = (unmap_buffer_fn) SDL_GL_GetProcAddress("glUnmapBuffer");
+    return gen_buffers && bind_buffer && buffer_data && map_buffer && unmap_buffer;
+}
+
+/* Upload w by h pixels, whose rows are stride pixels long, to level 0 of the
+ * bound texture, by way of a pixel buffer object. The buffer is orphaned
+ * each time, so the driver needn't wait for the last upload to finish. */
+void gpu_upload_pbo(const unsigned char *pixels, unsigned int w, unsigned int h, unsigned int stride) {
+    size_t bytes = (size_t) w * h * 3;
+    unsigned char *mapped;
+
+    if (!unpack_buffer)
+        gen_buffers(1, &unpack_buffer);
+    bind_buffer(GL_PIXEL_UNPACK_BUFFER, unpack_buffer);
+    buffer_data(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+    mapped = (unsigned char *) map_buffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (!mapped) {
+        /* Do it the ordinary way */
+        bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, stride);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        return;
+    }
+    pixel_copy_tile(PIXEL_RGB8, pixels, stride, w, h, PIXEL_RGB8, mapped);
+    unmap_buffer(GL_PIXEL_UNPACK_BUFFER);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, (const GLvoid *) 0);
+    bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+/* Megabytes a second of size by size RGB uploads */
+static double time_uploads(unsigned int size, int pbo, const unsigned char *pixels) {
+    GLuint tex;
+    double start, elapsed;
+    int reps = 0;
+
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, size, size, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+    glFinish();
+
+    start = clock_now_ms();
+    do {
+        if (pbo)
+            gpu_upload_pbo(pixels, size, size, size);
+        else
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, size, size, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+        glFinish();
+        reps++;
+        elapsed = clock_now_ms() - start;
+    } while (elapsed < PROBE_MS);
+    glDeleteTextures(1, &tex);
+
+    return reps * (size * size * 3.0 / (1024 * 1024)) / (elapsed / 1000);
+}
+
+static void probe(gpu_profile *p, const char *extensions, int verbose) {
+    unsigned char *pixels;
+    double gl_version = atof(p->version), best = 0;
+    size_t i, bytes = (size_t) probe_sizes[NUM_PROBE_SIZES - 1] * probe_sizes[NUM_PROBE_SIZES - 1] * 3;
+    int s, best_s = 0;
+
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &p->max_texture_size);
+    p->npot = gl_version >= 2.0 || has_extension(extensions, "GL_ARB_texture_non_power_of_two");
+    p->mipmap_generation = gl_version >= 1.4 || has_extension(extensions, "GL_SGIS_generate_mipmap");
+    p->lod_bias = gl_version >= 1.4 || has_extension(extensions, "GL_EXT_texture_lod_bias");
+    p->pbo = (gl_version >= 2.1 || has_extension(extensions, "GL_ARB_pixel_buffer_object")) && load_pbo_functions();
+    p->texture_array = gl_version >= 3.0 || has_extension(extensions, "GL_EXT_texture_array");
+    p->compression = gl_version >= 1.3 || has_extension(extensions, "GL_ARB_texture_compression");
+
+    pixels = (unsigned char *) malloc(bytes);
+    if (!pixels) {
+        perror("Out of memory probing the GPU");
+        p->subtexsize = 1024;
+        return;
+    }
+    for (i = 0; i < bytes; i++)
+        pixels[i] = i * 2654435761U >> 24;
+
+    /* The biggest tile that uploads about as fast as the fastest, since
+     * fewer tiles are fewer draw calls */
+    for (s = 0; s < NUM_PROBE_SIZES && probe_sizes[s] <= (unsigned int) p->max_texture_size; s++) {
+        p->upload_mb_s[s] = time_uploads(probe_sizes[s], 0, pixels);
+        if (verbose)
+            fprintf(stderr, "GPU probe: %u x %u uploads at %0.0f MB/s\n", probe_sizes[s], probe_sizes[s], p->upload_mb_s[s]);
+        if (p->upload_mb_s[s] > best)
+            best = p->upload_mb_s[s];
+    }
+    for (s = 0; s < NUM_PROBE_SIZES; s++) {
+        if (p->upload_mb_s[s] >= best * CLOSE_ENOUGH)
+            best_s = s;
+    }
+    p->subtexsize = probe_sizes[best_s];
+
+    /* If the biggest uploads are slower by the byte than the chosen size,
+     * whole image textures would be slower still */
+    p->forcesubtex = !p->npot || (best_s < NUM_PROBE_SIZES - 1 &&
+                                  p->upload_mb_s[NUM_PROBE_SIZES - 1] < p->upload_mb_s[best_s] * CLOSE_ENOUGH);
+
+    if (p->pbo) {
+        p->pbo_mb_s = time_uploads(p->subtexsize, 1, pixels);
+        p->use_pbo = p->pbo_mb_s > p->upload_mb_s[best_s] / CLOSE_ENOUGH;
+        if (verbose)
+            fprintf(stderr, "GPU probe: %u x %u uploads through a pixel buffer object at %0.0f MB/s\n",
+                p->subtexsize, p->subtexsize, p->pbo_mb_s);
+    }
+    free(pixels);
+}
+
+/* $XDG_CACHE_HOME/lg-pano/gpu-<hash>, made if need be, or 0 if there's
+ * nowhere to put it */
+static int profile_path(const gpu_profile *p, char *path, size_t len) {
+    const char *base = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    char dir[512];
+    unsigned long hash = 2166136261UL;
+    const char *parts[3];
+    const char *c;
+    int i;
+
+    if (base && *base)
+        snprintf(dir, sizeof(dir), "%s/lg-pano", base);
+    else if (home && *home)
+        snprintf(dir, sizeof(dir), "%s/.cache/lg-pano", home);
+    else
+        return 0;
+    if (!base || !*base) {
+        /* ~/.cache itself may not exist yet */
+        snprintf(path, len, "%s/.cache", home);
+        mkdir(path, 0755);
+    }
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+        return 0;
+
+    parts[0] = p->vendor;
+    parts[1] = p->renderer;
+    parts[2] = p->version;
+    for (i = 0; i < 3; i++) {
+        for (c = parts[i]; *c; c++)
+            hash = ((hash ^ (unsigned char) *c) * 16777619UL) & 0xffffffffUL;
+        hash = ((hash ^ '|') * 16777619UL) & 0xffffffffUL;
+    }
+    snprintf(path, len, "%s/gpu-%08lx", dir, hash);
+    return 1;
+}
+
+static void strip_newline(char *s) {
+    s[strcspn(s, "\n")] = '\0';
+}
+
+/* Read a profile made earlier for this same GPU and driver */
+static int load_profile(gpu_profile *p, const char *path) {
+    char line[512], key[64], *value;
+    int version = 0, matches = 0, s;
+    unsigned int size;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        strip_newline(line);
+        if (line[0] == '#' || sscanf(line, "%63s", key) != 1)
+            continue;
+        value = line + strlen(key);
+        while (*value == ' ')
+            value++;
+
+        if (!strcmp(key, "profile_version"))
+            version = atoi(value);
+        else if (!strcmp(key, "vendor"))
+            matches += !strcmp(value, p->vendor);
+        else if (!strcmp(key, "renderer"))
+            matches += !strcmp(value, p->renderer);
+        else if (!strcmp(key, "version"))
+            matches += !strcmp(value, p->version);
+        else if (!strcmp(key, "max_texture_size"))
+            p->max_texture_size = atoi(value);
+        else if (!strcmp(key, "npot"))
+            p->npot = atoi(value);
+        else if (!strcmp(key, "mipmap_generation"))
+            p->mipmap_generation = atoi(value);
+        else if (!strcmp(key, "lod_bias"))
+            p->lod_bias = atoi(value);
+        else if (!strcmp(key, "pbo"))
+            p->pbo = atoi(value);
+        else if (!strcmp(key, "texture_array"))
+            p->texture_array = atoi(value);
+        else if (!strcmp(key, "compression"))
+            p->compression = atoi(value);
+        else if (!strcmp(key, "pbo_mb_s"))
+            p->pbo_mb_s = atof(value);
+        else if (!strcmp(key, "subtexsize"))
+            p->subtexsize = atoi(value);
+        else if (!strcmp(key, "forcesubtex"))
+            p->forcesubtex = atoi(value);
+        else if (!strcmp(key, "use_pbo"))
+            p->use_pbo = atoi(value);
+        else if (sscanf(key, "upload_mb_s_%u", &size) == 1) {
+            for (s = 0; s < NUM_PROBE_SIZES; s++) {
+                if (probe_sizes[s] == size)
+                    p->upload_mb_s[s] = atof(value);
+            }
+        }
+    }
+    fclose(f);
+
+    /* Buffer object functions have to be looked up again, every run */
+    if (p->use_pbo && !load_pbo_functions())
+        p->use_pbo = 0;
+    return version == PROFILE_VERSION && matches == 3 && p->subtexsize > 0;
+}
+
+static void save_profile(const gpu_profile *p, const char *path) {
+    char tmp[PATH_LEN + 4];
+    FILE *f;
+
+    /* A truncated name would have rename() replace the wrong file */
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+        fprintf(stderr, "GPU profile path %s is too long; not saving it\n", path);
+        return;
+    }
+    f = fopen(tmp, "w");
+    if (!f) {
+        perror("Couldn't save GPU profile");
+        return;
+    }
+    fprintf(f, "# lg-pano GPU profile; delete it, or run with --gpuprobe=force, to probe again\n");
+    fprintf(f, "profile_version %d\n", PROFILE_VERSION);
+    gpu_profile_print(p, f);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        perror("Couldn't save GPU profile");
+        remove(tmp);
+    }
+}
+
+/* Fill in p for the current GL context, from the cache if we've probed this
+ * GPU and driver before, or by probing it now. Returns 1 if it was cached. */
+int gpu_profile_get(gpu_profile *p, int reprobe, int verbose) {
+    const char *s, *extensions;
+    char path[PATH_LEN];
+    int have_path;
+
+    memset(p, 0, sizeof(*p));
+    s = (const char *) glGetString(GL_VENDOR);
+    strncpy(p->vendor, s ? s : "unknown", sizeof(p->vendor) - 1);
+    s = (const char *) glGetString(GL_RENDERER);
+    strncpy(p->renderer, s ? s : "unknown", sizeof(p->renderer) - 1);
+    s = (const char *) glGetString(GL_VERSION);
+    strncpy(p->version, s ? s : "0", sizeof(p->version) - 1);
+
+    have_path = profile_path(p, path, sizeof(path));
+    if (have_path && !reprobe && load_profile(p, path)) {
+        if (verbose)
+            fprintf(stderr, "Using GPU profile %s\n", path);
+        return 1;
+    }
+
+    /* Start afresh, in case a stale profile left things behind */
+    memset(p->upload_mb_s, 0, sizeof(p->upload_mb_s));
+    p->pbo_mb_s = 0;
+    p->use_pbo = 0;
+    extensions = (const char *) glGetString(GL_EXTENSIONS);
+    if (verbose)
+        fprintf(stderr, "Probing %s %s, OpenGL %s\n", p->vendor, p->renderer, p->version);
+    probe(p, extensions ? extensions : "", verbose);
+    if (have_path)
+        save_profile(p, path);
+    return 0;
+}
+
+void gpu_profile_print(const gpu_profile *p, FILE *out) {
+    int s;
+
+    fprintf(out, "vendor %s\n", p->vendor);
+    fprintf(out, "renderer %s\n", p->renderer);
+    fprintf(out, "version %s\n", p->version);
+    fprintf(out, "max_texture_size %d\n", p->max_texture_size);
+    fprintf(out, "npot %d\n", p->npot);
+    fprintf(out, "mipmap_generation %d\n", p->mipmap_generation);
+    fprintf(out, "lod_bias %d\n", p->lod_bias);
+    fprintf(out, "pbo %d\n", p->pbo);
+    fprintf(out, "texture_array %d\n", p->texture_array);
+    fprintf(out, "compression %d\n", p->compression);
+    for (s = 0; s < NUM_PROBE_SIZES; s++)
+        fprintf(out, "upload_mb_s_%u %0.1f\n", probe_sizes[s], p->upload_mb_s[s]);
+    fprintf(out, "pbo_mb_s %0.1f\n", p->pbo_mb_s);
+    fprintf(out, "subtexsize %u\n", p->subtexsize);
+    fprintf(out, "forcesubtex %d\n", p->forcesubtex);
+    fprintf(out, "use_pbo %d\n", p->use_pbo);
+}
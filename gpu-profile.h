@@ -0,0 +1,37 @@
+#ifndef _gpu_profile_h_
+#define _gpu_profile_h_
+
+#include <stdio.h>
+
+/* What this GPU and driver can do, and how fast textures get onto it, so
+ * lg-pano can choose its subtexture size and upload path itself. Probing
+ * means timing uploads for a second or so, so the result is kept on disk,
+ * under $XDG_CACHE_HOME/lg-pano (~/.cache/lg-pano by default), one file per
+ * vendor, renderer and driver version, and later runs on the same setup
+ * just read it. Needs a current GL context. */
+
+#define NUM_PROBE_SIZES 4           /* Square tiles of 256, 512, 1024 and 2048 */
+
+#define GPU_PROBE_OFF 0
+#define GPU_PROBE_CACHED 1          /* Probe only if there's no profile on disk */
+#define GPU_PROBE_FORCE 2
+
+typedef struct {
+    char vendor[128], renderer[128], version[128];
+    int max_texture_size;
+    int npot;                       /* Textures needn't be powers of two */
+    int mipmap_generation, lod_bias;
+    int pbo, texture_array, compression;
+    double upload_mb_s[NUM_PROBE_SIZES];    /* Plain glTexImage2D, per tile size */
+    double pbo_mb_s;                /* Through a pixel buffer object, at subtexsize */
+
+    /* What we chose */
+    unsigned int subtexsize;
+    int forcesubtex, use_pbo;
+} gpu_profile;
+
+int gpu_profile_get(gpu_profile *, int reprobe, int verbose);
+void gpu_profile_print(const gpu_profile *, FILE *);
+void gpu_upload_pbo(const unsigned char *pixels, unsigned int w, unsigned int h, unsigned int stride);
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <GL/gl.h>
+#include "hud.h"
+#include "clock-sync.h"
+
+#define HISTORY 240                 /* Frames in the graph */
+#define GRAPH_MS 50.0               /* Frame time at the top of the graph */
+#define GRAPH_H 100                 /* Pixels */
+#define MARGIN 10
+#define GLYPH_W 10                  /* The 5x7 font, doubled, plus a pixel between */
+#define GLYPH_H 14
+#define ADVANCE 12
+#define LINE_H 20
+#define NUM_LINES 4
+
+/* 5x7 glyphs, top row first, leftmost pixel in bit 4. Anything not here is
+ * drawn as a space, and lower case as upper case. */
+static const char glyph_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ.,:/()%-+=<>";
+static const unsigned char glyphs[][7] = {
+    { 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E },   /* 0 */
+    { 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E },
+    { 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F },
+    { 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E },
+    { 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 },
+    { 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E },
+    { 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E },
+    { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },
+    { 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E },
+    { 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C },   /* 9 */
+    { 0x0E, 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11 },   /* A */
+    { 0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E },
+    { 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E },
+    { 0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C },
+    { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F },
+    { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10 },
+    { 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F },
+    { 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 },
+    { 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E },
+    { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C },
+    { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 },
+    { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F },
+    { 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11 },
+    { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 },
+    { 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E },
+    { 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10 },
+    { 0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D },
+    { 0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11 },
+    { 0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E },
+    { 0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E },
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04 },
+    { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A },
+    { 0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11 },
+    { 0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04 },
+    { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F },   /* Z */
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C },   /* . */
+    { 0x00, 0x00, 0x00, 0x00, 0x0C, 0x04, 0x08 },   /* , */
+    { 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00 },   /* : */
+    { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 },   /* / */
+    { 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 },   /* ( */
+    { 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 },   /* ) */
+    { 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 },   /* % */
+    { 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 },   /* - */
+    { 0x00, 0x04, 0x04, 0x1F, 0x04, 0x04, 0x00 },   /* + */
+    { 0x00, 0x00, 0x1F, 0x00, 0x1F, 0x00, 0x00 },   /* = */
+    { 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 },   /* < */
+    { 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 }    /* > */
+};
+
+static GLuint font_base = 0;
+
+static float frame_ms[HISTORY];
+static double frame_end[HISTORY];   /* When each frame finished */
+static int next_frame = 0, num_frames = 0;
+
+/* Packet rate, worked out about once a second */
+static double rate_ms = 0, packet_rate = 0;
+static unsigned long rate_packets = 0;
+
+/* One display list per character, each a doubled glyph drawn with
+ * glBitmap(), which moves the raster position along to the next */
+static void build_font(void) {
+    unsigned char bitmap[GLYPH_H][2];
+    const char *p;
+    int c, row, col, bit;
+
+    font_base = glGenLists(128);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    for (c = 0; c < 128; c++) {
+        memset(bitmap, 0, sizeof(bitmap));
+        p = c ? strchr(glyph_chars, toupper(c)) : NULL;
+        if (p) {
+            for (row = 0; row < 7; row++) {
+                for (col = 0; col < 5; col++) {
+                    if (!(glyphs[p - glyph_chars][row] & (0x10 >> col)))
+                        continue;
+                    /* glBitmap() wants the bottom row first */
+                    for (bit = col * 2; bit < col * 2 + 2; bit++) {
+                        bitmap[GLYPH_H - 1 - row * 2][bit / 8] |= 0x80 >> (bit % 8);
+                        bitmap[GLYPH_H - 2 - row * 2][bit / 8] |= 0x80 >> (bit % 8);
+                    }
+                }
+            }
+        }
+        glNewList(font_base + c, GL_COMPILE);
+        glBitmap(GLYPH_W, GLYPH_H, 0, 0, ADVANCE, 0, &bitmap[0][0]);
+        glEndList();
+    }
+}
+
+static void draw_text(float x, float y, const char *text) {
+    glRasterPos3f(x, y, 0);
+    glListBase(font_base);
+    glCallLists(strlen(text), GL_UNSIGNED_BYTE, text);
+}
+
+/* Note how long a frame took to draw, swap included */
+void hud_frame(double ms) {
+    frame_ms[next_frame] = ms;
+    frame_end[next_frame] = clock_now_ms();
+    next_frame = (next_frame + 1) % HISTORY;
+    if (num_frames < HISTORY)
+        num_frames++;
+}
+
+void hud_draw(const hud_stats *s, int screen_width, int screen_height) {
+    char lines[NUM_LINES][128];
+    double now = clock_now_ms(), worst = 0, total = 0;
+    float x, y, width = HISTORY * 2, height = GRAPH_H + NUM_LINES * LINE_H + MARGIN;
+    unsigned long lookups = s->cache_hits + s->cache_misses;
+    int i, f, fps = 0;
+
+    if (!font_base)
+        build_font();
+
+    for (i = 0; i < num_frames; i++) {
+        f = (next_frame - num_frames + i + HISTORY) % HISTORY;
+        if (now - frame_end[f] <= 1000)
+            fps++;
+        if (frame_ms[f] > worst)
+            worst = frame_ms[f];
+        total += frame_ms[f];
+    }
+    if (now - rate_ms >= 1000) {
+        if (rate_ms)
+            packet_rate = (s->packets - rate_packets) * 1000.0 / (now - rate_ms);
+        rate_ms = now;
+        rate_packets = s->packets;
+    }
+
+    snprintf(lines[0], sizeof(lines[0]), "%d fps  frame %0.1f ms, worst %0.1f",
+        fps, num_frames ? total / num_frames : 0, worst);
+    snprintf(lines[1], sizeof(lines[1]), "image %d/%d  load %0.0f ms: decode %0.0f, upload %0.0f",
+        s->image_index + 1, s->num_images, s->load_ms, s->decode_ms, s->upload_ms);
+    snprintf(lines[2], sizeof(lines[2]), "%d textures  %0.1f/%0.0f MB  cache hits %lu/%lu (%0.0f%%)",
+        s->textures, s->resident_bytes / 1048576.0, s->budget_bytes / 1048576.0,
+        s->cache_hits, lookups, lookups ? s->cache_hits * 100.0 / lookups : 0);
+    snprintf(lines[3], sizeof(lines[3]), "%0.1f sync packets/s %s", packet_rate, s->packet_verb);
+    for (i = 0; i < NUM_LINES; i++) {
+        if (strlen(lines[i]) * ADVANCE > width)
+            width = strlen(lines[i]) * ADVANCE;
+    }
+
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_LINE_BIT | GL_COLOR_BUFFER_BIT);
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    /* Backdrop, and lines at 60 and 30 frames a second */
+    x = MARGIN;
+    y = MARGIN;
+    glColor4f(0, 0, 0, 0.6);
+    glBegin(GL_QUADS);
+        glVertex3f(x - MARGIN / 2, y - MARGIN / 2, 0);
+        glVertex3f(x + width + MARGIN / 2, y - MARGIN / 2, 0);
+        glVertex3f(x + width + MARGIN / 2, y + height, 0);
+        glVertex3f(x - MARGIN / 2, y + height, 0);
+    glEnd();
+    glColor4f(0.5, 0.5, 0.5, 1);
+    glBegin(GL_LINES);
+        glVertex3f(x, y + GRAPH_H * (1000 / 60.0) / GRAPH_MS, 0);
+        glVertex3f(x + HISTORY * 2, y + GRAPH_H * (1000 / 60.0) / GRAPH_MS, 0);
+        glVertex3f(x, y + GRAPH_H * (1000 / 30.0) / GRAPH_MS, 0);
+        glVertex3f(x + HISTORY * 2, y + GRAPH_H * (1000 / 30.0) / GRAPH_MS, 0);
+    glEnd();
+
+    /* Oldest frame on the left */
+    glColor4f(0.2, 1, 0.2, 1);
+    glBegin(GL_LINE_STRIP);
+    for (i = 0; i < num_frames; i++) {
+        f = (next_frame - num_frames + i + HISTORY) % HISTORY;
+        glVertex3f(x + (HISTORY - num_frames + i) * 2,
+                   y + GRAPH_H * (frame_ms[f] < GRAPH_MS ? frame_ms[f] : GRAPH_MS) / GRAPH_MS, 0);
+    }
+    glEnd();
+
+    glColor4f(1, 1, 1, 1);
+    for (i = 0; i < NUM_LINES; i++)
+        draw_text(x, y + GRAPH_H + MARGIN + (NUM_LINES - 1 - i) * LINE_H, lines[i]);
+    glPopAttrib();
+}
@@ -0,0 +1,25 @@
+#ifndef _hud_h_
+#define _hud_h_
+
+#include <stddef.h>
+
+/* A small overlay in the bottom left corner of the screen, with a graph of
+ * the last few seconds of frame times and a few lines of numbers, for
+ * finding out why a screen stutters without having to turn on logging.
+ * Text is drawn with a built-in bitmap font, from display lists, so the
+ * whole thing is a handful of GL calls a frame. Main thread only. */
+
+typedef struct {
+    int image_index, num_images;
+    double load_ms, decode_ms, upload_ms;   /* The last image switch */
+    int textures;
+    size_t resident_bytes, budget_bytes;
+    unsigned long cache_hits, cache_misses; /* Switches to images already resident */
+    unsigned long packets;                  /* Sync packets so far */
+    const char *packet_verb;                /* "sent" or "received" */
+} hud_stats;
+
+void hud_frame(double ms);
+void hud_draw(const hud_stats *, int screen_width, int screen_height);
+
+#endif
@@ -0,0 +1,530 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include "wand/magick_wand.h"
+#include "tiff-reader.h"
+#include "image-reader.h"
+
+/* libjpeg-turbo can crop and skip without doing the IDCT for the parts we
+ * throw away. Plain libjpeg has to decode whole rows. */
+#ifdef LIBJPEG_TURBO_VERSION_NUMBER
+#define HAVE_JPEG_CROP 1
+#endif
+
+struct jpeg_priv {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    jmp_buf env;
+    FILE *file;
+    unsigned char *row;         /* Full width row, when cropping by hand */
+    unsigned int scale_denom;
+
+    /* Reading raw 4:2:0 planes: the last iMCU row, 16 luma rows and 8 of
+     * each chroma, and how much of it has been handed out */
+    int planar;
+    JSAMPLE *mcu[3];
+    unsigned int mcu_stride[3];
+    unsigned int mcu_rows, mcu_used, decoded;
+};
+
+struct tiff_priv {
+    tiff_file *tiff;
+    int level;                  /* Pyramid level we're reading */
+};
+
+static void jpeg_error(j_common_ptr cinfo) {
+    struct jpeg_priv *p = (struct jpeg_priv *) cinfo->client_data;
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(p->env, 1);
+}
+
+static int is_jpeg(FILE *f) {
+    unsigned char magic[3];
+    int ret;
+
+    ret = (fread(magic, 1, 3, f) == 3 && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF);
+    rewind(f);
+    return ret;
+}
+
+static int is_tiff(FILE *f) {
+    unsigned char magic[4];
+    int ret;
+
+    ret = (fread(magic, 1, 4, f) == 4 && tiff_is_tiff(magic));
+    rewind(f);
+    return ret;
+}
+
+/* Luma at twice the resolution of each chroma plane, both ways */
+static int is_420(struct jpeg_decompress_struct *cinfo) {
+    return cinfo->num_components == 3 && cinfo->jpeg_color_space == JCS_YCbCr &&
+        cinfo->comp_info[0].h_samp_factor == 2 && cinfo->comp_info[0].v_samp_factor == 2 &&
+        cinfo->comp_info[1].h_samp_factor == 1 && cinfo->comp_info[1].v_samp_factor == 1 &&
+        cinfo->comp_info[2].h_samp_factor == 1 && cinfo->comp_info[2].v_samp_factor == 1;
+}
+
+static int jpeg_start(image_reader *r) {
+    struct jpeg_priv *p = (struct jpeg_priv *) r->priv;
+    int c;
+
+    if (setjmp(p->env))
+        return 0;
+    jpeg_stdio_src(&p->cinfo, p->file);
+    jpeg_read_header(&p->cinfo, TRUE);
+    if (p->planar) {
+        if (!is_420(&p->cinfo))
+            return 0;
+        /* Skip upsampling and color conversion; the GL does those */
+        p->cinfo.raw_data_out = TRUE;
+        p->cinfo.out_color_space = JCS_YCbCr;
+        p->cinfo.do_fancy_upsampling = FALSE;
+        jpeg_start_decompress(&p->cinfo);
+        for (c = 0; c < 3; c++) {
+            p->mcu_stride[c] = p->cinfo.comp_info[c].width_in_blocks * DCTSIZE;
+            if (!p->mcu[c])
+                p->mcu[c] = (JSAMPLE *) malloc((size_t) p->mcu_stride[c] * (c ? DCTSIZE : 2 * DCTSIZE));
+            if (!p->mcu[c])
+                return 0;
+        }
+        p->mcu_rows = p->mcu_used = p->decoded = 0;
+        r->width = r->crop_width = p->cinfo.output_width;
+        r->height = p->cinfo.output_height;
+        r->crop_x = 0;
+        r->next_row = 0;
+        r->planar = 1;
+        return 1;
+    }
+    p->cinfo.out_color_space = JCS_RGB;
+    if (p->scale_denom > 1) {
+        /* Much quicker: the IDCT only produces the pixels we keep */
+        p->cinfo.scale_num = 1;
+        p->cinfo.scale_denom = p->scale_denom;
+        p->cinfo.dct_method = JDCT_IFAST;
+        p->cinfo.do_fancy_upsampling = FALSE;
+    }
+    jpeg_start_decompress(&p->cinfo);
+
+    r->width = r->crop_width = p->cinfo.output_width;
+    r->height = p->cinfo.output_height;
+    r->crop_x = 0;
+    r->next_row = 0;
+    return 1;
+}
+
+static int jpeg_open(image_reader *r, FILE *f, unsigned int scale_denom, int planar) {
+    struct jpeg_priv *p;
+
+    p = (struct jpeg_priv *) calloc(1, sizeof(struct jpeg_priv));
+    if (!p) {
+        perror("Couldn't allocate JPEG decoder");
+        return 0;
+    }
+    p->file = f;
+    p->scale_denom = scale_denom;
+    p->planar = planar;
+    p->cinfo.err = jpeg_std_error(&p->jerr);
+    p->jerr.error_exit = jpeg_error;
+    p->cinfo.client_data = p;
+    jpeg_create_decompress(&p->cinfo);
+    r->priv = p;
+    if (!jpeg_start(r)) {
+        jpeg_destroy_decompress(&p->cinfo);
+        free(p->mcu[0]);
+        free(p->mcu[1]);
+        free(p->mcu[2]);
+        free(p);
+        r->priv = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+static int jpeg_rewind(image_reader *r) {
+    struct jpeg_priv *p = (struct jpeg_priv *) r->priv;
+
+    jpeg_abort_decompress(&p->cinfo);
+    free(p->row);
+    p->row = NULL;
+    rewind(p->file);
+    return jpeg_start(r);
+}
+
+static void jpeg_crop(image_reader *r, unsigned int x, unsigned int w) {
+    struct jpeg_priv *p = (struct jpeg_priv *) r->priv;
+#ifdef HAVE_JPEG_CROP
+    JDIMENSION xoffset = x, width = w;
+
+    if (setjmp(p->env) == 0) {
+        jpeg_crop_scanline(&p->cinfo, &xoffset, &width);
+        r->crop_x = xoffset;
+        r->crop_width = width;
+        return;
+    }
+#endif
+    p->row = (unsigned char *) malloc((size_t) r->width * 3);
+    if (p->row) {
+        r->crop_x = x;
+        r->crop_width = w;
+    }
+}
+
+static unsigned int jpeg_skip_rows(image_reader *r, unsigned int nrows) {
+    struct jpeg_priv *p = (struct jpeg_priv *) r->priv;
+    volatile unsigned int done = 0;
+
+    if (setjmp(p->env))
+        return done;
+#ifdef HAVE_JPEG_CROP
+    done = jpeg_skip_scanlines(&p->cinfo, nrows);
+#else
+    JSAMPROW row = p->row;
+    if (!row)
+        row = (unsigned char *) malloc((size_t) r->width * 3);
+    while (row && done < nrows && p->cinfo.output_scanline < p->cinfo.output_height)
+        done += jpeg_read_scanlines(&p->cinfo, &row, 1);
+    if (row != p->row)
+        free(row);
+#endif
+    return done;
+}
+
+static unsigned int jpeg_read_rows(image_reader *r, unsigned char *buf, unsigned int nrows) {
+    struct jpeg_priv *p = (struct jpeg_priv *) r->priv;
+    JSAMPROW rows[16];
+    volatile unsigned int done = 0;
+    unsigned int i, want;
+
+    if (setjmp(p->env))
+        return done;
+
+    while (done < nrows && p->cinfo.output_scanline < p->cinfo.output_height) {
+        if (p->row) {
+            /* Cropping by hand: read a full row, and keep part of it */
+            rows[0] = p->row;
+            if (jpeg_read_scanlines(&p->cinfo, rows, 1) != 1)
+                break;
+            memcpy(buf + (size_t) done * r->crop_width * 3, p->row + r->crop_x * 3, (size_t) r->crop_width * 3);
+            done++;
+            continue;
+        }
+        want = nrows - done;
+        if (want > 16)
+            want = 16;
+        for (i = 0; i < want; i++)
+            rows[i] = buf + (size_t) (done + i) * r->crop_width * 3;
+        done += jpeg_read_scanlines(&p->cinfo, rows, want);
+    }
+    return done;
+}
+
+/* Hand out up to nrows rows of each plane, decoding another iMCU row
+ * whenever the last one's used up */
+static unsigned int jpeg_read_planes(image_reader *r, unsigned char *y, unsigned char *cb, unsigned char *cr,
+                                     unsigned int nrows) {
+    struct jpeg_priv *p = (struct jpeg_priv *) r->priv;
+    JSAMPROW yrows[2 * DCTSIZE], cbrows[DCTSIZE], crrows[DCTSIZE];
+    JSAMPARRAY planes[3];
+    volatile unsigned int done = 0;
+    unsigned int i, n, got, row, g, cw = (r->width + 1) / 2;
+
+    if (setjmp(p->env))
+        return done;
+
+    planes[0] = yrows;
+    planes[1] = cbrows;
+    planes[2] = crrows;
+    while (done < nrows) {
+        if (p->mcu_used == p->mcu_rows) {
+            if (p->cinfo.output_scanline >= p->cinfo.output_height)
+                break;
+            for (i = 0; i < 2 * DCTSIZE; i++)
+                yrows[i] = p->mcu[0] + (size_t) i * p->mcu_stride[0];
+            for (i = 0; i < DCTSIZE; i++) {
+                cbrows[i] = p->mcu[1] + (size_t) i * p->mcu_stride[1];
+                crrows[i] = p->mcu[2] + (size_t) i * p->mcu_stride[2];
+            }
+            got = jpeg_read_raw_data(&p->cinfo, planes, 2 * DCTSIZE);
+            if (got == 0)
+                break;
+            /* The last iMCU row is padded out past the bottom */
+            if (got > r->height - p->decoded)
+                got = r->height - p->decoded;
+            p->decoded += got;
+            p->mcu_rows = got;
+            p->mcu_used = 0;
+        }
+        n = p->mcu_rows - p->mcu_used;
+        if (n > nrows - done)
+            n = nrows - done;
+        for (i = 0; i < n; i++) {
+            row = p->mcu_used + i;
+            g = r->next_row + done + i;
+            memcpy(y + (size_t) (done + i) * r->width, p->mcu[0] + (size_t) row * p->mcu_stride[0], r->width);
+            /* Each chroma row goes with an even row and the odd one after
+             * it; a read starting on an odd row gets the one before too */
+            if (g % 2 == 0 || done + i == 0) {
+                memcpy(cb + (size_t) (g / 2 - r->next_row / 2) * cw, p->mcu[1] + (size_t) (row / 2) * p->mcu_stride[1], cw);
+                memcpy(cr + (size_t) (g / 2 - r->next_row / 2) * cw, p->mcu[2] + (size_t) (row / 2) * p->mcu_stride[2], cw);
+            }
+        }
+        p->mcu_used += n;
+        done += n;
+    }
+    return done;
+}
+
+static void jpeg_close(image_reader *r) {
+    struct jpeg_priv *p = (struct jpeg_priv *) r->priv;
+
+    /* jpeg_finish_decompress() would insist on reading every remaining
+     * scanline, so just throw the decoder away */
+    jpeg_destroy_decompress(&p->cinfo);
+    fclose(p->file);
+    free(p->row);
+    free(p->mcu[0]);
+    free(p->mcu[1]);
+    free(p->mcu[2]);
+    free(p);
+}
+
+/* Open a TIFF ourselves, at 1/denom of its full size, which it has to have
+ * as a pyramid level unless denom is 1 */
+static int tiff_open_reader(image_reader *r, const char *filename, unsigned int denom) {
+    struct tiff_priv *p;
+    unsigned int w, h;
+
+    p = (struct tiff_priv *) calloc(1, sizeof(struct tiff_priv));
+    if (!p) {
+        perror("Couldn't allocate TIFF reader");
+        return 0;
+    }
+    p->tiff = tiff_open(filename);
+    if (!p->tiff || (p->level = tiff_level(p->tiff, denom, &w, &h)) == -1) {
+        if (p->tiff)
+            tiff_close(p->tiff);
+        free(p);
+        return 0;
+    }
+    r->type = READER_TIFF;
+    r->width = r->crop_width = w;
+    r->height = h;
+    r->priv = p;
+    return 1;
+}
+
+static unsigned int tiff_read_rows(image_reader *r, unsigned char *buf, unsigned int nrows) {
+    struct tiff_priv *p = (struct tiff_priv *) r->priv;
+
+    if (nrows > r->height - r->next_row)
+        nrows = r->height - r->next_row;
+    if (!tiff_read(p->tiff, p->level, r->crop_x, r->next_row, r->crop_width, nrows, buf))
+        return 0;
+    return nrows;
+}
+
+static void tiff_close_reader(image_reader *r) {
+    struct tiff_priv *p = (struct tiff_priv *) r->priv;
+
+    tiff_close(p->tiff);
+    free(p);
+}
+
+static int wand_open(image_reader *r, const char *filename) {
+    MagickWand *wand;
+
+    wand = NewMagickWand();
+    if (!MagickReadImage(wand, filename)) {
+        fprintf(stderr, "Couldn't read image %s\n", filename);
+        DestroyMagickWand(wand);
+        return 0;
+    }
+    r->width = r->crop_width = MagickGetImageWidth(wand);
+    r->height = MagickGetImageHeight(wand);
+    r->priv = wand;
+    return 1;
+}
+
+static unsigned int wand_read_rows(image_reader *r, unsigned char *buf, unsigned int nrows) {
+    if (nrows > r->height - r->next_row)
+        nrows = r->height - r->next_row;
+    MagickExportImagePixels((MagickWand *) r->priv, r->crop_x, r->next_row, r->crop_width, nrows, "RGB", CharPixel, buf);
+    return nrows;
+}
+
+int image_reader_open(image_reader *r, const char *filename) {
+    FILE *f;
+
+    memset(r, 0, sizeof(image_reader));
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror("Couldn't open image file");
+        return 0;
+    }
+    if (is_jpeg(f)) {
+        r->type = READER_JPEG;
+        if (jpeg_open(r, f, 1, 0))
+            return 1;
+        fprintf(stderr, "libjpeg couldn't read %s; falling back to GraphicsMagick\n", filename);
+    }
+    else if (is_tiff(f)) {
+        fclose(f);
+        if (tiff_open_reader(r, filename, 1))
+            return 1;
+        fprintf(stderr, "Can't read TIFF %s a tile at a time; falling back to GraphicsMagick\n", filename);
+        r->type = READER_WAND;
+        return wand_open(r, filename);
+    }
+    fclose(f);
+    r->type = READER_WAND;
+    return wand_open(r, filename);
+}
+
+/* Open a JPEG to be decoded at 1/denom of its size, in each direction;
+ * libjpeg can do 1/2, 1/4 and 1/8. A pyramidal TIFF can be read at any
+ * size it keeps a level for. Other formats can't be read any quicker at a
+ * reduced size, so this fails for them without reading anything. */
+int image_reader_open_scaled(image_reader *r, const char *filename, unsigned int denom) {
+    FILE *f;
+
+    memset(r, 0, sizeof(image_reader));
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror("Couldn't open image file");
+        return 0;
+    }
+    r->type = READER_JPEG;
+    if (is_jpeg(f) && jpeg_open(r, f, denom, 0))
+        return 1;
+    if (is_tiff(f)) {
+        fclose(f);
+        return tiff_open_reader(r, filename, denom);
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Open a 4:2:0 JPEG to be read as its decoded planes, with no upsampling or
+ * color conversion. Fails, without complaint, for anything else, which can
+ * still be read as RGB. Planar readers can't crop or skip. */
+int image_reader_open_planar(image_reader *r, const char *filename) {
+    FILE *f;
+
+    memset(r, 0, sizeof(image_reader));
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror("Couldn't open image file");
+        return 0;
+    }
+    r->type = READER_JPEG;
+    if (is_jpeg(f) && jpeg_open(r, f, 1, 1))
+        return 1;
+    fclose(f);
+    return 0;
+}
+
+/* Go back to the top of the image, with no crop. JPEGs get decoded again
+ * from the start; GraphicsMagick already has the whole image, and TIFF
+ * tiles can be read in any order. */
+int image_reader_rewind(image_reader *r) {
+    if (r->type == READER_JPEG)
+        return jpeg_rewind(r);
+    r->next_row = 0;
+    r->crop_x = 0;
+    r->crop_width = r->width;
+    return 1;
+}
+
+/* Switch to the level of a pyramidal TIFF that's 1/denom of the full
+ * image's size, each way, and go back to its top, with no crop. Returns 0,
+ * changing nothing, if there isn't one. Every reader opened at full size
+ * has denom 1, so that's the same as image_reader_rewind(). */
+int image_reader_select_level(image_reader *r, unsigned int denom) {
+    struct tiff_priv *p = (struct tiff_priv *) r->priv;
+    unsigned int w, h;
+    int level;
+
+    if (r->type != READER_TIFF)
+        return denom == 1 && image_reader_rewind(r);
+    level = tiff_level(p->tiff, denom, &w, &h);
+    if (level == -1)
+        return 0;
+    p->level = level;
+    r->width = r->crop_width = w;
+    r->height = h;
+    r->crop_x = 0;
+    r->next_row = 0;
+    return 1;
+}
+
+/* Only return columns x through x + w - 1 (or a few more) from here on. Must
+ * come before any rows are read or skipped. */
+void image_reader_crop(image_reader *r, unsigned int x, unsigned int w) {
+    if (x >= r->width)
+        return;
+    if (x + w > r->width)
+        w = r->width - x;
+    if (r->type == READER_JPEG) {
+        jpeg_crop(r, x, w);
+    }
+    else {
+        r->crop_x = x;
+        r->crop_width = w;
+    }
+}
+
+unsigned int image_reader_skip_rows(image_reader *r, unsigned int nrows) {
+    unsigned int n;
+
+    if (nrows > r->height - r->next_row)
+        nrows = r->height - r->next_row;
+    if (r->type == READER_JPEG)
+        n = jpeg_skip_rows(r, nrows);
+    else
+        n = nrows;
+    r->next_row += n;
+    return n;
+}
+
+/* Reads up to nrows rows into buf, which must hold nrows * crop_width * 3
+ * bytes. Returns the number of rows actually read. */
+unsigned int image_reader_read_rows(image_reader *r, unsigned char *buf, unsigned int nrows) {
+    unsigned int n;
+
+    if (r->type == READER_JPEG)
+        n = jpeg_read_rows(r, buf, nrows);
+    else if (r->type == READER_TIFF)
+        n = tiff_read_rows(r, buf, nrows);
+    else
+        n = wand_read_rows(r, buf, nrows);
+    r->next_row += n;
+    return n;
+}
+
+/* Reads up to nrows rows of luma into y, width bytes each, and the chroma
+ * rows that go with them into cb and cr, (width + 1) / 2 bytes each: rows
+ * next_row / 2 through (next_row + nrows - 1) / 2 of the chroma planes.
+ * Returns the number of luma rows read. */
+unsigned int image_reader_read_planes(image_reader *r, unsigned char *y, unsigned char *cb, unsigned char *cr,
+                                      unsigned int nrows) {
+    unsigned int n;
+
+    n = jpeg_read_planes(r, y, cb, cr, nrows);
+    r->next_row += n;
+    return n;
+}
+
+void image_reader_close(image_reader *r) {
+    if (!r->priv)
+        return;
+    if (r->type == READER_JPEG)
+        jpeg_close(r);
+    else if (r->type == READER_TIFF)
+        tiff_close_reader(r);
+    else
+        DestroyMagickWand((MagickWand *) r->priv);
+    r->priv = NULL;
+}
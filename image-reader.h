@@ -0,0 +1,47 @@
+#ifndef _image_reader_h_
+#define _image_reader_h_
+
+/* Reads an image top to bottom, a strip of scanlines at a time, as packed
+ * 8-bit RGB. JPEG files are decoded incrementally with libjpeg, so only the
+ * rows asked for are ever held in memory. Tiled and stripped TIFFs are
+ * decoded by tiff-reader a tile at a time, so rows skipped and columns
+ * cropped away are never decoded at all. Anything else is handed to
+ * GraphicsMagick, which has to read the whole image first.
+ *
+ * Reads can be limited to a band of columns with image_reader_crop(), and
+ * rows above the part we want skipped with image_reader_skip_rows(). The
+ * crop may start a little left of, and be a little wider than, what was
+ * asked for, because libjpeg can only crop on iMCU boundaries.
+ *
+ * 4:2:0 JPEGs can also be read as their luma and half size chroma planes,
+ * as libjpeg decodes them, for the GL to convert to RGB.
+ *
+ * Pyramidal TIFFs can switch to one of their reduced resolution levels
+ * with image_reader_select_level(), which costs nothing but the tiles read
+ * from it. */
+
+#define READER_JPEG 0
+#define READER_WAND 1
+#define READER_TIFF 2
+
+typedef struct {
+    int type;
+    unsigned int width, height;
+    unsigned int crop_x, crop_width;    /* Columns each row read returns */
+    unsigned int next_row;              /* First row the next read will return */
+    int planar;                         /* Opened with image_reader_open_planar() */
+    void *priv;
+} image_reader;
+
+int image_reader_open(image_reader *, const char *);
+int image_reader_open_scaled(image_reader *, const char *, unsigned int);
+int image_reader_open_planar(image_reader *, const char *);
+int image_reader_rewind(image_reader *);
+int image_reader_select_level(image_reader *, unsigned int);
+void image_reader_crop(image_reader *, unsigned int, unsigned int);
+unsigned int image_reader_skip_rows(image_reader *, unsigned int);
+unsigned int image_reader_read_rows(image_reader *, unsigned char *, unsigned int);
+unsigned int image_reader_read_planes(image_reader *, unsigned char *, unsigned char *, unsigned char *, unsigned int);
+void image_reader_close(image_reader *);
+
+#endif
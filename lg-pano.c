@@ -1,6 +1,5 @@
 /* TODO:
  *      -- Constrain movement
- *      -- Sort image files found in directories
  */
 
 /* #include <freeglut.h> */
@@ -11,7 +10,6 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
-#include <dirent.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -20,9 +18,46 @@
 #include <poll.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
-#include "wand/magick_wand.h"
+#include <sys/resource.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include "read-event.h"
+#include "image-reader.h"
+#include "texture-cache.h"
+#include "pixel-kernels.h"
+#include "catalog.h"
+#include "shared-image.h"
+#include "tile-server.h"
+#include "tile-client.h"
+#include "view-buffer.h"
+#include "prefetch.h"
+#include "telemetry.h"
+#include "clock-sync.h"
+#include "gpu-profile.h"
+#include "thumbnails.h"
+#include "hud.h"
+#include "ycbcr.h"
+#include "sync-protocol.h"
+#include "view-schedule.h"
+#include "strip-loader.h"
 #define ADDR_LEN 500
+#define MAX_LEVELS 16
+#ifndef GL_GENERATE_MIPMAP
+#define GL_GENERATE_MIPMAP 0x8191
+#endif
+#ifndef GL_TEXTURE_LOD_BIAS
+#define GL_TEXTURE_FILTER_CONTROL 0x8500
+#define GL_TEXTURE_LOD_BIAS 0x8501
+#endif
+#define SETTLE_MS 250       /* How long the view must be still to count as stopped */
+#define MAX_QUALITY_BIAS 4
+#define PREVIEW_MAX 2048    /* Largest preview texture we'll make */
+#define SLIDE_MARGIN_MS 500 /* How far ahead of its deadline a slide should be ready */
+#define STATE_RETRY_MS 500  /* How often a new slave asks for the view until it gets it */
+#define STATE_WAIT_MS 2000  /* How long it waits for it before loading an image anyway */
+#define HUD_REFRESH_MS 250  /* Redraw at least this often while the overlay is up */
+#define GRID_GAP 16         /* Pixels between thumbnails in the overview */
 
 const char VERSION[] = "0.1";
 const char *BUILD_DATE = __DATE__;
@@ -36,11 +71,57 @@ float
 int texnum = 0;
 int quit_main_loop = 0;     /* Flag to exit the program */
 int image_index = 0,        /* Which image are we supposed to be looking at now? */
-    num_images = 0,
     num_textures = 1,
-    subtextured = 0;
+    subtextured = 0,
+    subtex_cols = 0,        /* Grid of subtextures, when subtextured */
+    subtex_rows = 0;
 int something = 0;
-GLuint *texture_names;
+texture_set *current_set;     /* Textures for the image on screen */
+int gpu_mipmaps = 0;            /* Can the GL build mip chains for us? */
+int gl_lod_bias = 0;            /* Can we bias mip level selection? */
+gpu_profile gpu;                /* What the GPU probe found, with --gpuprobe */
+int subtexsize_given = 0;       /* Did the user pick a subtexsize, overriding the probe? */
+int hud = 0;                    /* Showing the performance overlay? */
+double hud_drawn_ms = 0;
+double upload_ms = 0,           /* Time spent in glTexImage2D, ever */
+       switch_load_ms = 0, switch_upload_ms = 0;   /* The last image switch */
+unsigned long cache_hits = 0, cache_misses = 0;
+unsigned long packets = 0;      /* Sync packets sent, or on slaves, received */
+int ycbcr_image = 0;            /* Image being loaded is uploaded as YCbCr planes */
+int overview = 0;               /* Showing the thumbnail grid instead of the image? */
+int overview_selected = 0,      /* Image under the cursor in the grid */
+    overview_top = 0;           /* Row of the grid at the top of the screen */
+
+/* With --frametarget, how many levels coarser than it should be we draw
+ * while the view is moving, and what we know about recent frames */
+int quality_bias = 0;
+double frame_ms = 0,            /* Running average draw time */
+       last_motion_ms = 0;
+
+/* With --progressive or --loaderthread, the image on screen may still be
+ * being loaded into its subtextures, a row at a time between frames, over a
+ * low resolution preview of the whole thing with --progressive */
+strip_loader *progressive_loader;   /* Set while there are rows to come */
+int progressive_row = -1;       /* Next row of subtextures to upload, or -1 */
+GLuint preview_texture = 0;
+
+/* For logging how long it takes an image to appear, and to be complete */
+double load_start_ms = 0;
+int first_pixels_logged = 1;
+unsigned char *black_subtexture;
+shared_image shared_current;    /* Decoded pixels, with --sharedecode */
+
+/* A subtextured image also gets coarser copies of itself, each half the size
+ * of the last, so zoomed out views draw a few coarse subtextures instead of
+ * all the full resolution ones. Level 0 is the full resolution image, and
+ * every level shares the one texture set. */
+struct level_s {
+    unsigned int width, height;
+    int cols, rows;
+    int first;              /* Index of its first subtexture in the set */
+} levels[MAX_LEVELS];
+int num_levels = 1;
+unsigned long frame_count = 0;
 float near_plane = 0.1;
 int screen_width, screen_height;
 float texture_aspect;
@@ -50,6 +131,53 @@ int *send_sockets;
 int num_sockets = 0;
 int has_slaves = 0;
 int redraw = 1;
+int recv_socket = -1;
+
+/* Sync packets are numbered so slaves can acknowledge them. On slaves, the
+ * newest one applied is acknowledged once it's been drawn. */
+unsigned int sync_seq = 0;
+double last_sync_ms = 0;        /* When the master last sent its view, or a heartbeat */
+int have_state = 0;             /* Has a slave heard from its master yet? */
+double state_requested_ms = 0;
+struct sockaddr_in master_sockaddr;     /* Where --master said to ask */
+view_state ack_view;
+int ack_pending = 0;
+double ack_apply_ms;
+
+/* Views waiting until they're due. Only the main loop uses this. */
+view_schedule schedule;
+
+/* Telemetry lives on the control side; these ask it for a dump */
+double next_dump_ms = 0;
+volatile sig_atomic_t dump_requested = 0;
+
+/* The view as input and sync traffic leave it. Only the control side touches
+ * this: the input thread with --inputthread, otherwise the main loop. The
+ * globals draw() uses are copied from snapshots of it, through the view
+ * buffer, by the main loop, which also does all the GL work. */
+view_state control = { 0, 0, 0, 1 };
+
+/* Bumped by the main loop each time it renumbers the image list. A snapshot
+ * from before the control side caught up would name images by their old
+ * numbers, so apply_view() waits for a newer one. */
+unsigned int catalog_generation = 0;
+
+/* Things the main loop asks the control side to do */
+#define CMD_TRANSLATE 0
+#define CMD_STEP_IMAGE 1    /* Move by `from` images */
+#define CMD_RENUMBER 2      /* Image `from` is now image `to`, as of generation `generation` */
+#define CMD_RESET 3         /* Image `from` is loaded; put it back to zoom z */
+#define CMD_DUMP_TELEMETRY 4
+#define CMD_GOTO_IMAGE 5    /* Show image `from` */
+#define CMD_TOGGLE_HUD 6
+
+typedef struct {
+    int type;
+    int from, to;
+    float h, v, z;
+    unsigned int generation;
+} control_cmd;
+int control_pipe[2] = { -1, -1 };
 
 struct slavehost_s {
     char addr[ADDR_LEN];
@@ -59,13 +187,6 @@ struct slavehost_s {
 };
 LIST_HEAD(slavelisthead, slavehost_s) slave_list;
 
-/* List of image names, initialized from argv */
-struct image_s {
-    char *filename;
-    TAILQ_ENTRY(image_s) entries;
-};
-TAILQ_HEAD(imagelisthead, image_s) image_list;
-
 struct {
     int verbose, fullscreen;
     int use_spacenav, swapaxes;
@@ -75,6 +196,37 @@ struct {
     unsigned int valid_listenaddr, listenport, multicast;
     int xoffset;
     unsigned int subtexsize, forcesubtex, width, height;
+    int stream;
+    unsigned int vram_budget;
+    int roi, roi_margin;
+    int cpu_mipmaps;
+    int watch, bgscan;
+    int share_decode;
+    unsigned int tile_server_port;
+    int tile_compress;
+    int tile_client;
+    char tile_server_addr[ADDR_LEN];
+    unsigned int tile_client_port, tile_cache;
+    char *mcast_send;
+    int mcast_ttl, mcast_loop;
+    char *mcast_if;
+    int input_thread;
+    int loader_thread;
+    float frame_target;
+    int progressive;
+    int readahead;
+    unsigned int readahead_mb;
+    float slideshow;
+    unsigned int ack_port;
+    float telemetry_interval;
+    float sync_lead;
+    int selftest;
+    int gpu_probe;
+    int thumb_threads;
+    float heartbeat;
+    char master_addr[ADDR_LEN];
+    unsigned int master_port;
+    int ycbcr;
 } options = {
     0,      /* verbose */
     0,      /* fullscreen */
@@ -89,10 +241,48 @@ struct {
     0,      /* xoffset */
     1000,   /* size of subtextures when the single texture is too big to remain one texture */
     0,      /* force use of subtextures */
-    0, 0    /* width, height */
+    0, 0,   /* width, height */
+    0,      /* stream images straight into subtextures */
+    256,    /* MB of textures to keep resident, 0 for no limit */
+    0,      /* only load the part of the image this screen can see */
+    512,    /* screen pixels to load beyond the edges of the screen */
+    0,      /* build mipmaps on the CPU even if the GL could */
+    0,      /* watch directories for new and removed images */
+    0,      /* read directories on a background thread */
+    0,      /* share decoded images with other processes on this host */
+    0,      /* port to serve tiles on, 0 for none */
+    0,      /* compress the tiles we serve */
+    0,      /* fetch tiles from a tile server instead of decoding */
+    "",     /* tile server address */
+    0,      /* tile server port */
+    64,     /* MB of fetched tiles to keep */
+    NULL,   /* multicast group:port to send sync traffic to */
+    1,      /* multicast TTL */
+    1,      /* loop multicast back to this host */
+    NULL,   /* address of the interface to send multicast from */
+    0,      /* handle input and sync traffic on their own thread */
+    0,      /* decode images on their own thread, and only upload between frames */
+    0,      /* ms per frame to aim for while moving, 0 to always draw full quality */
+    0,      /* show a quick preview, then fill in full resolution between frames */
+    0,      /* image files on each side to read into the page cache */
+    512,    /* MB to read ahead each time the image changes */
+    0,      /* seconds to show each image for, 0 for no slideshow */
+    0,      /* port slaves acknowledge sync packets to, 0 for none */
+    0,      /* seconds between telemetry dumps, 0 for only on demand */
+    0,      /* ms ahead to schedule view changes on every screen, 0 for right away */
+    0,      /* load each image, check it, and exit */
+    GPU_PROBE_CACHED,   /* measure the GPU to choose subtexsize and upload path */
+    0,      /* threads making thumbnails for the overview, 0 for one less than the CPUs */
+    1,      /* seconds between resending the view to slaves while it's still, 0 for never */
+    "", 0,  /* master's acknowledgement port, for a new slave to ask for the view */
+    0       /* upload JPEGs as YCbCr planes, and convert them to RGB on the GPU */
 };
 
 void setup_texture(void);
+void reset_view(void);
+void publish_view(void);
+void load_visible_tiles(void);
+void level_rect(int, int, unsigned int *, unsigned int *, unsigned int *, unsigned int *);
 
 void usage(const char *pname) {
     fprintf(stderr, "%s%s%s%s%s%s\n\n%s%s%s\n",
@@ -100,7 +290,10 @@ void usage(const char *pname) {
 "USAGE: ", pname, " <options> image_file[, image_file, ...]\n\n"
 "OPTIONS:\n"
 "\t-v, --verbose\n"
-"\t\tInclude extra output\n"
+"\t\tInclude extra output. Give it twice to log every tile of every frame drawn,\n"
+"\t\twhich slows drawing down; press h instead for an overlay with a graph of frame\n"
+"\t\ttimes, load times and texture and sync statistics. On the master, h shows it\n"
+"\t\ton every screen.\n"
 "\t-f, --fullscreen\n"
 "\t\tMake the window full screen\n"
 "\t-s, --spacenav[=device_name]\n"
@@ -109,6 +302,18 @@ void usage(const char *pname) {
 "\t--sensitivity=value\n"
 "\t\tChange the space navigator's sensitivity. Larger numbers make the device more\n"
 "\t\tsensitive. The default is 0.02\n"
+"\t--inputthread\n"
+"\t\tRead the space navigator and synchronization traffic, and send updates to\n"
+"\t\tslaves, on a separate thread, so they never wait on drawing or on loading\n"
+"\t\timages, and drawing never waits on them.\n"
+"\t--loaderthread\n"
+"\t\tDecode images on a separate thread, a row of subtextures at a time, and have\n"
+"\t\tthe main loop only upload the rows that are ready between frames, so switching\n"
+"\t\timages never stops drawing. Rows show up as they're loaded, over a preview\n"
+"\t\twith --progressive. Without it, a new image is decoded before the next frame,\n"
+"\t\tunless it was preloaded with --slideshow or is loaded with --progressive.\n"
+"\t\tThe slideshow preloader decodes on the thread too. Has no effect with --roi or\n"
+"\t\t--tileclient, which decode what's visible as it's needed. Implies --forcesubtex.\n"
 "\t-w, --swapaxes\n"
 "\t\tReverse the direction the image moves on input from the space navigator.\n"
 "\t-h, --help\n"
@@ -121,28 +326,175 @@ void usage(const char *pname) {
 "\t--slave=addr:port, --bcastslave=addr:port\n"
 "\t\tAdds addr:port as a slave to receive UDP synchronization traffic. The bcastslave\n"
 "\t\toption indicates that the slave's address is a broadcast address\n"
+"\t--mcastsend=group:port\n"
+"\t\tSend UDP synchronization traffic once, to a multicast group, for slaves running\n"
+"\t\t--listen=group:port --multicast.\n"
+"\t--mcastttl=##\n"
+"\t\tUsed only with --mcastsend; how many routers multicast traffic may cross.\n"
+"\t\tThe default is 1, which keeps it on the local network.\n"
+"\t--mcastif=addr\n"
+"\t\tUsed only with --mcastsend; send multicast from the interface with this address,\n"
+"\t\tinstead of the one the routing table picks.\n"
+"\t--mcastloop=0|1\n"
+"\t\tUsed only with --mcastsend; whether slaves on this same host get the multicast\n"
+"\t\ttraffic. The default is 1.\n"
 "\t--xoffset=##\n"
 "\t\tDisplaces image by ## pixels horizontally. Numbers may be negative or positive.\n"
 "\t--subtexsize=##\n"
 "\t\tSize of subtextures, when a texture image is too big for the hardware.\n"
+"\t--ackport=port\n"
+"\t\tOn the master, have slaves acknowledge sync packets to this port once they've\n"
+"\t\tdrawn them, and keep histograms for each slave of the network round trip, the\n"
+"\t\ttime to apply each update, the time until it's on screen, and frame times.\n"
+"\t\tPress t, or send SIGUSR1, to print them.\n"
+"\t--synclead=##\n"
+"\t\tUsed only with --ackport; have every screen, this one included, show each view\n"
+"\t\tchange ## milliseconds after the master makes it, by the master's clock, so they\n"
+"\t\tall show it on the same frame. Slaves work out how far their clocks are from\n"
+"\t\tthe master's by pinging it on the acknowledgement port about once a second.\n"
+"\t\tIt should be longer than the slowest slave's network round trip.\n"
+"\t--telemetry=##\n"
+"\t\tUsed only with --ackport; print the slave histograms every ## seconds.\n"
+"\t--heartbeat=##\n"
+"\t\tOn the master, send the whole view to slaves again once it's been still for\n"
+"\t\t## seconds, and every ## seconds after that, so a slave that missed a packet\n"
+"\t\tor restarted catches up. Nothing extra is sent while the view is moving. The\n"
+"\t\tdefault is 1; 0 turns it off.\n"
+"\t--master=host:port\n"
+"\t\tUsed only with --listen; ask the master at host, on its --ackport, for the view\n"
+"\t\tas soon as we start, instead of waiting for the next heartbeat, and wait up to two seconds\n"
+"\t\tfor it, so the first image loaded is the one the master is showing.\n"
+"\t--bgscan\n"
+"\t\tRead directories on a background thread, and show the first image as soon as\n"
+"\t\tone is found. Images are listed in the order they're found until the scan\n"
+"\t\tfinishes, then put in sorted order.\n"
+"\t--cpumipmaps\n"
+"\t\tBuild mipmaps on the CPU, even if the GL could do it. Coarser copies of\n"
+"\t\tsubtextured images are always built on the CPU, halving the image for as long\n"
+"\t\tas subtexsize stays divisible by two; a power of two subtexsize works best.\n"
+"\t--frametarget=##\n"
+"\t\tMilliseconds per frame to aim for while the view is moving. When drawing takes\n"
+"\t\tlonger, coarser levels of detail are drawn until it doesn't, and full quality\n"
+"\t\tcomes back once the view stops. Works best with subtextures.\n"
 "\t--forcesubtex\n"
 "\t\tForce splitting image into subtextures.\n"
+"\t--gpuprobe=off|cached|force\n"
+"\t\tTime texture uploads of a few sizes when starting, and choose the subtexsize,\n"
+"\t\twhether to split images into subtextures, and whether to upload through pixel\n"
+"\t\tbuffer objects from what's fastest. The results are kept in ~/.cache/lg-pano,\n"
+"\t\tone file per GPU and driver, and reused next time unless this is force. A\n"
+"\t\t--subtexsize given here still wins. Defaults to cached.\n"
+"\t--stream\n"
+"\t\tDecode images a strip at a time, straight into subtextures, instead of loading\n"
+"\t\tthe whole image first. Implies --forcesubtex. Memory use is bounded only for\n"
+"\t\tJPEG files; other formats are still read whole by GraphicsMagick.\n"
+"\t--ycbcr\n"
+"\t\tUpload 4:2:0 JPEGs as the luma and chroma planes libjpeg decodes, and convert\n"
+"\t\tthem to RGB in a shader, which halves the bytes uploaded and skips the CPU's\n"
+"\t\tcolor conversion. Other images are uploaded as RGB. Needs OpenGL 2.0, and\n"
+"\t\ttakes the GPU's mipmaps in place of coarser copies of the image. Implies\n"
+"\t\t--stream; has no effect with --roi, --tileclient or --progressive.\n"
+"\t--selftest\n"
+"\t\tLoad each image in turn, check that every part of it made it into a texture of\n"
+"\t\tthe right size, print how long it took and the peak memory use, and exit. Exits\n"
+"\t\twith 1 if any image failed. Used by make check.\n"
+"\t--sharedecode\n"
+"\t\tShare decoded images with other lg-pano processes on this host, such as ones\n"
+"\t\tdriving the other screens of a multi-head machine. The first to load an image\n"
+"\t\tdecodes it into shared memory, and the rest use that. Has no effect with\n"
+"\t\t--stream or --roi.\n"
+"\t--progressive\n"
+"\t\tShow a low resolution preview of each new image as soon as it's decoded, then\n"
+"\t\tdecode the full resolution image a row of subtextures at a time between frames.\n"
+"\t\tPreviews are only quick for JPEG files. Implies --forcesubtex.\n"
+"\t--readahead=##\n"
+"\t\tRead the files of this many images on either side of the current one into the\n"
+"\t\tpage cache in the background, pausing whenever an image is being decoded, so\n"
+"\t\tslow disks or NFS don't hold up decoding them later.\n"
+"\t--readaheadmb=##\n"
+"\t\tUsed only with --readahead; megabytes to read each time the image changes.\n"
+"\t\tDefault 512.\n"
+"\t--slideshow=##\n"
+"\t\tMove on to the next image every ## seconds, and tell the slaves. The next image\n"
+"\t\tis decoded a row of subtextures at a time between frames, early enough to be\n"
+"\t\tready when it's due, and the switch waits for it rather than stalling drawing.\n"
+"\t\tSlaves given --slideshow preload the next image too, and wait for it the same\n"
+"\t\tway, but leave the timing to the master. Switching to an image before its\n"
+"\t\tpreload is done shows what's loaded and finishes the rest between frames.\n"
+"\t\tNothing is preloaded with --roi or --tileclient.\n"
+"\t--roi[=margin]\n"
+"\t\tOnly decode and upload the parts of the image this screen can see, plus margin\n"
+"\t\tscreen pixels around it (default 512), and load more as the view moves.\n"
+"\t\tTiled TIFFs only have those tiles read, and pyramidal ones are read from\n"
+"\t\ttheir reduced resolution copies when zoomed out. Implies --forcesubtex.\n"
+"\t--thumbthreads=##\n"
+"\t\tThreads making thumbnails for the overview grid, which o shows and hides.\n"
+"\t\tIn the grid, the arrow keys or a, d, w and s move, and enter shows the image.\n"
+"\t\tThumbnails are kept in ~/.cache/lg-pano/thumbs for next time. Defaults to one\n"
+"\t\tless than the number of CPUs.\n"
+"\t--tileserver=port\n"
+"\t\tServe decoded tiles of the images to slaves running --tileclient, over TCP.\n"
+"\t--tilecompress\n"
+"\t\tUsed only with --tileserver; compress tiles with zlib before sending them.\n"
+"\t--tileclient=addr:port\n"
+"\t\tFetch the parts of each image this screen can see from the tile server at\n"
+"\t\taddr:port, instead of decoding image files. The list of images still has to\n"
+"\t\tmatch the master's, but the files needn't exist here. Implies --roi.\n"
+"\t--tilecache=##\n"
+"\t\tMegabytes of fetched tiles to keep, so they needn't be fetched again. Default 64.\n"
+"\t--vrambudget=##\n"
+"\t\tMegabytes of texture memory to use, including recently viewed images kept\n"
+"\t\tloaded so flipping back to them is instant. 0 means no limit. Default 256.\n"
+"\t--watch\n"
+"\t\tWatch directories given on the command line, adding images copied into them\n"
+"\t\tand dropping ones that are removed, without a restart. New images go where\n"
+"\t\ta fresh start would list them, so every screen agrees on the order.\n"
 "\t--width=##, --height=##\n"
 "\t\tForce screen width and/or height to a specified value.\n"
     );
 }
 
-typedef struct {
-    int flag, img_idx;
-    int horiz_disp, vert_disp;
-    float tex_min_x, tex_max_x, tex_min_y, tex_max_y;
-} sync_struct;
+/* A sync packet of the wrong size or version: its sender is running a build
+ * that lays them out differently. Say so, now and then. */
+void sync_mismatch(const struct sockaddr_in *from, ssize_t got, int version) {
+    static double last_warned = 0;
+    double now = clock_now_ms();
+
+    if (last_warned && now - last_warned < 10000)
+        return;
+    last_warned = now;
+    fprintf(stderr, "WARNING: Ignoring %d byte sync packet (version %d) from %s; this build speaks version %d, "
+                    "in %d byte packets. Are all the screens running the same lg-pano?\n",
+        (int) got, got >= (ssize_t) (2 * sizeof(int)) ? version : 0, inet_ntoa(from->sin_addr),
+        SYNC_VERSION, (int) sizeof(sync_struct));
+}
 
 void udp_handler(int recv_socket) {
+    union {
+        sync_struct sync;
+        clock_ping ping;
+    } packet;
     sync_struct data;
-
-    if (read(recv_socket, &data, sizeof(sync_struct)) >= (ssize_t) sizeof(sync_struct)) {
-        if ( data.flag == 1234) {
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+    ssize_t got;
+    double offset;
+
+    /* MSG_TRUNC, so a longer packet from a newer build shows its real size */
+    got = recvfrom(recv_socket, &packet, sizeof(packet), MSG_TRUNC, (struct sockaddr *) &from, &len);
+    __atomic_add_fetch(&packets, 1, __ATOMIC_RELAXED);
+    if (got == (ssize_t) sizeof(clock_ping) && packet.ping.flag == PONG_FLAG) {
+        clock_sync_pong(&packet.ping);
+        return;
+    }
+    if (got >= (ssize_t) sizeof(int) && packet.sync.flag == SYNC_FLAG &&
+        (got != (ssize_t) sizeof(sync_struct) || packet.sync.version != SYNC_VERSION)) {
+        sync_mismatch(&from, got, packet.sync.version);
+        return;
+    }
+    if (got == (ssize_t) sizeof(sync_struct)) {
+        data = packet.sync;
+        if ( data.flag == SYNC_FLAG) {
             if (options.verbose) {
                 fprintf(stderr, "%d, %d, %d, %d, %f, %f, %f, %f\n",
                     data.flag, data.img_idx,
@@ -151,21 +503,11 @@ void udp_handler(int recv_socket) {
                     data.tex_max_x, data.tex_max_y);
             }
 
-            if (image_index != data.img_idx) {
-                if (data.img_idx >= num_images || data.img_idx < 0) {
-                    fprintf(stderr, "ERROR: Tried to cycle past the end of the image list (image_index = %d, num_images = %d). Is the list of images on your command line identical to the master, and do all the images actually exist?\n", data.img_idx, num_images);
-                    exit(1);
-                }
-                setup_texture();
-            }
-            horiz_disp = data.horiz_disp;
-            vert_disp = data.vert_disp;
-            tex_min_x = data.tex_min_x;
-            tex_min_y = data.tex_min_y;
-            tex_max_x = data.tex_max_x;
-            tex_max_y = data.tex_max_y;
-
-            redraw = 1;
+            have_state = 1;
+            control.master_addr = from.sin_addr.s_addr;
+            /* apply_view() checks the image index, and loads the image */
+            if (sync_take(&control, &data, clock_now_ms(), clock_sync_offset(&offset) ? &offset : NULL))
+                publish_view();
         }
         else {
             fprintf(stderr, "Wrong flag value\n");
@@ -231,44 +573,115 @@ int setup_slave(struct slavehost_s *slave, const int broadcast, char *args) {
     return 1;
 }
 
-int is_directory(const char *name) {
-    struct stat statbuf;
-    if (stat(name, &statbuf) == -1) {
-        perror("Getting information about image file");
-        return 0;
+/* A multicast group gets one socket, like any other slave, so translate()
+ * sends each update to it once however many screens have joined */
+int setup_mcast_sender(struct slavehost_s *group, char *args) {
+    struct sockaddr_in addr;
+    struct in_addr iface;
+    unsigned char ttl, loop;
+
+    memset(group->addr, 0, ADDR_LEN);
+    if (get_addr_port(group->addr, &group->port, args) != 1) {
+        fprintf(stderr, "ERROR: You must include a group in --mcastsend=%s\n", args);
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(group->port);
+    if (inet_aton(group->addr, &addr.sin_addr) == 0 || !IN_MULTICAST(ntohl(addr.sin_addr.s_addr))) {
+        fprintf(stderr, "ERROR: %s isn't a multicast group address\n", group->addr);
+        exit(1);
+    }
+
+    if (options.verbose)
+        fprintf(stderr, "Sending to multicast group %s:%d, TTL %d\n", group->addr, group->port, options.mcast_ttl);
+    group->broadcast = 0;
+    group->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (group->socket == -1) {
+        perror("Couldn't open multicast socket");
+        exit(1);
+    }
+
+    ttl = options.mcast_ttl;
+    if (setsockopt(group->socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0)
+        perror("Couldn't set multicast TTL");
+    loop = options.mcast_loop ? 1 : 0;
+    if (setsockopt(group->socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
+        perror("Couldn't set multicast loopback");
+    if (options.mcast_if) {
+        if (inet_aton(options.mcast_if, &iface) == 0) {
+            fprintf(stderr, "ERROR: Can't make sense of interface address %s\n", options.mcast_if);
+            exit(1);
+        }
+        if (setsockopt(group->socket, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0) {
+            perror("Couldn't choose multicast interface");
+            exit(1);
+        }
     }
 
-    return (S_ISDIR(statbuf.st_mode));
+    if (connect(group->socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("Error connecting multicast socket");
+        return 0;
+    }
+    return 1;
 }
 
 void get_options(const int argc, char * const argv[]) {
     int opt_index, c, broadcast;
     struct slavehost_s *new_slave;
-    char *image_file;
-    int i, imgnamelen;
-    struct image_s *img;
-    DIR *dirfd;
-    struct dirent *d;
+    struct hostent *server;
+    int i;
     
     while (1) {
         broadcast = 0;
 
         static struct option long_options[] = {
+            { "ackport",     required_argument,  NULL, 'k' },
             { "bcastslave",  required_argument,  NULL, 'B' },
+            { "bgscan",      no_argument,        NULL, 'G' },
+            { "cpumipmaps",  no_argument,        NULL, 'C' },
             { "slave",       required_argument,  NULL, 'S' },
             { "sensitivity", required_argument,  NULL, 'e' },
             { "fullscreen",  no_argument,        NULL, 'f' },
             { "forcesubtex", no_argument,        NULL, 'F' },
+            { "gpuprobe",    required_argument,  NULL, 'U' },
+            { "frametarget", required_argument,  NULL, 'Q' },
+            { "heartbeat",   required_argument,  NULL, 'b' },
             { "help",        no_argument,        NULL, 'h' },
             { "height",      required_argument,  NULL, 'H' },
+            { "inputthread", no_argument,        NULL, 'Y' },
             { "listen",      required_argument,  NULL, 'l' },
+            { "loaderthread",no_argument,        NULL, 'j' },
+            { "progressive", no_argument,        NULL, 'J' },
+            { "readahead",   required_argument,  NULL, 'r' },
+            { "readaheadmb", required_argument,  NULL, 'u' },
+            { "roi",         optional_argument,  NULL, 'I' },
+            { "selftest",    no_argument,        NULL, 'E' },
+            { "sharedecode", no_argument,        NULL, 'D' },
+            { "slideshow",   required_argument,  NULL, 'X' },
+            { "mcastif",     required_argument,  NULL, 'A' },
+            { "mcastloop",   required_argument,  NULL, 'O' },
+            { "mcastsend",   required_argument,  NULL, 'M' },
+            { "mcastttl",    required_argument,  NULL, 'L' },
+            { "master",      required_argument,  NULL, 'p' },
             { "multicast",   no_argument,        NULL, 'm' },
             { "xoffset",     required_argument,  NULL, 'o' },
             { "spacenav",    optional_argument,  NULL, 's' },
+            { "stream",      no_argument,        NULL, 'R' },
             { "subtexsize",  required_argument,  NULL, 't' },
             { "verbose",     no_argument,        NULL, 'v' },
+            { "vrambudget",  required_argument,  NULL, 'V' },
             { "swapaxes",    no_argument,        NULL, 'w' },
+            { "thumbthreads",required_argument,  NULL, 'n' },
+            { "tilecache",   required_argument,  NULL, 'K' },
+            { "tileclient",  required_argument,  NULL, 'N' },
+            { "tilecompress",no_argument,        NULL, 'Z' },
+            { "tileserver",  required_argument,  NULL, 'P' },
+            { "synclead",    required_argument,  NULL, 'y' },
+            { "telemetry",   required_argument,  NULL, 'g' },
+            { "watch",       no_argument,        NULL, 'T' },
             { "width",       required_argument,  NULL, 'W' },
+            { "ycbcr",       no_argument,        NULL, 'i' },
             { 0,             0,                  0,     0  }
         };
 
@@ -282,10 +695,93 @@ void get_options(const int argc, char * const argv[]) {
             case 'W':
                 options.width = atoi(optarg);
                 break;
+            case 'C':
+                options.cpu_mipmaps = 1;
+                break;
+            case 'G':
+                options.bgscan = 1;
+                break;
+            case 'Y':
+                options.input_thread = 1;
+                break;
+            case 'j':
+                options.loader_thread = 1;
+                options.forcesubtex = 1;
+                break;
+            case 'D':
+                options.share_decode = 1;
+                break;
             case 'F':
                 options.forcesubtex = 1;
                 break;
+            case 'Q':
+                options.frame_target = atof(optarg);
+                break;
+            case 'I':
+                options.roi = 1;
+                options.forcesubtex = 1;
+                if (optarg != NULL) options.roi_margin = atoi(optarg);
+                break;
+            case 'R':
+                options.stream = 1;
+                options.forcesubtex = 1;
+                break;
+            case 'i':
+                options.ycbcr = 1;
+                options.stream = 1;
+                options.forcesubtex = 1;
+                break;
+            case 'r':
+                options.readahead = atoi(optarg);
+                break;
+            case 'u':
+                options.readahead_mb = atoi(optarg);
+                break;
+            case 'X':
+                options.slideshow = atof(optarg);
+                break;
+            case 'k':
+                options.ack_port = atoi(optarg);
+                break;
+            case 'g':
+                options.telemetry_interval = atof(optarg);
+                break;
+            case 'y':
+                options.sync_lead = atof(optarg);
+                break;
+            case 'b':
+                options.heartbeat = atof(optarg);
+                break;
+            case 'p':
+                if (get_addr_port(options.master_addr, &options.master_port, optarg) != 1 || options.master_port == 0) {
+                    fprintf(stderr, "--master needs host:port, the master's --ackport\n");
+                    exit(1);
+                }
+                break;
+            case 'E':
+                options.selftest = 1;
+                break;
+            case 'n':
+                options.thumb_threads = atoi(optarg);
+                break;
+            case 'J':
+                options.progressive = 1;
+                options.forcesubtex = 1;
+                break;
+            case 'U':
+                if (!strcmp(optarg, "off"))
+                    options.gpu_probe = GPU_PROBE_OFF;
+                else if (!strcmp(optarg, "cached"))
+                    options.gpu_probe = GPU_PROBE_CACHED;
+                else if (!strcmp(optarg, "force"))
+                    options.gpu_probe = GPU_PROBE_FORCE;
+                else {
+                    fprintf(stderr, "--gpuprobe takes off, cached or force, not %s\n", optarg);
+                    exit(1);
+                }
+                break;
             case 't':
+                subtexsize_given = 1;
                 options.subtexsize = atoi(optarg);
                 if (options.subtexsize % 2 != 0) {
                     fprintf(stderr, "Cannot accept an odd subtexsize value (you entered %d)\n", options.subtexsize);
@@ -298,6 +794,18 @@ void get_options(const int argc, char * const argv[]) {
             case 'm':
                 options.multicast = 1;
                 break;
+            case 'M':
+                options.mcast_send = optarg;
+                break;
+            case 'L':
+                options.mcast_ttl = atoi(optarg);
+                break;
+            case 'A':
+                options.mcast_if = optarg;
+                break;
+            case 'O':
+                options.mcast_loop = atoi(optarg);
+                break;
             case 'B':
                 broadcast = 1;
                 /* The missing break here is intentional */
@@ -327,6 +835,9 @@ void get_options(const int argc, char * const argv[]) {
             case 'v':
                 options.verbose++;
                 break;
+            case 'V':
+                options.vram_budget = atoi(optarg);
+                break;
             case 'f':
                 options.fullscreen = 1;
                 break;
@@ -340,6 +851,27 @@ void get_options(const int argc, char * const argv[]) {
             case 'w':
                 options.swapaxes = -1;
                 break;
+            case 'T':
+                options.watch = 1;
+                break;
+            case 'P':
+                options.tile_server_port = atoi(optarg);
+                break;
+            case 'Z':
+                options.tile_compress = 1;
+                break;
+            case 'N':
+                if (get_addr_port(options.tile_server_addr, &options.tile_client_port, optarg) != 1) {
+                    fprintf(stderr, "ERROR: You must include a host in --tileclient=%s\n", optarg);
+                    exit(1);
+                }
+                options.tile_client = 1;
+                options.roi = 1;
+                options.forcesubtex = 1;
+                break;
+            case 'K':
+                options.tile_cache = atoi(optarg);
+                break;
             default:
                 /* Unrecognized option */
                 usage(argv[0]);
@@ -347,6 +879,43 @@ void get_options(const int argc, char * const argv[]) {
         }
     }
 
+    /* Settle where the master is now, rather than once the screen is up */
+    if (options.master_port) {
+        if (options.listenport == -1) {
+            fprintf(stderr, "ERROR: --master is for slaves, and needs --listen as well\n");
+            exit(1);
+        }
+        server = gethostbyname(options.master_addr);
+        if (server == NULL) {
+            fprintf(stderr, "ERROR: Couldn't find the --master host %s\n", options.master_addr);
+            exit(1);
+        }
+        memset(&master_sockaddr, 0, sizeof(struct sockaddr_in));
+        master_sockaddr.sin_family = AF_INET;
+        memcpy(&master_sockaddr.sin_addr.s_addr, server->h_addr, server->h_length);
+        master_sockaddr.sin_port = htons(options.master_port);
+    }
+
+    if (options.ycbcr && (options.roi || options.progressive)) {
+        fprintf(stderr, "--ycbcr has no effect with --roi, --tileclient or --progressive\n");
+        options.ycbcr = 0;
+    }
+
+    /* Set up after the loop, since the TTL and the rest may come later */
+    if (options.mcast_send) {
+        if (! has_slaves) {
+            has_slaves = 1;
+            LIST_INIT(&slave_list);
+        }
+        new_slave = (struct slavehost_s *) malloc(sizeof(struct slavehost_s));
+        if (!new_slave) {
+            perror("Couldn't allocate memory for multicast group");
+            exit(1);
+        }
+        if (setup_mcast_sender(new_slave, options.mcast_send))
+            LIST_INSERT_HEAD(&slave_list, new_slave, entries);
+    }
+
     if (optind < argc) {
         /* Setup images tail queue */
 
@@ -355,81 +924,13 @@ void get_options(const int argc, char * const argv[]) {
         /* XXX Another option is to test each file to be sure it's a real JPG
          * file before adding it to the list */
 
-        TAILQ_INIT(&image_list);
-
-        num_images = argc - optind;
-        for (i = optind; i < argc; i++) {
-            if (is_directory(argv[i])) {
-                /* Read through this directory and load all files */
-                dirfd = opendir(argv[i]);
-                if (! dirfd) {
-                    perror("Couldn't open directory");
-                    continue;
-                }
-
-                while ((d = readdir(dirfd))) {
-                    imgnamelen = strlen(argv[i]) + 2 + strlen(d->d_name);
-                    printf("Allocating to %d\n", imgnamelen);
-                    image_file = (char *) malloc(imgnamelen);
-                    /*}
-                    else {
-                        if (imgnamelen < strlen(argv[i]) + 2 + strlen(d->d_name)) {
-                            imgnamelen = strlen(argv[i]) + 2 + strlen(d->d_name);
-                            printf("Reallocating to %d\n", imgnamelen);
-                            image_file = (char *) realloc(image_file, imgnamelen);
-                        }
-                    }*/
-                    if (!image_file) {
-                        perror("Couldn't allocate memory for reconstructed filename");
-                        exit(1);
-                    }
-                    sprintf(image_file, "%s/%s", argv[i], d->d_name);
-                    printf("Allocated %s\n", image_file);
-
-                    if (!is_directory(image_file)) {
-                        img = (struct image_s *) malloc(sizeof(struct image_s));
-                        if (!img) {
-                            perror("Couldn't allocate image structure");
-                            exit(1);
-                        }
-                        img->filename = image_file;
-                        if (!img->filename) {
-                            perror("Couldn't duplicate filename");
-                            exit(1);
-                        }
-                        if (options.verbose)
-                            fprintf(stderr, "Adding file %s\n", img->filename);
-                        TAILQ_INSERT_TAIL(&image_list, img, entries);
-                    }
-                    else {
-                        printf("File isn't a normal file.\n");
-                    }
-                }
-/*                if (imgnamelen > 0) {
-                    printf("Freeing image...\n");
-                    free(image_file);
-                } */
-            }
-            else {
-                /* This is apparently a single image */
-                image_file = strdup(argv[i]);
-                if (!image_file) {
-                    perror("Couldn't allocate memory for image name");
-                    exit(1);
-                }
-                img = (struct image_s *) malloc(sizeof(struct image_s));
-                if (!img) {
-                    perror("Couldn't allocate memory for image structure");
-                    exit(1);
-                }
-                img->filename = image_file;
-                TAILQ_INSERT_TAIL(&image_list, img, entries);
-            }
+        catalog_init(options.verbose);
+        if (options.bgscan) {
+            catalog_scan_start(argv + optind, argc - optind, options.watch);
         }
-
-        num_images = 0;
-        TAILQ_FOREACH(img, &image_list, entries) {
-            num_images++;
+        else {
+            for (i = optind; i < argc; i++)
+                catalog_add_path(argv[i], options.watch);
         }
     }
     else {
@@ -439,39 +940,237 @@ void get_options(const int argc, char * const argv[]) {
     }
 }
 
-void translate(float h, float v, float z) {
+/* Hand the control view to the main loop */
+void publish_view(void) {
+    control.serial++;
+    view_buffer_publish(&control);
+}
+
+/* The control view, as sent to slaves */
+void fill_sync(sync_struct *sync) {
+    memset(sync, 0, sizeof(*sync));
+    sync->flag = SYNC_FLAG;
+    sync->version = SYNC_VERSION;
+    sync->img_idx = control.img_idx;
+    sync->horiz_disp = control.horiz_disp;
+    sync->vert_disp = control.vert_disp;
+    sync->tex_min_x = control.tex_min_x;
+    sync->tex_min_y = control.tex_min_y;
+    sync->tex_max_x = control.tex_max_x;
+    sync->tex_max_y = control.tex_max_y;
+    sync->seq = sync_seq;
+    sync->ack_port = options.ack_port;
+    sync->hud = control.hud;
+}
+
+void write_slaves(const sync_struct *sync) {
     struct slavehost_s *slave;
+
+    LIST_FOREACH(slave, &slave_list, entries) {
+        if (write(slave->socket, sync, sizeof(*sync)) <= 0 && options.verbose) {
+            fprintf(stderr, "Write returned 0 or -1; writing to %s:%d may have failed\n", slave->addr, slave->port);
+        }
+        __atomic_add_fetch(&packets, 1, __ATOMIC_RELAXED);
+    }
+    last_sync_ms = clock_now_ms();
+}
+
+/* Notify slaves */
+void send_sync(void) {
+    sync_struct sync;
+
+    fill_sync(&sync);
+    sync.seq = ++sync_seq;
+    sync.apply_at = control.apply_ms;
+    if (options.ack_port)
+        telemetry_sent(sync.seq);
+    write_slaves(&sync);
+}
+
+/* Resend the view, so slaves that missed a packet, or have just started,
+ * catch up. Only when it's been still for a while; while it's moving, every
+ * change goes out anyway. It keeps the last change's number, so slaves
+ * that already have it needn't acknowledge it again. */
+void send_heartbeat(void) {
+    sync_struct sync;
+
+    if (!has_slaves || clock_now_ms() - last_sync_ms < options.heartbeat * 1000)
+        return;
+    fill_sync(&sync);
+    sync.heartbeat = 1;
+    write_slaves(&sync);
+}
+
+/* A slave has just started, and asked for the view on the acknowledgement
+ * port; answer it from there, straight away */
+void answer_state_request(int sock, const struct sockaddr_in *from) {
     sync_struct sync;
 
-    fprintf(stderr, "Running translate(%f, %f, %f) with zoom factor %f\n", h, v, z, zoom_factor);
-    horiz_disp += h * 5;
-    vert_disp += v * 5;
-    if (zoom_factor * z >= 0.1)
-        zoom_factor *= z;
+    fill_sync(&sync);
+    sync.heartbeat = 1;
+    if (sendto(sock, &sync, sizeof(sync), 0, (const struct sockaddr *) from, sizeof(*from)) != (ssize_t) sizeof(sync))
+        perror("Couldn't answer state request");
+}
+
+/* On a slave given --master, ask for the view until it arrives */
+void request_state(void) {
+    state_request request;
+    double now = clock_now_ms();
+
+    if (have_state || now - state_requested_ms < STATE_RETRY_MS)
+        return;
+    state_requested_ms = now;
+    request.flag = STATE_REQUEST_FLAG;
+    request.xoffset = options.xoffset;
+    if (sendto(recv_socket, &request, sizeof(request), 0, (struct sockaddr *) &master_sockaddr, sizeof(master_sockaddr)) !=
+        (ssize_t) sizeof(request))
+        perror("Couldn't ask the master for its view");
+    else if (options.verbose)
+        fprintf(stderr, "Asked %s:%u for the current view\n", options.master_addr, options.master_port);
+}
+
+/* A slave given --master asks for the view before loading anything, so the
+ * first image it decodes is the one the wall is showing, not image 0. If the
+ * master doesn't answer in time, start on image 0 and catch up later. */
+void wait_for_state(void) {
+    struct pollfd fds[1];
+    double start = clock_now_ms();
+
+    fds[0].fd = recv_socket;
+    fds[0].events = POLLIN;
+    while (!have_state && clock_now_ms() - start < STATE_WAIT_MS) {
+        request_state();
+        if (poll(fds, 1, 50) > 0)
+            udp_handler(recv_socket);
+    }
+    if (!have_state) {
+        fprintf(stderr, "No answer from the master at %s:%u yet; starting on image %d\n",
+            options.master_addr, options.master_port, image_index);
+        return;
+    }
+    if (control.img_idx >= 0 && control.img_idx < num_images)
+        image_index = control.img_idx;
+    if (options.verbose)
+        fprintf(stderr, "The master is showing image %d; loading it first\n", control.img_idx);
+}
+
+void translate(float h, float v, float z) {
+    fprintf(stderr, "Running translate(%f, %f, %f) with zoom factor %f\n", h, v, z, control.zoom_factor);
+    control.horiz_disp += h * 5;
+    control.vert_disp += v * 5;
+    if (control.zoom_factor * z >= 0.1)
+        control.zoom_factor *= z;
 
     if (z != 0 && options.verbose)
-        fprintf(stderr, "zoom factor: %f\n", zoom_factor);
+        fprintf(stderr, "zoom factor: %f\n", control.zoom_factor);
 
-    redraw = 1;
+    control.apply_ms = options.sync_lead ? clock_now_ms() + options.sync_lead : 0;
+    publish_view();
+    send_sync();
+}
 
-    /* Notify slaves */
-    sync.flag = 1234;
-    sync.img_idx = image_index;
-    sync.horiz_disp = horiz_disp;
-    sync.vert_disp = vert_disp;
-    sync.tex_min_x = tex_min_x;
-    sync.tex_min_y = tex_min_y;
-    sync.tex_max_x = tex_max_x;
-    sync.tex_max_y = tex_max_y;
+/* Go forward or back through the list. num_images belongs to the main loop,
+ * but it's only read here, and if it's just changed, the worst that happens
+ * is we wrap around one image late. */
+void step_image(int delta) {
+    int n = num_images;
+
+    control.img_idx += delta;
+    if (control.img_idx >= n)
+        control.img_idx = 0;
+    if (control.img_idx < 0)
+        control.img_idx = n - 1;
+    control.apply_ms = 0;
+    publish_view();
+}
 
-    LIST_FOREACH(slave, &slave_list, entries) {
-        if (write(slave->socket, &sync, sizeof(sync)) <= 0 && options.verbose) {
-            fprintf(stderr, "Write returned 0 or -1; writing to %s:%d may have failed\n", slave->addr, slave->port);
-        }
+/* Jump straight to an image, as picked from the overview */
+void goto_image(int idx) {
+    if (idx < 0 || idx >= num_images)
+        return;
+    control.img_idx = idx;
+    control.apply_ms = 0;
+    publish_view();
+}
+
+void run_command(const control_cmd *cmd) {
+    switch (cmd->type) {
+        case CMD_TRANSLATE:
+            translate(cmd->h, cmd->v, cmd->z);
+            break;
+        case CMD_STEP_IMAGE:
+            step_image(cmd->from);
+            break;
+        case CMD_RENUMBER:
+            if (control.img_idx == cmd->from) {
+                control.img_idx = cmd->to;
+                control.apply_ms = 0;
+            }
+            control.generation = cmd->generation;
+            publish_view();
+            break;
+        case CMD_RESET:
+            /* Unless we've already moved on to another image. Slaves keep
+             * the position the master sent along with the image, which
+             * isn't the start if they've just joined. */
+            if (control.img_idx == cmd->from) {
+                if (options.listenport == -1)
+                    control.horiz_disp = control.vert_disp = 0;
+                control.zoom_factor = cmd->z;
+                translate(0, 0, 0);
+            }
+            break;
+        case CMD_DUMP_TELEMETRY:
+            telemetry_dump(stderr);
+            break;
+        case CMD_GOTO_IMAGE:
+            goto_image(cmd->from);
+            break;
+        case CMD_TOGGLE_HUD:
+            /* Slaves follow the master's */
+            control.hud = !control.hud;
+            control.apply_ms = 0;
+            publish_view();
+            send_sync();
+            break;
     }
+}
 
-    /* Make sure we redraw */
-    redraw = 1;
+void request_dump(int sig) {
+    dump_requested = 1;
+}
+
+/* Called on the control side: take in slave acknowledgements, and print
+ * what we know when it's time to, or when asked */
+void poll_telemetry(void) {
+    double now;
+
+    telemetry_receive();
+    now = clock_now_ms();
+    if (dump_requested || (options.telemetry_interval && now >= next_dump_ms)) {
+        if (next_dump_ms)
+            telemetry_dump(stderr);
+        dump_requested = 0;
+        next_dump_ms = now + options.telemetry_interval * 1000;
+    }
+}
+
+/* Ask the control side to do something: right away, or by way of the input
+ * thread */
+void post_command(int type, int from, int to, float h, float v, float z) {
+    control_cmd cmd;
+
+    cmd.type = type;
+    cmd.from = from;
+    cmd.to = to;
+    cmd.h = h;
+    cmd.v = v;
+    cmd.z = z;
+    cmd.generation = catalog_generation;
+    if (!options.input_thread)
+        run_command(&cmd);
+    else if (write(control_pipe[1], &cmd, sizeof(cmd)) != sizeof(cmd))
+        perror("Couldn't pass command to input thread");
 }
 
 int check_glerror(int line) {
@@ -507,36 +1206,79 @@ int check_glerror(int line) {
     return error;
 }
 
-/* render the image */
-void draw(void) {
-    int curh, curw;
-    int i = 0, tw, th;
-    float minx = 0, miny = 0, maxx, maxy;
+/* Where the bottom left corner of the image lands on this screen, given the
+ * current pan and zoom. The image is zoom_factor screen pixels per image
+ * pixel, centered, then displaced by the pan and by this screen's xoffset
+ * within the wall. */
+void image_origin(float *x, float *y) {
+    *x = horiz_disp + options.xoffset - (texture_width * zoom_factor - screen_width) / 2.0;
+    *y = vert_disp - (texture_height * zoom_factor - screen_height) / 2.0;
+}
+
+/* With --frametarget, trade detail for frame rate while the view moves: draw
+ * coarser while frames take too long, finer again when there's time to
+ * spare, and everything at full quality once the view has settled */
+void adapt_quality(double ms) {
+    int old_bias = quality_bias;
+
+    frame_ms = frame_ms ? frame_ms * 0.7 + ms * 0.3 : ms;
+    if (clock_now_ms() - last_motion_ms > SETTLE_MS)
+        return;
+    if (frame_ms > options.frame_target * 1.1 && quality_bias < MAX_QUALITY_BIAS)
+        quality_bias++;
+    else if (frame_ms < options.frame_target * 0.6 && quality_bias > 0)
+        quality_bias--;
+    if (quality_bias != old_bias && options.verbose)
+        fprintf(stderr, "Frames taking %0.1f ms; drawing %d levels coarser\n", frame_ms, quality_bias);
+}
+
+/* Called from the main loop; once the view stops, redraw at full quality */
+void settle_quality(void) {
+    if (quality_bias && clock_now_ms() - last_motion_ms > SETTLE_MS) {
+        quality_bias = 0;
+        redraw = 1;
+        if (options.verbose)
+            fprintf(stderr, "View settled; back to full quality\n");
+    }
+}
+
+/* The coarsest level that still has at least one texel per screen pixel */
+int zoom_level(void) {
+    int level = 0;
+
+    while (level + 1 < num_levels && zoom_factor * (1 << (level + 1)) <= 1)
+        level++;
+    return level;
+}
+
+/* Draw the current image, as much of it as is loaded */
+void draw_image(void) {
+    int i = 0, j, level;
+    unsigned int x, y, w, h;
+    float minx = 0, miny = 0, maxx, maxy, scale;
 
-    redraw = 0;
-    check_glerror(__LINE__);
-    glClear(GL_COLOR_BUFFER_BIT);
-    check_glerror(__LINE__);
     glColor3f(1.0f, 1.0f, 1.0f);
     check_glerror(__LINE__);
     glEnable(GL_TEXTURE_2D);
     check_glerror(__LINE__);
     glPushMatrix();
     check_glerror(__LINE__);
-    glTranslatef(horiz_disp, vert_disp, 0);
+    image_origin(&minx, &miny);
+    glTranslatef(minx, miny, 0);
     check_glerror(__LINE__);
 
-    maxy = screen_height * zoom_factor;
-    maxx = texture_width * maxy / texture_height;
-    check_glerror(__LINE__);
-    glTranslatef((maxx - screen_width) / -2.0, (maxy - screen_height)/ -2.0, 0);
-    check_glerror(__LINE__);
+    maxy = texture_height * zoom_factor;
+    maxx = texture_width * zoom_factor;
 
     if (!subtextured) {
         minx = 0; miny = 0;
-        fprintf(stderr, "minx, maxx: %f, %f\t\tminy, maxy: %f, %f\n", minx, maxx, miny, maxy);
+        if (options.verbose > 1)
+            fprintf(stderr, "minx, maxx: %f, %f\t\tminy, maxy: %f, %f\n", minx, maxx, miny, maxy);
 
-        glBindTexture(GL_TEXTURE_2D, texture_names[0]);
+        glBindTexture(GL_TEXTURE_2D, current_set->names[0]);
+        texcache_drawn(current_set, 0, frame_count);
+        if (gl_lod_bias)
+            glTexEnvf(GL_TEXTURE_FILTER_CONTROL, GL_TEXTURE_LOD_BIAS, quality_bias);
         glBegin(GL_QUADS);
             glTexCoord2f(0, 0); glVertex3f(minx, maxy, i);
             glTexCoord2f(1, 0); glVertex3f(maxx, maxy, i);
@@ -545,178 +1287,1556 @@ void draw(void) {
         glEnd();
     }
     else {
-        i = 0;
-        for (curh = 0; curh < texture_height; curh += options.subtexsize) {
-            for (curw = 0; curw < texture_width; curw += options.subtexsize) {
-                minx = curw * zoom_factor;
-                miny = curh * zoom_factor;
-
-                tw = (curw + options.subtexsize < texture_width) ? options.subtexsize : texture_width - curw;
-                th = (curh + options.subtexsize < texture_height) ? options.subtexsize : texture_height - curh;
-
-                maxy = th * zoom_factor + miny;
-                maxx = tw * (maxy - miny) / th + minx;
-                fprintf(stderr, "zf: %0.2f\tminx, maxx: %0.2f, %0.2f\t"
+        level = zoom_level() + quality_bias;
+        if (level >= num_levels)
+            level = num_levels - 1;
+
+        if (preview_texture) {
+            /* Coarse levels only have what's been decoded so far, and are
+             * black elsewhere, so draw the preview with full resolution
+             * subtextures on top of it until we're done */
+            level = 0;
+            glBindTexture(GL_TEXTURE_2D, preview_texture);
+            glBegin(GL_QUADS);
+                glTexCoord2f(0, 0); glVertex3f(0, maxy, 0);
+                glTexCoord2f(1, 0); glVertex3f(maxx, maxy, 0);
+                glTexCoord2f(1, 1); glVertex3f(maxx, 0, 0);
+                glTexCoord2f(0, 1); glVertex3f(0, 0, 0);
+            glEnd();
+        }
+        scale = zoom_factor * (1 << level);
+
+        if (current_set->chroma)
+            ycbcr_begin();
+        for (j = 0; j < levels[level].cols * levels[level].rows; j++) {
+            i = levels[level].first + j;
+            level_rect(level, j, &x, &y, &w, &h);
+            minx = (j % levels[level].cols) * options.subtexsize * scale;
+            miny = (j / levels[level].cols) * options.subtexsize * scale;
+            maxx = minx + w * scale;
+            maxy = miny + h * scale;
+            if (options.verbose > 1)
+                fprintf(stderr, "zf: %0.2f\tlevel: %d\tminx, maxx: %0.2f, %0.2f\t"
                                 "miny, maxy: %0.2f, %0.2f\ttw, th: %d, %d\n",
-                    zoom_factor, minx, maxx, miny, maxy, tw, th);
-
-                glBindTexture(GL_TEXTURE_2D, texture_names[i]);
+                    zoom_factor, level, minx, maxx, miny, maxy, w, h);
+
+            /* Tiles outside the region of interest may not be loaded */
+            if (current_set->tile_bytes[i]) {
+                if (current_set->chroma)
+                    ycbcr_bind(current_set->names[i], current_set->chroma[2 * i], current_set->chroma[2 * i + 1]);
+                else
+                    glBindTexture(GL_TEXTURE_2D, current_set->names[i]);
+                texcache_drawn(current_set, i, frame_count);
                 glBegin(GL_QUADS);
                     glTexCoord2f(0, 0); glVertex3f(minx, maxy, 0);
                     glTexCoord2f(1, 0); glVertex3f(maxx, maxy, 0);
                     glTexCoord2f(1, 1); glVertex3f(maxx, miny, 0);
                     glTexCoord2f(0, 1); glVertex3f(minx, miny, 0);
                 glEnd();
-                i++;
             }
         }
+        if (current_set->chroma)
+            ycbcr_end();
         something++;
     }
     glPopMatrix();
     check_glerror(__LINE__);
-
-    SDL_GL_SwapBuffers();
 }
 
-char *image_at(int i) {
-    struct image_s *image;
-    int p = 0;
-
-    TAILQ_FOREACH(image, &image_list, entries) {
-        if (p == i) break;
-        p++;
-    }
+/* Lay out the overview grid: how many thumbnails fit across, and how many
+ * rows, at least partly, down */
+void overview_layout(int *cols, int *rows) {
+    *cols = screen_width / (THUMB_W + GRID_GAP);
+    if (*cols < 1)
+        *cols = 1;
+    *rows = screen_height / (THUMB_H + GRID_GAP) + 1;
+}
 
-    printf("Returning %s for image file %d\n", image->filename, i);
-    return (image->filename);
+/* Top left corner of the ith cell on screen. GL's y goes up. */
+void grid_cell(int i, int cols, float *x, float *y) {
+    *x = GRID_GAP / 2 + (i % cols) * (THUMB_W + GRID_GAP);
+    *y = screen_height - GRID_GAP / 2 - (i / cols) * (THUMB_H + GRID_GAP);
 }
 
-void setup_texture(void) {
-    MagickWand *wand;
-    int curw, curh;
-    int tw, th, i;
-    int full_texture_works = 0;
+/* Draw a screenful of thumbnails, one atlas at a time, with gray boxes for
+ * the ones that aren't ready yet, and ask for the next screenful too */
+void draw_overview(void) {
+    static const char **names = NULL;
+    static thumb_rect *rects = NULL;
+    static int *states = NULL, capacity = 0;
+    int cols, rows, n, i, a, num_atlases = 0, bound;
+    float x, y;
+
+    overview_layout(&cols, &rows);
+    if (overview_selected >= num_images)
+        overview_selected = num_images - 1;
+    if (overview_selected < 0)
+        overview_selected = 0;
+    /* Keep the selection on screen, with its whole row showing */
+    if (overview_selected / cols < overview_top)
+        overview_top = overview_selected / cols;
+    if (overview_selected / cols > overview_top + rows - 2)
+        overview_top = overview_selected / cols - (rows - 2 > 0 ? rows - 2 : 0);
+
+    if (capacity < cols * rows * 2) {
+        capacity = cols * rows * 2;
+        names = (const char **) realloc(names, sizeof(char *) * capacity);
+        rects = (thumb_rect *) realloc(rects, sizeof(thumb_rect) * capacity);
+        states = (int *) realloc(states, sizeof(int) * capacity);
+        if (!names || !rects || !states) {
+            perror("Out of memory drawing overview");
+            exit(1);
+        }
+    }
 
-    wand = NewMagickWand();
-    MagickReadImage(wand, image_at(image_index));
+    /* What's on screen now, then the screenful after it, which is only
+     * asked for */
+    n = catalog_range(overview_top * cols, cols * rows * 2, names);
+    for (i = 0; i < n; i++) {
+        states[i] = thumbnails_get(names[i], i < cols * rows, frame_count, &rects[i]);
+        if (i < cols * rows && states[i] == THUMB_RESIDENT && rects[i].atlas >= num_atlases)
+            num_atlases = rects[i].atlas + 1;
+    }
+    if (n > cols * rows)
+        n = cols * rows;
 
-    texture_width = MagickGetImageWidth(wand);
-    texture_height = MagickGetImageHeight(wand);
+    /* Thumbnails, one batch per atlas */
+    glColor3f(1.0f, 1.0f, 1.0f);
+    glEnable(GL_TEXTURE_2D);
+    for (a = 0; a < num_atlases; a++) {
+        bound = 0;
+        for (i = 0; i < n; i++) {
+            if (states[i] != THUMB_RESIDENT || rects[i].atlas != a)
+                continue;
+            if (!bound) {
+                glBindTexture(GL_TEXTURE_2D, rects[i].texture);
+                glBegin(GL_QUADS);
+                bound = 1;
+            }
+            grid_cell(i, cols, &x, &y);
+            /* Centered in its cell */
+            x += (THUMB_W - rects[i].w) / 2.0;
+            y -= (THUMB_H - rects[i].h) / 2.0;
+            glTexCoord2f(rects[i].s0, rects[i].t0); glVertex3f(x, y, 0);
+            glTexCoord2f(rects[i].s1, rects[i].t0); glVertex3f(x + rects[i].w, y, 0);
+            glTexCoord2f(rects[i].s1, rects[i].t1); glVertex3f(x + rects[i].w, y - rects[i].h, 0);
+            glTexCoord2f(rects[i].s0, rects[i].t1); glVertex3f(x, y - rects[i].h, 0);
+        }
+        if (bound)
+            glEnd();
+    }
+    glDisable(GL_TEXTURE_2D);
+
+    /* Placeholders, darker for images we couldn't read */
+    glBegin(GL_QUADS);
+    for (i = 0; i < n; i++) {
+        if (states[i] == THUMB_RESIDENT)
+            continue;
+        if (states[i] == THUMB_FAILED)
+            glColor3f(0.3f, 0.3f, 0.3f);
+        else
+            glColor3f(0.7f, 0.7f, 0.7f);
+        grid_cell(i, cols, &x, &y);
+        glVertex3f(x, y, 0);
+        glVertex3f(x + THUMB_W, y, 0);
+        glVertex3f(x + THUMB_W, y - THUMB_H, 0);
+        glVertex3f(x, y - THUMB_H, 0);
+    }
+    glEnd();
+
+    /* And a box around the selection */
+    i = overview_selected - overview_top * cols;
+    if (i >= 0 && i < n) {
+        grid_cell(i, cols, &x, &y);
+        glColor3f(1.0f, 0.6f, 0.0f);
+        glLineWidth(3);
+        glBegin(GL_LINE_LOOP);
+            glVertex3f(x - 3, y + 3, 0);
+            glVertex3f(x + THUMB_W + 3, y + 3, 0);
+            glVertex3f(x + THUMB_W + 3, y - THUMB_H - 3, 0);
+            glVertex3f(x - 3, y - THUMB_H - 3, 0);
+        glEnd();
+        glLineWidth(1);
+    }
+    glColor3f(1.0f, 1.0f, 1.0f);
+    glEnable(GL_TEXTURE_2D);
+    check_glerror(__LINE__);
+}
 
-    if (options.verbose)
-        fprintf(stderr, "Texture resolution: %d x %d\n", texture_width, texture_height);
+void draw_hud(void) {
+    hud_stats s;
+
+    s.image_index = image_index;
+    s.num_images = num_images;
+    s.load_ms = switch_load_ms;
+    s.upload_ms = switch_upload_ms;
+    s.decode_ms = switch_load_ms - switch_upload_ms;
+    s.textures = texcache_count();
+    s.resident_bytes = texcache_bytes();
+    s.budget_bytes = (size_t) options.vram_budget * 1024 * 1024;
+    s.cache_hits = cache_hits;
+    s.cache_misses = cache_misses;
+    s.packets = __atomic_load_n(&packets, __ATOMIC_RELAXED);
+    s.packet_verb = options.listenport != -1 ? "received" : "sent";
+    hud_draw(&s, screen_width, screen_height);
+    hud_drawn_ms = clock_now_ms();
+}
 
-    if (tex_buffer != NULL)
-        free(tex_buffer);
+void draw(void) {
+    double start = clock_now_ms();
 
-    tex_buffer = (unsigned char *) malloc(texture_height * texture_width * 3);
-    if (!tex_buffer) {
-        perror("Out of memory trying to allocate texture");
-        exit(-1);
+    redraw = 0;
+    check_glerror(__LINE__);
+    glClear(GL_COLOR_BUFFER_BIT);
+    check_glerror(__LINE__);
+    if (overview)
+        draw_overview();
+    else
+        draw_image();
+    if (hud)
+        draw_hud();
+    SDL_GL_SwapBuffers();
+    frame_count++;
+    if (hud)
+        hud_frame(clock_now_ms() - start);
+    if (ack_pending) {
+        ack_pending = 0;
+        telemetry_ack(recv_socket, ack_view.master_addr, ack_view.ack_port, ack_view.seq,
+                      options.xoffset, ack_view.recv_ms, ack_apply_ms, clock_now_ms(), clock_now_ms() - start);
     }
-    /*
-     * GRAPHICSMAGICK VERSION
-    MagickGetImagePixels(wand, 0, 0, texture_width, texture_height, "RGB", CharPixel, tex_buffer);
-    */
-    MagickExportImagePixels(wand, 0, 0, texture_width, texture_height, "RGB", CharPixel, tex_buffer);
-
-    texture_names = (GLuint *) malloc(sizeof(GLuint));
-    if (!texture_names) {
-        perror("Out of memory allocating space for one texture name");
-        exit(1);
+    if (!first_pixels_logged) {
+        first_pixels_logged = 1;
+        if (options.verbose)
+            fprintf(stderr, "Image %d: first pixels on screen after %0.0f ms\n", image_index, clock_now_ms() - load_start_ms);
     }
-    num_textures = 1;
+    if (options.frame_target)
+        adapt_quality(clock_now_ms() - start);
+}
 
-    glEnable(GL_TEXTURE_2D);
-    glGenTextures(1, texture_names);
-    glBindTexture(GL_TEXTURE_2D, texture_names[0]);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+/* Find the part of level `level` covered by its subtexture j, in that
+ * level's pixel coordinates (row 0 at the top). Subtextures are numbered
+ * left to right, starting with the bottom row, which is the order draw()
+ * walks them in, so the top row is the one that may be short. */
+void level_rect(int level, int j, unsigned int *x, unsigned int *y, unsigned int *w, unsigned int *h) {
+    struct level_s *l = &levels[level];
+    unsigned int row = j / l->cols, col = j % l->cols;
+    unsigned int bottom = l->height - row * options.subtexsize;
+
+    *x = col * options.subtexsize;
+    *w = (*x + options.subtexsize <= l->width) ? options.subtexsize : l->width - *x;
+    *h = (bottom > options.subtexsize) ? options.subtexsize : bottom;
+    *y = bottom - *h;
+}
+
+/* The same, for subtexture i of the full resolution image */
+void subtex_rect(int i, unsigned int *x, unsigned int *y, unsigned int *w, unsigned int *h) {
+    level_rect(0, i, x, y, w, h);
+}
+
+/* Set wrapping and filtering for the bound texture. Mipmapped textures get
+ * trilinear filtering, and have the GPU build their mip chain if it can. */
+void texture_params(int mipmapped) {
     /* wrap horizontally and vertically */
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
     /* Linear texture processing for zooming */
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    check_glerror(__LINE__);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    if (mipmapped && gpu_mipmaps)
+        glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+}
 
-    glTexImage2D(GL_PROXY_TEXTURE_2D, 0, GL_RGB, texture_width, texture_height, 0, GL_RGB, GL_UNSIGNED_BYTE, tex_buffer);
-    if (!options.forcesubtex && !check_glerror(__LINE__)) {
-        subtextured = 0;
-	if (options.verbose)
-	    fprintf(stderr, "Full image texture successful. Not subtexturing.\n");
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texture_width, texture_height, 0, GL_RGB, GL_UNSIGNED_BYTE, tex_buffer);
-        if (!check_glerror(__LINE__))
-	    full_texture_works = 1;
+/* Upload mip levels 1 and up of the bound texture, from level 0's pixels.
+ * GL wants each level's size rounded down, so the odd column and row
+ * pixel_downsample() keeps get dropped. */
+void cpu_mipmaps(const unsigned char *pixels, unsigned int w, unsigned int h, unsigned int stride) {
+    unsigned char *buf, *prev = NULL;
+    unsigned int cw, ch;
+    int level = 0;
+
+    while (w > 1 || h > 1) {
+        cw = (w + 1) / 2;
+        ch = (h + 1) / 2;
+        buf = (unsigned char *) malloc((size_t) cw * ch * 3);
+        if (!buf) {
+            perror("Out of memory building mipmaps");
+            break;
+        }
+        pixel_downsample(PIXEL_RGB8, pixels, w, h, stride, buf);
+        free(prev);
+        prev = buf;
+
+        w = (w > 1) ? w / 2 : 1;
+        h = (h > 1) ? h / 2 : 1;
+        pixels = buf + (size_t) (ch - h) * cw * 3;
+        stride = cw;
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, stride);
+        glTexImage2D(GL_TEXTURE_2D, ++level, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
     }
-    if (!full_texture_works) {
-        if (options.verbose)
-            fprintf(stderr, "Failed to use texture monolithically, or subtexturing forced. Texture will be split into smaller pieces.\n");
-        subtextured = 1;
+    free(prev);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
 
-        tw = texture_width / options.subtexsize;
-        if (texture_width % options.subtexsize != 0)
-            tw++;
-        th = texture_height / options.subtexsize;
-        if (texture_height % options.subtexsize != 0)
-            th++;
-        num_textures = tw * th;
+/* Texture memory for a w by h texture. Drivers generally pad RGB out to four
+ * bytes per texel, and a mip chain adds another third. */
+size_t texture_bytes(unsigned int w, unsigned int h, int mipmapped) {
+    size_t bytes = (size_t) w * h * 4;
 
-        if (options.verbose)
-            fprintf(stderr, "We'll have %d total textures: %d * %d (width: %d, height: %d, subtexsize: %d)\n",
-                num_textures, tw, th, texture_width, texture_height, options.subtexsize);
+    return mipmapped ? bytes + bytes / 3 : bytes;
+}
 
-        texture_names = (GLuint *) realloc(texture_names, sizeof(GLuint) * num_textures);
-        if (!texture_names) {
-            perror("Out of memory allocating space for multiple texture name");
-            exit(1);
+/* Fold freshly uploaded subtexture j of level from into each of the
+ * coarser levels, halving it again for each one. Coarse subtextures are
+ * created, black, the first time part of them arrives. */
+void update_coarse_levels(int from, int j, const unsigned char *pixels, unsigned int w, unsigned int h, unsigned int stride) {
+    unsigned int row = j / levels[from].cols, col = j % levels[from].cols;
+    unsigned int lx, ly, lw, lh, xoff, voff;
+    unsigned char *buf, *prev = NULL;
+    int level, d, k, t;
+
+    for (level = from + 1; level < num_levels; level++) {
+        d = level - from;
+        buf = (unsigned char *) malloc((size_t) ((w + 1) / 2) * ((h + 1) / 2) * 3);
+        if (!buf) {
+            perror("Out of memory building coarse levels");
+            break;
         }
-        i = 0;
-        for (curh = (texture_height - options.subtexsize); curh > 0; curh -= options.subtexsize) {
-            printf("curh: %d\ttexheight: %d\tsubtexsize: %d\n", curh, texture_height, options.subtexsize);
-            for (curw = 0; curw < texture_width; curw += options.subtexsize) {
-                th = (curh > options.subtexsize) ? options.subtexsize : curh;
-                tw = ((curw + options.subtexsize <= texture_width) ? options.subtexsize : (texture_width - curw));
-
-                MagickExportImagePixels(wand, curw, curh, tw, th, "RGB", CharPixel, tex_buffer);
-                glBindTexture(GL_TEXTURE_2D, texture_names[i]);
-                i++;
-                glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-                /* wrap horizontally and vertically */
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-                /* Linear texture processing for zooming */
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, tw, th, 0, GL_RGB, GL_UNSIGNED_BYTE, tex_buffer);
-                check_glerror(__LINE__);
-                if (options.verbose)
-                    fprintf(stderr, "Created another sub texture, number %d, name %d: %d, %d, %d, %d\n", i, texture_names[i], curw, curh, tw, th);
-            }
+        pixel_downsample(PIXEL_RGB8, pixels, w, h, stride, buf);
+        free(prev);
+        prev = buf;
+        pixels = buf;
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        stride = w;
+
+        /* Which coarse subtexture this lands in, and where, counting up from
+         * its bottom edge since that's where the subtexture rows line up */
+        k = (row >> d) * levels[level].cols + (col >> d);
+        t = levels[level].first + k;
+        level_rect(level, k, &lx, &ly, &lw, &lh);
+        xoff = ((col * options.subtexsize) >> d) - (col >> d) * options.subtexsize;
+        voff = ((row * options.subtexsize) >> d) - (row >> d) * options.subtexsize;
+
+        if (!current_set->names[t])
+            glGenTextures(1, &current_set->names[t]);
+        glBindTexture(GL_TEXTURE_2D, current_set->names[t]);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if (!current_set->tile_bytes[t]) {
+            texture_params(gpu_mipmaps);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, lw, lh, 0, GL_RGB, GL_UNSIGNED_BYTE, black_subtexture);
+            texcache_account(current_set, t, texture_bytes(lw, lh, gpu_mipmaps));
         }
+        glTexSubImage2D(GL_TEXTURE_2D, 0, xoff, lh - voff - h, w, h, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+        check_glerror(__LINE__);
     }
+    free(prev);
+}
 
-    horiz_disp = vert_disp = 0;
+/* Upload subtexture j of a level whole, from pixels whose rows are stride
+ * pixels long, and fold it into the levels coarser still. Coarse levels
+ * only come whole from a pyramidal TIFF's reduced resolution copies. */
+void upload_level_subtexture(int level, int j, unsigned char *pixels, unsigned int w, unsigned int h, unsigned int stride) {
+    int i = levels[level].first + j;
+    double start;
+
+    /* The texture cache deletes the names of evicted subtextures */
+    if (!current_set->names[i])
+        glGenTextures(1, &current_set->names[i]);
+    glBindTexture(GL_TEXTURE_2D, current_set->names[i]);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, stride);
+    texture_params(1);
+    start = clock_now_ms();
+    if (gpu.use_pbo)
+        gpu_upload_pbo(pixels, w, h, stride);
+    else
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    if (!gpu_mipmaps)
+        cpu_mipmaps(pixels, w, h, stride);
+    upload_ms += clock_now_ms() - start;
+    check_glerror(__LINE__);
+    texcache_account(current_set, i, texture_bytes(w, h, 1));
+    current_set->tile_whole[i] = 1;
+    if (options.verbose)
+        fprintf(stderr, "Created another sub texture, number %d, name %d: %d x %d\n", i, current_set->names[i], w, h);
 
-    /* Initial zoom factor is whatever makes the image fill the screen vertically */
-    zoom_factor = screen_height * 1.0 / texture_height;
-    fprintf(stderr, "zoom factor: %f\n", zoom_factor);
+    update_coarse_levels(level, j, pixels, w, h, stride);
+}
 
-    /* Set texture coordinates */
-    translate(0, 0, 0);
+/* Upload subtexture i of the full resolution image */
+void upload_subtexture(int i, unsigned char *pixels, unsigned int w, unsigned int h, unsigned int stride) {
+    upload_level_subtexture(0, i, pixels, w, h, stride);
 }
 
-void next_image(void) {
-    image_index++;
-    if (image_index >= num_images)
-        image_index = 0;
+/* Upload one plane of a YCbCr tile, w by h bytes with rows stride bytes
+ * long, into the texture name, getting a new name if it was evicted */
+void upload_plane(GLuint *name, const unsigned char *pixels, unsigned int w, unsigned int h, unsigned int stride) {
+    if (!*name)
+        glGenTextures(1, name);
+    glBindTexture(GL_TEXTURE_2D, *name);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, stride);
+    texture_params(gpu_mipmaps);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, w, h, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, pixels);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 }
 
-void handle_keyboard(SDL_keysym* keysym ) {
-    switch(keysym->sym) {
-        case SDLK_j:
-            texnum++;
+/* upload_subtexture(), for an image uploaded as YCbCr planes: w by h of
+ * luma, and ch rows of each chroma plane, half as wide. There are no coarse
+ * levels to update; the GPU mipmaps each plane, if it can. */
+void upload_planes(int i, const unsigned char *y, const unsigned char *cb, const unsigned char *cr,
+                   unsigned int w, unsigned int h, unsigned int ch, unsigned int stride, unsigned int cstride) {
+    size_t bytes = (size_t) w * h + (size_t) 2 * ((w + 1) / 2) * ch;
+    double start;
+
+    start = clock_now_ms();
+    upload_plane(&current_set->names[i], y, w, h, stride);
+    upload_plane(&current_set->chroma[2 * i], cb, (w + 1) / 2, ch, cstride);
+    upload_plane(&current_set->chroma[2 * i + 1], cr, (w + 1) / 2, ch, cstride);
+    upload_ms += clock_now_ms() - start;
+    check_glerror(__LINE__);
+    /* Luminance textures are a byte a texel */
+    texcache_account(current_set, i, gpu_mipmaps ? bytes + bytes / 3 : bytes);
+    if (options.verbose)
+        fprintf(stderr, "Created another YCbCr sub texture, number %d, name %d: %d x %d\n", i, current_set->names[i], w, h);
+}
+
+/* Start a new set of textures in the residency manager for the current
+ * image, shaped like the current geometry, and put it on screen */
+void new_texture_set(int count) {
+    current_set = texcache_new(image_index, count);
+    current_set->width = texture_width;
+    current_set->height = texture_height;
+    current_set->subtextured = subtextured;
+    current_set->cols = subtex_cols;
+    current_set->rows = subtex_rows;
+    if (ycbcr_image)
+        texcache_add_chroma(current_set);
+    texcache_pin(current_set);
+}
+
+/* Work out the subtexture grid for the full resolution image and for each
+ * coarser level. Each level is half the size of the one before, and they
+ * stop once a level fits in one subtexture, or once subtexture edges would
+ * no longer line up between levels. */
+int setup_levels(void) {
+    struct level_s *l;
+    int total = 0;
+
+    num_levels = 0;
+    do {
+        l = &levels[num_levels];
+        l->width = (texture_width + (1 << num_levels) - 1) >> num_levels;
+        l->height = (texture_height + (1 << num_levels) - 1) >> num_levels;
+        l->cols = l->width / options.subtexsize;
+        if (l->width % options.subtexsize != 0)
+            l->cols++;
+        l->rows = l->height / options.subtexsize;
+        if (l->height % options.subtexsize != 0)
+            l->rows++;
+        l->first = total;
+        total += l->cols * l->rows;
+        num_levels++;
+    } while (!ycbcr_image && num_levels < MAX_LEVELS && l->cols * l->rows > 1 &&
+             options.subtexsize % (1 << num_levels) == 0);
+
+    subtex_cols = levels[0].cols;
+    subtex_rows = levels[0].rows;
+    num_textures = subtex_cols * subtex_rows;
+    return total;
+}
+
+/* Work out the subtexture grid and get names for all of it */
+void setup_subtextures(void) {
+    int total;
+
+    subtextured = 1;
+    total = setup_levels();
+
+    if (options.verbose)
+        fprintf(stderr, "We'll have %d total textures: %d * %d (width: %d, height: %d, subtexsize: %d), plus %d in %d coarser levels\n",
+            num_textures, subtex_cols, subtex_rows, texture_width, texture_height, options.subtexsize,
+            total - num_textures, num_levels - 1);
+
+    black_subtexture = (unsigned char *) realloc(black_subtexture, (size_t) options.subtexsize * options.subtexsize * 3);
+    if (!black_subtexture) {
+        perror("Out of memory allocating blank subtexture");
+        exit(1);
+    }
+    memset(black_subtexture, 0, (size_t) options.subtexsize * options.subtexsize * 3);
+
+    new_texture_set(total);
+}
+
+/* Upload row `row` of subtextures from a strip strip_decode() filled. For
+ * YCbCr planes, the strip holds the luma rows, then the Cb and the Cr rows,
+ * each half as wide and about half as many, which together take half the
+ * room RGB would. */
+void upload_strip(unsigned char *strip, int row) {
+    unsigned int x, y, w, h, ch = 0, cw = (texture_width + 1) / 2;
+    unsigned char *cb = NULL, *cr = NULL;
+    int col;
+
+    subtex_rect(row * subtex_cols, &x, &y, &w, &h);
+    if (ycbcr_image) {
+        ch = chroma_rows(y, h);
+        cb = strip + (size_t) texture_width * h;
+        cr = cb + (size_t) cw * ch;
+    }
+    for (col = 0; col < subtex_cols; col++) {
+        subtex_rect(row * subtex_cols + col, &x, &y, &w, &h);
+        if (ycbcr_image)
+            upload_planes(row * subtex_cols + col, strip + x, cb + x / 2, cr + x / 2, w, h, ch, texture_width, cw);
+        else
+            upload_subtexture(row * subtex_cols + col, strip + x * 3, w, h, texture_width);
+    }
+}
+
+/* Decode the next row of subtextures, row, into strip, which holds
+ * subtexsize full width rows, and upload it */
+void stream_row(image_reader *reader, unsigned char *strip, int row) {
+    unsigned int x, y, w, h;
+
+    subtex_rect(row * subtex_cols, &x, &y, &w, &h);
+    strip_decode(reader, strip, h);
+    upload_strip(strip, row);
+}
+
+unsigned char *alloc_strip(void) {
+    unsigned char *strip;
+
+    strip = (unsigned char *) malloc((size_t) texture_width * options.subtexsize * 3);
+    if (!strip) {
+        perror("Out of memory trying to allocate texture strip");
+        exit(-1);
+    }
+    return strip;
+}
+
+/* Open an image, as YCbCr planes if we're using them and it's a JPEG that
+ * can be read that way */
+int open_reader(image_reader *reader, const char *filename) {
+    if (options.ycbcr && image_reader_open_planar(reader, filename))
+        return 1;
+    return image_reader_open(reader, filename);
+}
+
+/* Decode the image one row of subtextures at a time, uploading each row as
+ * soon as it's complete. Only one row's worth of pixels is ever held here. */
+void stream_subtextures(image_reader *reader) {
+    int row;
+
+    setup_subtextures();
+    tex_buffer = alloc_strip();
+    for (row = subtex_rows - 1; row >= 0; row--)
+        stream_row(reader, tex_buffer, row);
+    free(tex_buffer);
+    tex_buffer = NULL;
+}
+
+/* Decode the image at an eighth of its size, which libjpeg can do far
+ * quicker than the real thing, and make a texture of it to show until the
+ * real thing is ready */
+void load_preview(void) {
+    image_reader r;
+    unsigned char *pixels, *half;
+    unsigned int w, h;
+
+    if (!image_reader_open_scaled(&r, image_at(image_index), 8))
+        return;
+    w = r.width;
+    h = r.height;
+    pixels = (unsigned char *) malloc((size_t) w * h * 3);
+    if (!pixels) {
+        perror("Out of memory trying to allocate preview");
+        image_reader_close(&r);
+        return;
+    }
+    image_reader_read_rows(&r, pixels, h);
+    image_reader_close(&r);
+
+    while (w > PREVIEW_MAX || h > PREVIEW_MAX) {
+        half = (unsigned char *) malloc((size_t) ((w + 1) / 2) * ((h + 1) / 2) * 3);
+        if (!half)
+            break;
+        pixel_downsample(PIXEL_RGB8, pixels, w, h, w, half);
+        free(pixels);
+        pixels = half;
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+
+    glGenTextures(1, &preview_texture);
+    glBindTexture(GL_TEXTURE_2D, preview_texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    texture_params(0);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+    check_glerror(__LINE__);
+    free(pixels);
+    if (options.verbose)
+        fprintf(stderr, "Image %d: %u x %u preview ready after %0.0f ms\n", image_index, w, h, clock_now_ms() - load_start_ms);
+}
+
+/* Stop filling in the image on screen, if we were */
+void end_progressive(void) {
+    if (progressive_loader) {
+        strip_loader_close(progressive_loader);
+        progressive_loader = NULL;
+    }
+    progressive_row = -1;
+    if (preview_texture) {
+        glDeleteTextures(1, &preview_texture);
+        preview_texture = 0;
+    }
+}
+
+/* With --progressive: show a preview now. Either way, have the main loop
+ * upload the rest between frames, decoding it there too unless there's a
+ * --loaderthread. */
+void start_progressive(image_reader *reader) {
+    setup_subtextures();
+    if (options.progressive)
+        load_preview();
+    progressive_loader = strip_loader_open(reader, options.subtexsize, options.loader_thread);
+    progressive_row = subtex_rows - 1;
+}
+
+/* Called from the main loop: upload one more row, if it's been decoded */
+void progressive_step(void) {
+    unsigned char *strip;
+
+    if (!(strip = strip_loader_next(progressive_loader, NULL)))
+        return;
+    upload_strip(strip, progressive_row);
+    strip_loader_done(progressive_loader);
+    progressive_row--;
+    redraw = 1;
+    if (progressive_row < 0) {
+        end_progressive();
+        if (options.verbose)
+            fprintf(stderr, "Image %d: full resolution after %0.0f ms\n", image_index, clock_now_ms() - load_start_ms);
+    }
+}
+
+/* Everything upload_subtexture() and friends need to know about the image
+ * they're loading. The slideshow preloader swaps its own in while it works
+ * on the next image, and puts the one on screen back afterwards. */
+typedef struct {
+    int image_index;
+    texture_set *set;
+    unsigned int width, height;
+    int subtextured, cols, rows, num_textures, num_levels, ycbcr;
+    struct level_s levels[MAX_LEVELS];
+} load_target;
+
+void save_target(load_target *t) {
+    t->image_index = image_index;
+    t->set = current_set;
+    t->width = texture_width;
+    t->height = texture_height;
+    t->subtextured = subtextured;
+    t->cols = subtex_cols;
+    t->rows = subtex_rows;
+    t->num_textures = num_textures;
+    t->num_levels = num_levels;
+    t->ycbcr = ycbcr_image;
+    memcpy(t->levels, levels, sizeof(levels));
+}
+
+void restore_target(const load_target *t) {
+    image_index = t->image_index;
+    current_set = t->set;
+    texture_width = t->width;
+    texture_height = t->height;
+    subtextured = t->subtextured;
+    subtex_cols = t->cols;
+    subtex_rows = t->rows;
+    num_textures = t->num_textures;
+    num_levels = t->num_levels;
+    ycbcr_image = t->ycbcr;
+    memcpy(levels, t->levels, sizeof(levels));
+}
+
+/* With --slideshow, the next image is loaded into the texture cache a row
+ * of subtextures at a time between frames, and held there until it's shown */
+load_target preload;
+strip_loader *preload_loader;   /* Set while there are rows to come */
+int preload_idx = -1,           /* Image being preloaded, or -1 */
+    preload_row = -1,           /* Next row to decode, or -1 once it's done */
+    preload_failed = 0;
+double preload_start_ms,
+       preload_decode_ms = 0,   /* Running averages per row */
+       preload_upload_ms = 0;
+double next_slide_ms = 0;       /* When the master moves on */
+int deadline_missed = 0;
+
+void close_preload_loader(void) {
+    if (preload_loader) {
+        strip_loader_close(preload_loader);
+        preload_loader = NULL;
+    }
+}
+
+/* Stop preloading. What's been preloaded stays in the cache if it's
+ * complete, but is no longer held there. */
+void abort_preload(void) {
+    texture_set *set;
+
+    close_preload_loader();
+    if (preload_idx != -1 && (set = texcache_lookup(preload_idx)) != NULL) {
+        if (set->resident == set->num_textures || set == current_set)
+            texcache_hold(set, 0);
+        else
+            texcache_free(set);
+    }
+    preload_idx = -1;
+    preload_row = -1;
+    preload_failed = 0;
+}
+
+void start_preload(int idx) {
+    load_target saved;
+    texture_set *set;
+    image_reader reader;
+
+    preload_idx = idx;
+    preload_row = -1;
+    preload_start_ms = clock_now_ms();
+    set = texcache_lookup(idx);
+    if (set && set->resident == set->num_textures) {
+        texcache_hold(set, 1);
+        if (options.verbose)
+            fprintf(stderr, "Slideshow: image %d is still resident\n", idx);
+        return;
+    }
+    if (set)
+        texcache_free(set);
+    if (!open_reader(&reader, image_at(idx))) {
+        fprintf(stderr, "Slideshow: couldn't open %s to preload it\n", image_at(idx));
+        preload_failed = 1;
+        return;
+    }
+
+    save_target(&saved);
+    image_index = idx;
+    texture_width = reader.width;
+    texture_height = reader.height;
+    ycbcr_image = reader.planar;
+    setup_subtextures();
+    preload_loader = strip_loader_open(&reader, options.subtexsize, options.loader_thread);
+    save_target(&preload);
+    restore_target(&saved);
+    /* setup_subtextures() pinned the new set in place of ours */
+    texcache_pin(current_set);
+    texcache_hold(preload.set, 1);
+    preload_row = preload.rows - 1;
+}
+
+/* Upload one more row of the next image, decoding it first unless the
+ * loader thread already has, with its geometry in place of the one on
+ * screen */
+void preload_step(void) {
+    load_target saved;
+    unsigned char *strip;
+    double start, decode_ms, upload_ms;
+
+    if (!(strip = strip_loader_next(preload_loader, &decode_ms)))
+        return;
+    save_target(&saved);
+    restore_target(&preload);
+    start = clock_now_ms();
+    upload_strip(strip, preload_row);
+    upload_ms = clock_now_ms() - start;
+    restore_target(&saved);
+    strip_loader_done(preload_loader);
+
+    preload_decode_ms = preload_decode_ms ? preload_decode_ms * 0.7 + decode_ms * 0.3 : decode_ms;
+    preload_upload_ms = preload_upload_ms ? preload_upload_ms * 0.7 + upload_ms * 0.3 : upload_ms;
+    preload_row--;
+    if (preload_row < 0) {
+        close_preload_loader();
+        if (options.verbose)
+            fprintf(stderr, "Slideshow: image %d preloaded in %0.0f ms\n", preload_idx, clock_now_ms() - preload_start_ms);
+    }
+}
+
+/* The image being preloaded is wanted on screen before it's finished. Show
+ * what's been uploaded so far, and hand the loader to the progressive code
+ * to do the remaining rows between frames, instead of throwing them away and
+ * decoding the whole image with the render loop stopped. */
+void adopt_preload(void) {
+    if (options.verbose)
+        fprintf(stderr, "Slideshow: showing image %d with %d of %d rows still to load\n",
+            preload_idx, preload_row + 1, preload.rows);
+    shared_image_release(&shared_current);
+    end_progressive();
+    load_start_ms = clock_now_ms();
+    first_pixels_logged = 0;
+    cache_misses++;
+
+    restore_target(&preload);
+    texcache_pin(current_set);
+    texcache_hold(current_set, 0);
+    progressive_loader = preload_loader;
+    progressive_row = preload_row;
+    preload_loader = NULL;
+    preload_idx = -1;
+    preload_row = -1;
+
+    glEnable(GL_TEXTURE_2D);
+    reset_view();
+}
+
+/* Say why the next image isn't ready on time */
+void report_deadline_miss(void) {
+    if (preload_failed) {
+        fprintf(stderr, "Slideshow: image %d is due, but couldn't be opened to preload it\n", preload_idx);
+        return;
+    }
+    fprintf(stderr, "Slideshow: image %d is due, but is still being %s: %d of %d rows to go, at %0.0f ms decoding and %0.0f ms uploading a row, started %0.0f ms ago\n",
+        preload_idx, preload_decode_ms >= preload_upload_ms ? "decoded" : "uploaded",
+        preload_row + 1, preload.rows, preload_decode_ms, preload_upload_ms, clock_now_ms() - preload_start_ms);
+}
+
+/* Called from the main loop with --slideshow: keep the next image loading,
+ * and on the master, move on to it once it's due and ready. Rows are only
+ * decoded while the view is still, unless leaving them any longer would
+ * make the next image late. */
+void slideshow_tick(void) {
+    int next, master = (options.listenport == -1);
+    double now = clock_now_ms();
+
+    if (num_images < 2)
+        return;
+    next = (image_index + 1) % num_images;
+    if (!options.roi) {
+        if (preload_idx != next) {
+            abort_preload();
+            start_preload(next);
+        }
+        if (preload_row >= 0 && (now - last_motion_ms > SETTLE_MS || !master ||
+                now + (preload_decode_ms + preload_upload_ms) * (preload_row + 1) + SLIDE_MARGIN_MS >= next_slide_ms))
+            preload_step();
+    }
+
+    if (!master || now < next_slide_ms)
+        return;
+    if (preload_row >= 0) {
+        /* Not ready; keep drawing, and switch once it is */
+        if (!deadline_missed)
+            report_deadline_miss();
+        deadline_missed = 1;
+        return;
+    }
+    if (deadline_missed)
+        fprintf(stderr, "Slideshow: moving on to image %d %0.0f ms late\n", next, now - next_slide_ms);
+    deadline_missed = 0;
+    post_command(CMD_STEP_IMAGE, 1, 0, 0, 0, 0);
+    /* setup_texture() starts the clock again once the switch happens */
+    next_slide_ms = now + options.slideshow * 1000;
+}
+
+/* Decoder for the image on screen, kept open in --roi mode so more of it can
+ * be loaded as the view moves */
+image_reader roi_reader;
+int roi_reader_idx = -1;
+
+void close_roi_reader(void) {
+    if (roi_reader_idx != -1)
+        image_reader_close(&roi_reader);
+    roi_reader_idx = -1;
+}
+
+/* The part of the image within margin screen pixels of this screen, in image
+ * pixel coordinates (row 0 at the top), clipped to the image */
+void visible_region(int margin, unsigned int *x0, unsigned int *y0, unsigned int *x1, unsigned int *y1) {
+    float ox, oy, left, right, bottom, top;
+
+    image_origin(&ox, &oy);
+    left = (-margin - ox) / zoom_factor;
+    right = (screen_width + margin - ox) / zoom_factor;
+    bottom = texture_height - (-margin - oy) / zoom_factor;
+    top = texture_height - (screen_height + margin - oy) / zoom_factor;
+
+    *x0 = (left < 0) ? 0 : (left > texture_width) ? texture_width : (unsigned int) left;
+    *x1 = (right < 0) ? 0 : (right > texture_width) ? texture_width : (unsigned int) ceil(right);
+    *y0 = (top < 0) ? 0 : (top > texture_height) ? texture_height : (unsigned int) top;
+    *y1 = (bottom < 0) ? 0 : (bottom > texture_height) ? texture_height : (unsigned int) ceil(bottom);
+}
+
+/* Open the image on screen to decode parts of it, unless it already is */
+void open_roi_reader(void) {
+    if (roi_reader_idx == image_index)
+        return;
+    close_roi_reader();
+    if (!image_reader_open(&roi_reader, image_at(image_index))) {
+        fprintf(stderr, "ERROR: Couldn't load image %s\n", image_at(image_index));
+        exit(1);
+    }
+    roi_reader_idx = image_index;
+}
+
+/* Decode the missing subtextures of a level, which lie within the given
+ * rows and columns, in a single pass down the image, cropped to those
+ * columns. Levels other than 0 are read from a pyramidal TIFF's reduced
+ * resolution copies. */
+int decode_missing_tiles(int level, const char *missing, int row_min, int row_max, int col_min, int col_max) {
+    unsigned int x, y, w, h;
+    unsigned char *buf;
+    int j, row, col, cols = levels[level].cols, loaded = 0;
+
+    prefetch_decode_begin();
+    open_roi_reader();
+    if (!image_reader_select_level(&roi_reader, 1 << level)) {
+        fprintf(stderr, "ERROR: Couldn't reread image %s\n", image_at(image_index));
+        exit(1);
+    }
+
+    image_reader_crop(&roi_reader, col_min * options.subtexsize, (col_max - col_min + 1) * options.subtexsize);
+    buf = (unsigned char *) malloc((size_t) roi_reader.crop_width * options.subtexsize * 3);
+    if (!buf) {
+        perror("Out of memory trying to allocate texture strip");
+        exit(-1);
+    }
+
+    /* Subtexture rows count up from the bottom, and the image reads from the top */
+    for (row = row_max; row >= row_min; row--) {
+        for (col = col_min; col <= col_max; col++) {
+            if (missing[row * cols + col])
+                break;
+        }
+        if (col > col_max)
+            continue;
+
+        level_rect(level, row * cols, &x, &y, &w, &h);
+        image_reader_skip_rows(&roi_reader, y - roi_reader.next_row);
+        if (image_reader_read_rows(&roi_reader, buf, h) < h)
+            fprintf(stderr, "Image ended early; some subtextures will be incomplete\n");
+
+        for (col = col_min; col <= col_max; col++) {
+            j = row * cols + col;
+            if (!missing[j])
+                continue;
+            level_rect(level, j, &x, &y, &w, &h);
+            upload_level_subtexture(level, j, buf + (x - roi_reader.crop_x) * 3, w, h, roi_reader.crop_width);
+            loaded++;
+        }
+    }
+    free(buf);
+    prefetch_decode_end();
+    return loaded;
+}
+
+/* Fetch the missing subtextures from the tile server instead. Ones it can't
+ * give us are left for next time the view moves. */
+int fetch_missing_tiles(const char *missing) {
+    unsigned int x, y, w, h;
+    unsigned char *buf;
+    int i, loaded = 0;
+
+    buf = (unsigned char *) malloc((size_t) options.subtexsize * options.subtexsize * 3);
+    if (!buf) {
+        perror("Out of memory trying to allocate subtexture");
+        exit(-1);
+    }
+    for (i = 0; i < num_textures; i++) {
+        if (!missing[i])
+            continue;
+        subtex_rect(i, &x, &y, &w, &h);
+        if (!tile_client_fetch(image_index, x, y, w, h, buf))
+            continue;
+        upload_subtexture(i, buf, w, h, w);
+        loaded++;
+    }
+    free(buf);
+    return loaded;
+}
+
+/* In --roi mode, load whichever subtextures have come into reach of the
+ * screen and aren't loaded yet. When zoomed out, a pyramidal TIFF's reduced
+ * resolution copy is read in place of the full image, if it has the one
+ * we'd draw. */
+void load_visible_tiles(void) {
+    unsigned int x0, y0, x1, y1, x, y, w, h;
+    int j, row, col, loaded, count, level = 0;
+    int row_min, row_max = -1, col_min, col_max = -1;
+    char *missing;
+
+    if (!options.roi || !subtextured || !current_set)
+        return;
+
+    visible_region(options.roi_margin, &x0, &y0, &x1, &y1);
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    if (!options.tile_client) {
+        open_roi_reader();
+        level = zoom_level();
+        if (level > 0 && !image_reader_select_level(&roi_reader, 1 << level))
+            level = 0;
+    }
+    x0 >>= level;
+    y0 >>= level;
+    x1 = (x1 + (1 << level) - 1) >> level;
+    y1 = (y1 + (1 << level) - 1) >> level;
+    row_min = levels[level].rows;
+    col_min = levels[level].cols;
+
+    count = levels[level].cols * levels[level].rows;
+    missing = (char *) calloc(count, 1);
+    if (!missing) {
+        perror("Couldn't allocate region of interest map");
+        return;
+    }
+    for (j = 0; j < count; j++) {
+        level_rect(level, j, &x, &y, &w, &h);
+        if (current_set->tile_whole[levels[level].first + j] || x >= x1 || x + w <= x0 || y >= y1 || y + h <= y0)
+            continue;
+        missing[j] = 1;
+        row = j / levels[level].cols;
+        col = j % levels[level].cols;
+        if (row < row_min) row_min = row;
+        if (row > row_max) row_max = row;
+        if (col < col_min) col_min = col;
+        if (col > col_max) col_max = col;
+    }
+    if (row_max == -1) {
+        free(missing);
+        return;
+    }
+
+    if (options.tile_client)
+        loaded = fetch_missing_tiles(missing);
+    else
+        loaded = decode_missing_tiles(level, missing, row_min, row_max, col_min, col_max);
+    free(missing);
+
+    if (options.verbose)
+        fprintf(stderr, "Loaded %d more level %d subtextures for region %u,%u - %u,%u\n", loaded, level, x0, y0, x1, y1);
+    redraw = 1;
+}
+
+void load_texture(void);
+
+/* Put image_index on screen, and have the files around it read ahead once
+ * we're done with the disk */
+void setup_texture(void) {
+    double start = clock_now_ms(), uploaded = upload_ms;
+
+    prefetch_around(image_index, num_images);
+    if (image_index == preload_idx && preload_row >= 0) {
+        adopt_preload();
+    }
+    else {
+        /* A finished preload is found in the cache */
+        if (image_index == preload_idx)
+            abort_preload();
+        prefetch_decode_begin();
+        load_texture();
+        prefetch_decode_end();
+    }
+    /* Anything that isn't uploading is decoding, near enough */
+    switch_load_ms = clock_now_ms() - start;
+    switch_upload_ms = upload_ms - uploaded;
+    if (options.slideshow)
+        next_slide_ms = clock_now_ms() + options.slideshow * 1000;
+}
+
+void load_texture(void) {
+    image_reader reader;
+    unsigned int x, y, w, h;
+    int i;
+    int full_texture_works = 0;
+    double start;
+    int sharing = options.share_decode && !options.roi && !options.stream && !options.progressive &&
+                  !options.loader_thread;
+
+    /* Let other processes know we're done with the last image */
+    shared_image_release(&shared_current);
+    end_progressive();
+    load_start_ms = clock_now_ms();
+    first_pixels_logged = 0;
+
+    current_set = texcache_lookup(image_index);
+    if (current_set && !options.roi && current_set->resident < current_set->num_textures) {
+        /* Partly evicted; cheaper to start over than to patch it up */
+        texcache_free(current_set);
+        current_set = NULL;
+    }
+    if (current_set)
+        cache_hits++;
+    else
+        cache_misses++;
+    if (current_set) {
+        if (options.verbose)
+            fprintf(stderr, "Image %d is still resident; not reloading it\n", image_index);
+        texcache_pin(current_set);
+        texture_width = current_set->width;
+        texture_height = current_set->height;
+        subtextured = current_set->subtextured;
+        ycbcr_image = current_set->chroma != NULL;
+        num_textures = 1;
+        if (subtextured)
+            setup_levels();
+        reset_view();
+        return;
+    }
+
+    ycbcr_image = 0;
+    if (options.tile_client) {
+        if (!tile_client_info(image_index, &texture_width, &texture_height)) {
+            fprintf(stderr, "ERROR: Couldn't get image %d from the tile server\n", image_index);
+            exit(1);
+        }
+    }
+    else if (sharing) {
+        if (!shared_image_load(&shared_current, image_at(image_index))) {
+            fprintf(stderr, "ERROR: Couldn't load image %s\n", image_at(image_index));
+            exit(1);
+        }
+        texture_width = shared_current.width;
+        texture_height = shared_current.height;
+    }
+    else {
+        if (!open_reader(&reader, image_at(image_index))) {
+            fprintf(stderr, "ERROR: Couldn't load image %s\n", image_at(image_index));
+            exit(1);
+        }
+        texture_width = reader.width;
+        texture_height = reader.height;
+        ycbcr_image = reader.planar;
+    }
+
+    if (options.verbose)
+        fprintf(stderr, "Texture resolution: %d x %d\n", texture_width, texture_height);
+
+    if (tex_buffer != NULL)
+        free(tex_buffer);
+    tex_buffer = NULL;
+
+    num_textures = 1;
+    subtextured = 0;
+
+    glEnable(GL_TEXTURE_2D);
+
+    if (options.roi) {
+        /* Nothing is loaded yet; reset_view() will call load_visible_tiles() */
+        setup_subtextures();
+        close_roi_reader();
+        if (!options.tile_client) {
+            roi_reader = reader;
+            roi_reader_idx = image_index;
+        }
+    }
+    else if (options.progressive || options.loader_thread) {
+        start_progressive(&reader);
+    }
+    else if (options.stream) {
+        stream_subtextures(&reader);
+        image_reader_close(&reader);
+    }
+    else {
+        if (sharing) {
+            /* Mapped from shared memory, and held until the next image, so
+             * other processes arriving late still find it */
+            tex_buffer = shared_current.pixels;
+        }
+        else {
+            tex_buffer = (unsigned char *) malloc((size_t) texture_height * texture_width * 3);
+            if (!tex_buffer) {
+                perror("Out of memory trying to allocate texture");
+                exit(-1);
+            }
+            image_reader_read_rows(&reader, tex_buffer, texture_height);
+            image_reader_close(&reader);
+        }
+
+        new_texture_set(1);
+        glBindTexture(GL_TEXTURE_2D, current_set->names[0]);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        texture_params(1);
+        check_glerror(__LINE__);
+
+        glTexImage2D(GL_PROXY_TEXTURE_2D, 0, GL_RGB, texture_width, texture_height, 0, GL_RGB, GL_UNSIGNED_BYTE, tex_buffer);
+        if (!options.forcesubtex && !check_glerror(__LINE__)) {
+            subtextured = 0;
+            if (options.verbose)
+                fprintf(stderr, "Full image texture successful. Not subtexturing.\n");
+            start = clock_now_ms();
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texture_width, texture_height, 0, GL_RGB, GL_UNSIGNED_BYTE, tex_buffer);
+            if (!check_glerror(__LINE__)) {
+                full_texture_works = 1;
+                if (!gpu_mipmaps)
+                    cpu_mipmaps(tex_buffer, texture_width, texture_height, texture_width);
+                upload_ms += clock_now_ms() - start;
+                texcache_account(current_set, 0, texture_bytes(texture_width, texture_height, 1));
+            }
+        }
+        if (!full_texture_works) {
+            if (options.verbose)
+                fprintf(stderr, "Failed to use texture monolithically, or subtexturing forced. Texture will be split into smaller pieces.\n");
+            texcache_free(current_set);
+            setup_subtextures();
+
+            for (i = 0; i < num_textures; i++) {
+                subtex_rect(i, &x, &y, &w, &h);
+                upload_subtexture(i, tex_buffer + ((size_t) y * texture_width + x) * 3, w, h, texture_width);
+            }
+        }
+        if (!sharing)
+            free(tex_buffer);
+        tex_buffer = NULL;
+    }
+
+    if (options.verbose && progressive_row == -1 && !options.roi)
+        fprintf(stderr, "Image %d: full resolution after %0.0f ms\n", image_index, clock_now_ms() - load_start_ms);
+    reset_view();
+}
+
+/* Check that every subtexture of the image on screen lies inside the image,
+ * that together they cover it, and that each one in the GL is the size it
+ * should be. Returns the number of problems found, after describing them. */
+int check_coverage(void) {
+    GLint w, h;
+    unsigned int x, y, tw, th;
+    unsigned long area;
+    int level, j, i, problems = 0;
+
+    if (!subtextured) {
+        glBindTexture(GL_TEXTURE_2D, current_set->names[0]);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &w);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &h);
+        if ((unsigned int) w != texture_width || (unsigned int) h != texture_height) {
+            fprintf(stderr, "Texture is %d x %d, but the image is %u x %u\n", w, h, texture_width, texture_height);
+            problems++;
+        }
+        return problems;
+    }
+
+    for (level = 0; level < num_levels; level++) {
+        area = 0;
+        for (j = 0; j < levels[level].cols * levels[level].rows; j++) {
+            i = levels[level].first + j;
+            level_rect(level, j, &x, &y, &tw, &th);
+            if (tw == 0 || th == 0 || x + tw > levels[level].width || y + th > levels[level].height) {
+                fprintf(stderr, "Level %d subtexture %d is %u x %u at %u, %u, outside the %u x %u level\n",
+                    level, j, tw, th, x, y, levels[level].width, levels[level].height);
+                problems++;
+            }
+            area += (unsigned long) tw * th;
+            if (!current_set->tile_bytes[i]) {
+                /* In --roi mode, only what's on screen is loaded */
+                if (!options.roi) {
+                    fprintf(stderr, "Level %d subtexture %d was never loaded\n", level, j);
+                    problems++;
+                }
+                continue;
+            }
+            glBindTexture(GL_TEXTURE_2D, current_set->names[i]);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &w);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &h);
+            if ((unsigned int) w != tw || (unsigned int) h != th) {
+                fprintf(stderr, "Level %d subtexture %d is %d x %d, but should be %u x %u\n", level, j, w, h, tw, th);
+                problems++;
+            }
+        }
+        if (area != (unsigned long) levels[level].width * levels[level].height) {
+            fprintf(stderr, "Level %d subtextures cover %lu pixels of its %lu\n",
+                level, area, (unsigned long) levels[level].width * levels[level].height);
+            problems++;
+        }
+    }
+    return problems;
+}
+
+/* With --selftest: load each image, as the main loop would, and report on
+ * it in a form tests/run-checks.sh can read */
+int self_test(void) {
+    GLint max_size;
+    struct rusage ru;
+    double start, ms;
+    int i, problems, failures = 0;
+
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    for (i = 0; i < num_images; i++) {
+        image_index = i;
+        start = clock_now_ms();
+        setup_texture();
+        while (progressive_row >= 0)
+            progressive_step();
+        glFinish();
+        ms = clock_now_ms() - start;
+        problems = check_coverage() + check_glerror(__LINE__);
+        getrusage(RUSAGE_SELF, &ru);
+        printf("selftest: %s %ux%u subtextured=%d textures=%d levels=%d load_ms=%0.0f peak_rss_kb=%ld max_texture=%d coverage=%s\n",
+            image_at(i), texture_width, texture_height, subtextured, current_set->num_textures,
+            subtextured ? num_levels : 1, ms, ru.ru_maxrss, max_size, problems ? "bad" : "ok");
+        if (problems)
+            failures++;
+    }
+    return failures ? 1 : 0;
+}
+
+/* Put a freshly loaded image back to its initial position and zoom, and
+ * have the control side follow suit */
+void reset_view(void) {
+    horiz_disp = vert_disp = 0;
+
+    /* Initial zoom factor is whatever makes the image fill the screen vertically */
+    zoom_factor = screen_height * 1.0 / texture_height;
+    fprintf(stderr, "zoom factor: %f\n", zoom_factor);
+
+    redraw = 1;
+    load_visible_tiles();
+    post_command(CMD_RESET, image_index, 0, 0, 0, zoom_factor);
+}
+
+/* Hold on to the newest view the control side has published, until it's
+ * due, and return the newest one that is */
+int next_due_view(view_state *v) {
+    view_state fresh;
+
+    if (view_buffer_latest(&fresh))
+        view_schedule_add(&schedule, &fresh);
+    return view_schedule_next(&schedule, clock_now_ms(), v);
+}
+
+/* Bring the globals draw() uses up to date with the newest view the control
+ * side has published that's due, loading a different image first if need be */
+void apply_view(void) {
+    view_state v;
+
+    if (!next_due_view(&v))
+        return;
+    if (v.generation != catalog_generation) {
+        /* Its image index predates the list changing under it; the control
+         * side publishes a renumbered view as soon as it catches up */
+        if (options.verbose)
+            fprintf(stderr, "Dropping a view from before the image list was renumbered\n");
+        return;
+    }
+    if (v.ack_port && !v.heartbeat && v.seq != ack_view.seq) {
+        /* draw() acknowledges it once it's on screen */
+        ack_view = v;
+        ack_pending = 1;
+    }
+
+    if (v.hud != hud) {
+        hud = v.hud;
+        redraw = 1;
+    }
+    if (v.img_idx != image_index) {
+        if (v.img_idx >= num_images && catalog_scanning()) {
+            /* Our directory scan hasn't got that far yet */
+            if (options.verbose)
+                fprintf(stderr, "Image %d hasn't been found yet; staying on image %d\n", v.img_idx, image_index);
+            return;
+        }
+        if (v.img_idx >= num_images || v.img_idx < 0) {
+            fprintf(stderr, "ERROR: Tried to cycle past the end of the image list (image_index = %d, num_images = %d). Is the list of images on your command line identical to the master, and do all the images actually exist?\n", v.img_idx, num_images);
+            exit(1);
+        }
+        if (options.slideshow && v.img_idx == preload_idx && preload_row >= 0) {
+            /* Like the master, keep drawing the old image until the new
+             * one's preloaded; slideshow_tick() works on it every frame */
+            view_schedule_hold(&schedule, &v);
+            return;
+        }
+        image_index = v.img_idx;
+        setup_texture();
+        ack_apply_ms = clock_now_ms();
+        /* reset_view() has asked for a fresh view of the new image */
+        return;
+    }
+
+    if (v.horiz_disp != horiz_disp || v.vert_disp != vert_disp || v.zoom_factor != zoom_factor)
+        last_motion_ms = clock_now_ms();
+    horiz_disp = v.horiz_disp;
+    vert_disp = v.vert_disp;
+    zoom_factor = v.zoom_factor;
+    tex_min_x = v.tex_min_x;
+    tex_min_y = v.tex_min_y;
+    tex_max_x = v.tex_max_x;
+    tex_max_y = v.tex_max_y;
+    redraw = 1;
+    load_visible_tiles();
+    ack_apply_ms = clock_now_ms();
+}
+
+/* Keep image_index on the same image as watched directories change, and
+ * reload the image on screen if it was replaced or removed */
+void catalog_changed(int change, int idx) {
+    texture_set *set;
+
+    switch (change) {
+        case CATALOG_ADDED:
+            if (options.verbose)
+                fprintf(stderr, "Added image %d, %s\n", idx, image_at(idx));
+            if (idx == num_images - 1)
+                break;
+            abort_preload();
+            texcache_insert(idx);
+            if (options.tile_client)
+                tile_client_flush();
+            if (roi_reader_idx >= idx)
+                roi_reader_idx++;
+
+            catalog_generation++;
+            if (idx <= image_index) {
+                image_index++;
+                post_command(CMD_RENUMBER, image_index - 1, image_index, 0, 0, 0);
+            }
+            else {
+                post_command(CMD_RENUMBER, image_index, image_index, 0, 0, 0);
+            }
+            break;
+        case CATALOG_REMOVED:
+            abort_preload();
+            texcache_renumber(idx);
+            if (options.tile_client)
+                tile_client_flush();
+            if (roi_reader_idx == idx)
+                close_roi_reader();
+            else if (roi_reader_idx > idx)
+                roi_reader_idx--;
+
+            catalog_generation++;
+            if (idx < image_index) {
+                image_index--;
+                post_command(CMD_RENUMBER, image_index + 1, image_index, 0, 0, 0);
+            }
+            else if (idx > image_index) {
+                post_command(CMD_RENUMBER, image_index, image_index, 0, 0, 0);
+            }
+            else {
+                if (num_images == 0) {
+                    fprintf(stderr, "ERROR: The last image was removed\n");
+                    exit(1);
+                }
+                /* Show whichever image took its place */
+                if (image_index >= num_images)
+                    image_index = 0;
+                post_command(CMD_RENUMBER, idx, image_index, 0, 0, 0);
+                current_set = NULL;
+                setup_texture();
+            }
+            break;
+        case CATALOG_MODIFIED:
+            abort_preload();
+            if (roi_reader_idx == idx)
+                close_roi_reader();
+            if (options.tile_client)
+                tile_client_flush();
+            set = texcache_lookup(idx);
+            if (set)
+                texcache_free(set);
+            if (idx == image_index) {
+                current_set = NULL;
+                setup_texture();
+            }
+            break;
+    }
+}
+
+/* Pick up images a background directory scan has found, and once it's done,
+ * follow each image to its place in the final sorted order */
+void poll_catalog_scan(void) {
+    int *remap, added, old_index;
+
+    added = catalog_scan_poll(&remap);
+    if (added && options.verbose > 1)
+        fprintf(stderr, "Directory scan found %d more images, %d so far\n", added, num_images);
+    if (!remap)
+        return;
+
+    abort_preload();
+    texcache_remap(remap);
+    if (options.tile_client)
+        tile_client_flush();
+    if (roi_reader_idx != -1 && remap[roi_reader_idx] == -1)
+        close_roi_reader();
+    else if (roi_reader_idx != -1)
+        roi_reader_idx = remap[roi_reader_idx];
+    catalog_generation++;
+    old_index = image_index;
+    if (current_set) {
+        image_index = remap[image_index];
+        if (image_index == -1) {
+            /* Shouldn't happen, since the final list has everything the
+             * scan found, but don't leave the index dangling */
+            image_index = 0;
+            post_command(CMD_RENUMBER, old_index, image_index, 0, 0, 0);
+            setup_texture();
+        }
+        else {
+            post_command(CMD_RENUMBER, old_index, image_index, 0, 0, 0);
+        }
+    }
+    else {
+        post_command(CMD_RENUMBER, old_index, old_index, 0, 0, 0);
+    }
+    free(remap);
+}
+
+/* In the overview, the keys that would move the image move the selection
+ * instead, and enter shows it */
+void overview_keyboard(SDL_keysym *keysym) {
+    int cols, rows;
+
+    overview_layout(&cols, &rows);
+    switch (keysym->sym) {
+        case SDLK_a:
+        case SDLK_LEFT:
+            overview_selected--;
+            break;
+        case SDLK_d:
+        case SDLK_RIGHT:
+            overview_selected++;
+            break;
+        case SDLK_w:
+        case SDLK_UP:
+            if (overview_selected >= cols)
+                overview_selected -= cols;
+            break;
+        case SDLK_s:
+        case SDLK_DOWN:
+            if (overview_selected + cols < num_images)
+                overview_selected += cols;
+            break;
+        case SDLK_PAGEUP:
+            overview_selected -= cols * (rows - 1);
+            break;
+        case SDLK_PAGEDOWN:
+            overview_selected += cols * (rows - 1);
+            break;
+        case SDLK_RETURN:
+            post_command(CMD_GOTO_IMAGE, overview_selected, 0, 0, 0, 0);
+            overview = 0;
+            break;
+        case SDLK_o:
+        case SDLK_ESCAPE:
+            overview = 0;
+            break;
+        case SDLK_q:
+            quit_main_loop = 1;
+            break;
+        default:
+            break;
+    }
+    /* draw_overview() clamps the selection */
+    redraw = 1;
+}
+
+void handle_keyboard(SDL_keysym* keysym ) {
+    if (overview) {
+        overview_keyboard(keysym);
+        return;
+    }
+    switch(keysym->sym) {
+        case SDLK_j:
+            texnum++;
             if (texnum >= num_textures)
                 texnum = 0;
             printf("Texture is now %d of %d\n", texnum+1, num_textures);
@@ -726,26 +2846,36 @@ void handle_keyboard(SDL_keysym* keysym ) {
             quit_main_loop = 1;
             break;
         case SDLK_a:
-            translate(-0.1, 0, 0);
+            post_command(CMD_TRANSLATE, 0, 0, -0.1, 0, 0);
             break;
         case SDLK_d:
-            translate(0.1, 0, 0);
+            post_command(CMD_TRANSLATE, 0, 0, 0.1, 0, 0);
             break;
         case SDLK_w:
-            translate(0, 0.1, 0);
+            post_command(CMD_TRANSLATE, 0, 0, 0, 0.1, 0);
             break;
         case SDLK_s:
-            translate(0, -0.1, 0);
+            post_command(CMD_TRANSLATE, 0, 0, 0, -0.1, 0);
             break;
         case SDLK_z:
-            translate(0, 0, 0.5);
+            post_command(CMD_TRANSLATE, 0, 0, 0, 0, 0.5);
             break;
         case SDLK_c:
-            translate(0, 0, 2);
+            post_command(CMD_TRANSLATE, 0, 0, 0, 0, 2);
+            break;
+        case SDLK_t:
+            post_command(CMD_DUMP_TELEMETRY, 0, 0, 0, 0, 0);
+            break;
+        case SDLK_h:
+            post_command(CMD_TOGGLE_HUD, 0, 0, 0, 0, 0);
+            break;
+        case SDLK_o:
+            overview = 1;
+            overview_selected = image_index;
+            redraw = 1;
             break;
         case SDLK_x:
-            next_image();
-            setup_texture();
+            post_command(CMD_STEP_IMAGE, 1, 0, 0, 0, 0);
         default:
             break;
     }
@@ -804,19 +2934,97 @@ int setup_listen_port(void) {
     return recv_socket;
 }
 
+/* Deal with whatever the space navigator and the sync socket have for us.
+ * Runs on the control side. */
+void poll_input(void) {
+    spnav_event spev;
+    struct pollfd fds[1];
+    int retval;
+
+    if (options.use_spacenav && get_spacenav_event(&spev, NULL)) {
+        if (spev.type == SPNAV_MOTION) {
+            // Raw spacenav values range from -350 to 350
+            if (abs(spev.x) + abs(spev.y) + abs(spev.z) != 0) {
+                translate(-1.0 * options.swapaxes * spev.x * options.sensitivity / 350.0,
+                                 options.swapaxes * spev.y * options.sensitivity / 350.0,
+                                                    spev.z * options.sensitivity / 350.0);
+            }
+        } else {
+            // value == 0  means the button is coming up. Without this, it
+            // would cycle images both on press *and* on release, which
+            // gets irritating.
+            if (spev.type == SPNAV_BUTTON && spev.value == 0) {
+                // Left spnav button goes to previous image, right one goes to next image
+                step_image(spev.button * 2 - 1);
+            }
+        }
+    }
+    if (options.listenport != -1) {
+        fds[0].fd = recv_socket;
+        fds[0].events = POLLIN;
+        retval = poll(fds, 1, 0);
+        if (retval == -1)
+            perror("Poll UDP socket");
+        else if (retval) {
+            if (options.verbose > 1)
+                printf("We received something!\n");
+            udp_handler(recv_socket);
+        }
+        /* Once we know where the master is */
+        if (control.ack_port)
+            clock_sync_ping(recv_socket, control.master_addr, control.ack_port);
+        if (options.master_port)
+            request_state();
+    }
+    if (options.ack_port)
+        poll_telemetry();
+    if (options.heartbeat)
+        send_heartbeat();
+}
+
+/* With --inputthread, the control side lives here, waking up for commands
+ * from the main loop, sync traffic, or every millisecond to check the space
+ * navigator, which doesn't tell us when it has something. Telemetry and
+ * clock pings are seen to every tenth of a second. */
+void *input_main(void *arg) {
+    struct pollfd fds[2];
+    control_cmd cmd;
+    int nfds = 1, timeout = -1;
+
+    fds[0].fd = control_pipe[0];
+    fds[0].events = POLLIN;
+    if (options.listenport != -1) {
+        fds[1].fd = recv_socket;
+        fds[1].events = POLLIN;
+        nfds = 2;
+    }
+    if (options.use_spacenav)
+        timeout = 1;
+    else if (options.ack_port || options.listenport != -1 || (has_slaves && options.heartbeat))
+        timeout = 100;
+    while (1) {
+        if (poll(fds, nfds, timeout) == -1) {
+            perror("Input thread poll");
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            if (read(control_pipe[0], &cmd, sizeof(cmd)) == sizeof(cmd))
+                run_command(&cmd);
+        }
+        poll_input();
+    }
+    return NULL;
+}
+
 int main(int argc, char * argv[]) {
     /* XXX Copy lg-xiv options, where needed */
     const SDL_VideoInfo* info = NULL;
     int bpp = 0;
     int flags = 0;
-
-    spnav_event spev;
-
-    struct pollfd fds[1];
-    int retval;
-    int recv_socket = 0;
+    pthread_t input_thread;
 
     GLfloat h;
+    const char *gl_version, *gl_extensions;
 
     SDL_Event event;
 
@@ -885,6 +3093,72 @@ int main(int argc, char * argv[]) {
     glTranslatef(0, 0, -6);
     check_glerror(__LINE__);
 
+    if (options.gpu_probe != GPU_PROBE_OFF) {
+        gpu_profile_get(&gpu, options.gpu_probe == GPU_PROBE_FORCE, options.verbose);
+        if (options.verbose)
+            gpu_profile_print(&gpu, stderr);
+        gl_version = gpu.version;
+        gpu_mipmaps = !options.cpu_mipmaps && gpu.mipmap_generation;
+        gl_lod_bias = gpu.lod_bias;
+        if (!subtexsize_given)
+            options.subtexsize = gpu.subtexsize;
+        options.forcesubtex |= gpu.forcesubtex;
+    }
+    else {
+        /* Automatic mipmap generation is core from OpenGL 1.4 */
+        gl_version = (const char *) glGetString(GL_VERSION);
+        gl_extensions = (const char *) glGetString(GL_EXTENSIONS);
+        gpu_mipmaps = !options.cpu_mipmaps &&
+            ((gl_version && atof(gl_version) >= 1.4) || (gl_extensions && strstr(gl_extensions, "GL_SGIS_generate_mipmap")));
+        /* So is biasing mip level selection */
+        gl_lod_bias = (gl_version && atof(gl_version) >= 1.4) || (gl_extensions && strstr(gl_extensions, "GL_EXT_texture_lod_bias"));
+    }
+    if (options.verbose)
+        fprintf(stderr, "OpenGL version %s; building mipmaps on the %s\n", gl_version, gpu_mipmaps ? "GPU" : "CPU");
+
+    if (options.ycbcr)
+        options.ycbcr = ycbcr_init(options.verbose);
+    texcache_init((size_t) options.vram_budget * 1024 * 1024, options.verbose);
+    shared_image_init(options.verbose);
+    if (!options.thumb_threads)
+        options.thumb_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    thumbnails_init(options.thumb_threads, options.verbose);
+    prefetch_init(options.readahead, (size_t) options.readahead_mb * 1024 * 1024, options.verbose);
+    clock_sync_init(options.verbose);
+    if (options.ack_port) {
+        if (telemetry_init(options.ack_port, options.verbose) == -1)
+            exit(1);
+        telemetry_on_state_request(answer_state_request);
+        signal(SIGUSR1, request_dump);
+    }
+    if (options.tile_server_port && !tile_server_start(options.tile_server_port, options.tile_compress, options.verbose))
+        exit(1);
+    if (options.tile_client && !tile_client_init(options.tile_server_addr, options.tile_client_port,
+                                                  (size_t) options.tile_cache * 1024 * 1024, options.verbose)) {
+        fprintf(stderr, "ERROR: Couldn't reach the tile server at %s:%u\n", options.tile_server_addr, options.tile_client_port);
+        exit(1);
+    }
+
+    /* With --bgscan, we may still be waiting for the first image */
+    while (num_images == 0 && catalog_scanning()) {
+        poll_catalog_scan();
+        usleep(1000);
+    }
+    if (num_images == 0) {
+        fprintf(stderr, "ERROR: No images found\n");
+        exit(1);
+    }
+    /* Commands queue up here until the input thread starts */
+    if (options.input_thread && pipe(control_pipe) == -1) {
+        perror("Couldn't create input thread pipe");
+        exit(1);
+    }
+    if (options.selftest)
+        exit(self_test());
+    if (options.listenport != -1)
+        recv_socket = setup_listen_port();
+    if (options.master_port)
+        wait_for_state();
     setup_texture();
     check_glerror(__LINE__);
 
@@ -897,15 +3171,28 @@ int main(int argc, char * argv[]) {
             fprintf(stderr, "Successfully initialized the spacenav\n");
     }
 
-    if (options.listenport != -1) {
-        recv_socket = setup_listen_port();
-        fds[0].fd = recv_socket;
-        fds[0].events = POLLIN;
+    if (options.input_thread && pthread_create(&input_thread, NULL, input_main, NULL) != 0) {
+        perror("Couldn't start input thread");
+        exit(1);
     }
 
     while (!quit_main_loop) {
+        if (!options.input_thread)
+            poll_input();
+        apply_view();
+        if (options.frame_target)
+            settle_quality();
+        if (overview && thumbnails_upload(frame_count))
+            redraw = 1;
+        /* Keep the numbers fresh, even when nothing else is changing */
+        if (hud && clock_now_ms() - hud_drawn_ms > HUD_REFRESH_MS)
+            redraw = 1;
         if (redraw)
             draw();
+        if (progressive_row >= 0)
+            progressive_step();
+        else if (options.slideshow)
+            slideshow_tick();
         while( SDL_PollEvent( &event ) ) {
             switch (event.type) {
                 case SDL_KEYDOWN:
@@ -925,38 +3212,13 @@ int main(int argc, char * argv[]) {
                     break;
             }
         }
-        if (options.use_spacenav && get_spacenav_event(&spev, NULL)) {
-            if (spev.type == SPNAV_MOTION) {
-                // Raw spacenav values range from -350 to 350
-                if (abs(spev.x) + abs(spev.y) + abs(spev.z) != 0) {
-                    translate(-1.0 * options.swapaxes * spev.x * options.sensitivity / 350.0,
-                                     options.swapaxes * spev.y * options.sensitivity / 350.0,
-                                                        spev.z * options.sensitivity / 350.0);
-                }
-            } else {
-                // value == 0  means the button is coming up. Without this, it
-                // would cycle images both on press *and* on release, which
-                // gets irritating.
-                if (spev.type == SPNAV_BUTTON && spev.value == 0) {
-                    // Left spnav button goes to previous image, right one goes to next image
-                    image_index += spev.button * 2 - 1;
-                    setup_texture();
-		    check_glerror(__LINE__);
-                }
-            }
-        }
-        if (options.listenport != -1) {
-            retval = poll(fds, 1, 0);
-            if (retval == -1)
-                perror("Poll UDP socket");
-            else if (retval) {
-                if (options.verbose > 1)
-                    printf("We received something!\n");
-                udp_handler(recv_socket);
-            }
-        }
+        if (catalog_scanning())
+            poll_catalog_scan();
+        if (options.watch)
+            catalog_watch_events(catalog_changed);
         usleep(200);
     }
+    shared_image_release(&shared_current);
     free(tex_buffer);
     return 0;
 }
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pixel-kernels.h"
+
+namespace {
+
+/* Where each channel lives in a pixel. Formats without alpha still name a
+ * slot for it, so the kernels compile for them, but never use it. */
+struct RGB8  { enum { bytes = 3, r = 0, g = 1, b = 2, a = 0, alpha = 0 }; };
+struct RGBA8 { enum { bytes = 4, r = 0, g = 1, b = 2, a = 3, alpha = 1 }; };
+struct BGRA8 { enum { bytes = 4, r = 2, g = 1, b = 0, a = 3, alpha = 1 }; };
+
+template <class A, class B> struct same_format { enum { value = 0 }; };
+template <class A> struct same_format<A, A> { enum { value = 1 }; };
+
+/* W is the width when it's known at compile time, or 0 when it isn't */
+template <class S, class D, unsigned int W>
+void copy_rows(const unsigned char *src, unsigned int stride, unsigned int w, unsigned int h, unsigned char *dst) {
+    const unsigned int width = W ? W : w;
+    const unsigned char *s;
+    unsigned char *d;
+    unsigned int x, y;
+
+    for (y = 0; y < h; y++) {
+        s = src + (size_t) y * stride * S::bytes;
+        d = dst + (size_t) y * width * D::bytes;
+        if (same_format<S, D>::value) {
+            memcpy(d, s, (size_t) width * S::bytes);
+            continue;
+        }
+        for (x = 0; x < width; x++) {
+            d[x * D::bytes + D::r] = s[x * S::bytes + S::r];
+            d[x * D::bytes + D::g] = s[x * S::bytes + S::g];
+            d[x * D::bytes + D::b] = s[x * S::bytes + S::b];
+            if (D::alpha)
+                d[x * D::bytes + D::a] = S::alpha ? s[x * S::bytes + S::a] : 255;
+        }
+    }
+}
+
+template <class S, class D>
+void copy_any(const unsigned char *src, unsigned int stride, unsigned int w, unsigned int h, unsigned char *dst) {
+    switch (w) {
+        case 256:  copy_rows<S, D, 256>(src, stride, w, h, dst); break;
+        case 512:  copy_rows<S, D, 512>(src, stride, w, h, dst); break;
+        case 1024: copy_rows<S, D, 1024>(src, stride, w, h, dst); break;
+        case 2048: copy_rows<S, D, 2048>(src, stride, w, h, dst); break;
+        default:   copy_rows<S, D, 0>(src, stride, w, h, dst); break;
+    }
+}
+
+template <class S>
+void copy_from(const unsigned char *src, unsigned int stride, unsigned int w, unsigned int h,
+               pixel_format dst_format, unsigned char *dst) {
+    switch (dst_format) {
+        case PIXEL_RGB8:  copy_any<S, RGB8>(src, stride, w, h, dst); break;
+        case PIXEL_RGBA8: copy_any<S, RGBA8>(src, stride, w, h, dst); break;
+        case PIXEL_BGRA8: copy_any<S, BGRA8>(src, stride, w, h, dst); break;
+    }
+}
+
+/* Average one pair of source rows into a destination row, as
+ * downsample_rgb() does: a vertical sum over contiguous bytes, then the
+ * horizontal pairs */
+template <class F, unsigned int W>
+void downsample_row(const unsigned char *a, const unsigned char *b, unsigned int w,
+                    unsigned short *sum, unsigned char *dst) {
+    const unsigned int width = W ? W : w, half = width / 2;
+    unsigned int i, x, c;
+
+    for (i = 0; i < width * F::bytes; i++)
+        sum[i] = a[i] + b[i];
+    for (x = 0; x < half; x++) {
+        for (c = 0; c < F::bytes; c++)
+            dst[x * F::bytes + c] = (sum[x * 2 * F::bytes + c] + sum[(x * 2 + 1) * F::bytes + c] + 2) >> 2;
+    }
+    if (width & 1) {
+        for (c = 0; c < F::bytes; c++)
+            dst[half * F::bytes + c] = (sum[half * 2 * F::bytes + c] + 1) >> 1;
+    }
+}
+
+template <class F, unsigned int W>
+void downsample_rows(const unsigned char *src, unsigned int w, unsigned int h, unsigned int stride,
+                     unsigned char *dst, unsigned short *sum) {
+    const unsigned int width = W ? W : w, dw = (width + 1) / 2;
+    const unsigned char *top;
+    unsigned int y = 0;
+
+    /* Rows are stored top down, but pair up from the bottom */
+    if (h & 1) {
+        downsample_row<F, W>(src, src, width, sum, dst);
+        dst += dw * F::bytes;
+        y = 1;
+    }
+    for (; y < h; y += 2) {
+        top = src + (size_t) y * stride * F::bytes;
+        downsample_row<F, W>(top, top + (size_t) stride * F::bytes, width, sum, dst);
+        dst += dw * F::bytes;
+    }
+}
+
+/* A known width's row sums fit on the stack; anything else is allocated */
+template <class F, unsigned int W> struct downsampler {
+    static void run(const unsigned char *src, unsigned int w, unsigned int h, unsigned int stride, unsigned char *dst) {
+        unsigned short sum[W * F::bytes];
+
+        downsample_rows<F, W>(src, w, h, stride, dst, sum);
+    }
+};
+
+template <class F> struct downsampler<F, 0> {
+    static void run(const unsigned char *src, unsigned int w, unsigned int h, unsigned int stride, unsigned char *dst) {
+        unsigned short *sum;
+
+        sum = (unsigned short *) malloc(sizeof(unsigned short) * w * F::bytes);
+        if (!sum)
+            return;
+        downsample_rows<F, 0>(src, w, h, stride, dst, sum);
+        free(sum);
+    }
+};
+
+template <class F>
+void downsample_any(const unsigned char *src, unsigned int w, unsigned int h, unsigned int stride, unsigned char *dst) {
+    switch (w) {
+        case 256:  downsampler<F, 256>::run(src, w, h, stride, dst); break;
+        case 512:  downsampler<F, 512>::run(src, w, h, stride, dst); break;
+        case 1024: downsampler<F, 1024>::run(src, w, h, stride, dst); break;
+        case 2048: downsampler<F, 2048>::run(src, w, h, stride, dst); break;
+        default:   downsampler<F, 0>::run(src, w, h, stride, dst); break;
+    }
+}
+
+}
+
+int pixel_bytes(pixel_format format) {
+    return format == PIXEL_RGB8 ? 3 : 4;
+}
+
+void pixel_copy_tile(pixel_format src_format, const unsigned char *src, unsigned int stride,
+                     unsigned int w, unsigned int h, pixel_format dst_format, unsigned char *dst) {
+    switch (src_format) {
+        case PIXEL_RGB8:  copy_from<RGB8>(src, stride, w, h, dst_format, dst); break;
+        case PIXEL_RGBA8: copy_from<RGBA8>(src, stride, w, h, dst_format, dst); break;
+        case PIXEL_BGRA8: copy_from<BGRA8>(src, stride, w, h, dst_format, dst); break;
+    }
+}
+
+void pixel_downsample(pixel_format format, const unsigned char *src, unsigned int w, unsigned int h,
+                      unsigned int stride, unsigned char *dst) {
+    switch (format) {
+        case PIXEL_RGB8:  downsample_any<RGB8>(src, w, h, stride, dst); break;
+        case PIXEL_RGBA8: downsample_any<RGBA8>(src, w, h, stride, dst); break;
+        case PIXEL_BGRA8: downsample_any<BGRA8>(src, w, h, stride, dst); break;
+    }
+}
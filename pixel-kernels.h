@@ -0,0 +1,41 @@
+#ifndef _pixel_kernels_h_
+#define _pixel_kernels_h_
+
+/* Pixel copying, format conversion and 2x2 downsampling, written once as
+ * C++ templates and instantiated for each pixel format and for each of the
+ * usual subtexture widths, so the inner loops have constant trip counts the
+ * compiler can unroll and vectorize. The functions here pick the right
+ * instantiation at run time; widths other than 256, 512, 1024 and 2048 get
+ * one that's still specialized for the pixel format.
+ *
+ * pixel_downsample() gives exactly what downsample_rgb() does, which stays
+ * as the plain reference version for bench-kernels to compare against. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    PIXEL_RGB8,
+    PIXEL_RGBA8,
+    PIXEL_BGRA8
+} pixel_format;
+
+int pixel_bytes(pixel_format);
+
+/* Copy w by h pixels from src, whose rows are stride pixels long, to dst,
+ * packed, converting from src_format to dst_format. Alpha is dropped, or
+ * made opaque. */
+void pixel_copy_tile(pixel_format src_format, const unsigned char *src, unsigned int stride,
+                     unsigned int w, unsigned int h, pixel_format dst_format, unsigned char *dst);
+
+/* Halve a w by h image with a 2x2 box filter, the way downsample_rgb() does,
+ * into dst, (w + 1) / 2 by (h + 1) / 2 pixels packed */
+void pixel_downsample(pixel_format format, const unsigned char *src, unsigned int w, unsigned int h,
+                      unsigned int stride, unsigned char *dst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "catalog.h"
+#include "prefetch.h"
+#include "clock-sync.h"
+
+#define CHUNK (4 * 1024 * 1024)
+#define REMEMBERED 32               /* Files we know we've already read */
+
+pthread_t prefetch_thread;
+pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+int prefetch_target, prefetch_count;
+int prefetch_gen = 0, prefetch_done_gen = 0;   /* Bumped for each new target */
+int prefetch_decoding = 0;
+int prefetch_depth = 0, prefetch_verbose = 0;
+size_t prefetch_budget = 0;
+unsigned char *prefetch_buf;
+
+/* Files read recently enough that they're probably still cached */
+struct warmed_s {
+    char *filename;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+} warmed[REMEMBERED];
+int warmed_next = 0;
+
+static int superseded(int gen) {
+    return __atomic_load_n(&prefetch_gen, __ATOMIC_ACQUIRE) != gen;
+}
+
+static int already_warmed(const char *filename, const struct stat *st) {
+    int i;
+
+    for (i = 0; i < REMEMBERED; i++) {
+        if (warmed[i].filename && warmed[i].dev == st->st_dev && warmed[i].ino == st->st_ino &&
+            warmed[i].size == st->st_size && warmed[i].mtime == st->st_mtime && !strcmp(warmed[i].filename, filename))
+            return 1;
+    }
+    return 0;
+}
+
+static void remember(char *filename, const struct stat *st) {
+    free(warmed[warmed_next].filename);
+    warmed[warmed_next].filename = filename;
+    warmed[warmed_next].dev = st->st_dev;
+    warmed[warmed_next].ino = st->st_ino;
+    warmed[warmed_next].size = st->st_size;
+    warmed[warmed_next].mtime = st->st_mtime;
+    warmed_next = (warmed_next + 1) % REMEMBERED;
+}
+
+/* Read through a file, as far as the budget allows. Returns 0 if the round
+ * should stop, because the budget's gone or the target has moved. Takes
+ * ownership of filename. */
+static int warm_file(char *filename, size_t *budget, int gen) {
+    double start;
+    struct stat st;
+    size_t total = 0, want;
+    ssize_t n;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1 || already_warmed(filename, &st)) {
+        if (fd != -1)
+            close(fd);
+        free(filename);
+        return 1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    start = clock_now_ms();
+
+    while (*budget > 0) {
+        /* Leave the disk to the decoder while it's busy */
+        while (__atomic_load_n(&prefetch_decoding, __ATOMIC_ACQUIRE) > 0 && !superseded(gen))
+            usleep(10000);
+        if (superseded(gen))
+            break;
+        want = (*budget < CHUNK) ? *budget : CHUNK;
+        n = read(fd, prefetch_buf, want);
+        if (n <= 0)
+            break;
+        total += n;
+        *budget -= n;
+    }
+    close(fd);
+
+    if (prefetch_verbose > 1) {
+        fprintf(stderr, "Readahead: %lu of %lu KB of %s in %0.0f ms\n", (unsigned long) total / 1024,
+            (unsigned long) st.st_size / 1024, filename, clock_now_ms() - start);
+    }
+    if ((off_t) total >= st.st_size)
+        remember(filename, &st);
+    else
+        free(filename);
+    return *budget > 0 && !superseded(gen);
+}
+
+/* Read the files on either side of img_idx, nearest first */
+static void warm_around(int gen, int img_idx, int count) {
+    size_t budget = prefetch_budget;
+    char *filename;
+    int k, sign, i;
+
+    for (k = 1; k <= prefetch_depth && 2 * k - 1 < count; k++) {
+        for (sign = 1; sign >= -1; sign -= 2) {
+            if (sign == -1 && 2 * k >= count)
+                break;          /* Going back would land on one we've done */
+            i = ((img_idx + sign * k) % count + count) % count;
+            filename = catalog_filename(i);
+            if (filename && !warm_file(filename, &budget, gen))
+                return;
+        }
+    }
+}
+
+static void *prefetch_main(void *arg) {
+    int gen, target, count;
+
+    pthread_mutex_lock(&prefetch_lock);
+    while (1) {
+        while (prefetch_gen == prefetch_done_gen)
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        gen = prefetch_gen;
+        target = prefetch_target;
+        count = prefetch_count;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        warm_around(gen, target, count);
+
+        pthread_mutex_lock(&prefetch_lock);
+        prefetch_done_gen = gen;
+    }
+    return NULL;
+}
+
+void prefetch_init(int depth, size_t budget, int verbose) {
+    prefetch_depth = depth;
+    prefetch_budget = budget;
+    prefetch_verbose = verbose;
+    if (depth <= 0)
+        return;
+    prefetch_buf = (unsigned char *) malloc(CHUNK);
+    if (!prefetch_buf) {
+        perror("Couldn't allocate readahead buffer");
+        prefetch_depth = 0;
+        return;
+    }
+    if (pthread_create(&prefetch_thread, NULL, prefetch_main, NULL) != 0) {
+        perror("Couldn't start readahead thread");
+        prefetch_depth = 0;
+    }
+}
+
+/* The image on screen is now img_idx, of count; start a new round around it */
+void prefetch_around(int img_idx, int count) {
+    if (prefetch_depth <= 0)
+        return;
+    pthread_mutex_lock(&prefetch_lock);
+    prefetch_target = img_idx;
+    prefetch_count = count;
+    __atomic_add_fetch(&prefetch_gen, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+void prefetch_decode_begin(void) {
+    __atomic_add_fetch(&prefetch_decoding, 1, __ATOMIC_RELEASE);
+}
+
+void prefetch_decode_end(void) {
+    __atomic_sub_fetch(&prefetch_decoding, 1, __ATOMIC_RELEASE);
+}
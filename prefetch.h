@@ -0,0 +1,20 @@
+#ifndef _prefetch_h_
+#define _prefetch_h_
+
+#include <stddef.h>
+
+/* Warms the page cache with the image files on either side of the one on
+ * screen, nearest first, by reading them on a background thread in large
+ * sequential chunks and throwing the data away. That's all it does; nothing
+ * is decoded, so it's cheap enough to look several images ahead, and when
+ * the decoder gets to the file, it doesn't have to wait on the disk.
+ *
+ * Each round reads at most budget bytes, and reading stops whenever the main
+ * thread says it's decoding, so the two don't fight over the disk. */
+
+void prefetch_init(int depth, size_t budget, int verbose);
+void prefetch_around(int img_idx, int count);
+void prefetch_decode_begin(void);
+void prefetch_decode_end(void);
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE         /* For F_OFD_SETLKW */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "image-reader.h"
+#include "shared-image.h"
+
+#define SHARED_MAGIC 0x6c677069
+#define HEADER_SIZE 4096            /* Pixels start on the next page */
+
+#define STATE_DECODING 0
+#define STATE_READY 1
+#define STATE_FAILED 2
+
+/* The first page of each segment. unlinked is only touched with the header
+ * locked; state is set last by the decoding process, once width, height and
+ * the pixels are all in place. */
+struct shared_header {
+    unsigned int magic;
+    unsigned int width, height;
+    volatile int state;
+    int unlinked;
+    pid_t decoder;
+};
+
+int shared_verbose = 0;
+
+void shared_image_init(int verbose) {
+    shared_verbose = verbose;
+}
+
+/* FNV-1a over whatever identifies this version of the file */
+static unsigned long long image_key(const struct stat *st) {
+    unsigned long long fields[6], hash = 14695981039346656037ULL;
+    const unsigned char *p = (const unsigned char *) fields;
+    unsigned int i;
+
+    fields[0] = st->st_dev;
+    fields[1] = st->st_ino;
+    fields[2] = st->st_size;
+    fields[3] = st->st_mtim.tv_sec;
+    fields[4] = st->st_mtim.tv_nsec;
+    fields[5] = 0;
+    for (i = 0; i < sizeof(fields); i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Lock or unlock the header, with F_WRLCK or F_UNLCK. This is a lock on the
+ * segment's first byte, kept apart from the flock() that says who's using it.
+ * It belongs to the descriptor, not the process, so the tile server's thread
+ * and the main one keep out of each other's way too. */
+static int lock_header(int fd, short type) {
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 1;
+    while (fcntl(fd, F_OFD_SETLKW, &fl) == -1) {
+        if (errno != EINTR)
+            return 0;
+    }
+    return 1;
+}
+
+static int decode_private(shared_image *si, const char *filename) {
+    image_reader reader;
+
+    si->header = NULL;
+    si->fd = -1;
+    if (!image_reader_open(&reader, filename))
+        return 0;
+    si->width = reader.width;
+    si->height = reader.height;
+    si->pixels = (unsigned char *) malloc((size_t) si->width * si->height * 3);
+    if (!si->pixels) {
+        perror("Out of memory trying to allocate texture");
+        exit(-1);
+    }
+    image_reader_read_rows(&reader, si->pixels, si->height);
+    image_reader_close(&reader);
+    return 1;
+}
+
+/* Let go of the segment, unlinking it if nobody else is using it. If we
+ * can't have it to ourselves, someone else can; our shared lock goes either
+ * way, since flock() drops it before trying for the exclusive one. */
+static void release_segment(shared_image *si) {
+    struct shared_header *hdr = (struct shared_header *) si->header;
+
+    lock_header(si->fd, F_WRLCK);
+    if (flock(si->fd, LOCK_EX | LOCK_NB) == 0 && !hdr->unlinked) {
+        hdr->unlinked = 1;
+        shm_unlink(si->name);
+        if (shared_verbose)
+            fprintf(stderr, "Last user of %s; unlinked it\n", si->name);
+    }
+    lock_header(si->fd, F_UNLCK);
+
+    if (si->map && si->map != (unsigned char *) hdr)
+        munmap(si->map, si->map_size);
+    munmap(hdr, (si->map == (unsigned char *) hdr) ? si->map_size : HEADER_SIZE);
+    close(si->fd);
+    si->header = NULL;
+    si->map = NULL;
+    si->pixels = NULL;
+    si->fd = -1;
+}
+
+/* Something went wrong with the segment. Take the name away, so the next
+ * process to want this image starts a fresh one, then let go of it. */
+static void abandon_segment(shared_image *si) {
+    struct shared_header *hdr = (struct shared_header *) si->header;
+
+    lock_header(si->fd, F_WRLCK);
+    hdr->state = STATE_FAILED;
+    if (!hdr->unlinked) {
+        hdr->unlinked = 1;
+        shm_unlink(si->name);
+    }
+    lock_header(si->fd, F_UNLCK);
+    release_segment(si);
+}
+
+/* We created the segment, so it's up to us to decode into it. Called with
+ * the header locked. */
+static int decode_shared(shared_image *si, const char *filename) {
+    struct shared_header *hdr;
+    image_reader reader;
+
+    if (ftruncate(si->fd, HEADER_SIZE) == -1) {
+        perror("Couldn't size shared image memory");
+        lock_header(si->fd, F_UNLCK);
+        shm_unlink(si->name);
+        close(si->fd);
+        return decode_private(si, filename);
+    }
+    hdr = (struct shared_header *) mmap(NULL, HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, si->fd, 0);
+    if (hdr == MAP_FAILED) {
+        perror("Couldn't map shared image memory");
+        lock_header(si->fd, F_UNLCK);
+        shm_unlink(si->name);
+        close(si->fd);
+        return decode_private(si, filename);
+    }
+    hdr->magic = SHARED_MAGIC;
+    hdr->state = STATE_DECODING;
+    hdr->unlinked = 0;
+    hdr->decoder = getpid();
+    si->header = hdr;
+    lock_header(si->fd, F_UNLCK);
+
+    if (!image_reader_open(&reader, filename)) {
+        abandon_segment(si);
+        return 0;
+    }
+    si->width = reader.width;
+    si->height = reader.height;
+    si->map_size = HEADER_SIZE + (size_t) si->width * si->height * 3;
+    if (ftruncate(si->fd, si->map_size) == -1 ||
+        (si->map = (unsigned char *) mmap(NULL, si->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, si->fd, 0)) == MAP_FAILED) {
+        perror("Couldn't make room for shared image");
+        si->map = NULL;
+        image_reader_close(&reader);
+        abandon_segment(si);
+        return decode_private(si, filename);
+    }
+    munmap(hdr, HEADER_SIZE);
+    si->header = hdr = (struct shared_header *) si->map;
+    si->pixels = si->map + HEADER_SIZE;
+
+    image_reader_read_rows(&reader, si->pixels, si->height);
+    image_reader_close(&reader);
+
+    hdr->width = si->width;
+    hdr->height = si->height;
+    __sync_synchronize();
+    hdr->state = STATE_READY;
+    if (shared_verbose)
+        fprintf(stderr, "Decoded %s into shared memory %s\n", filename, si->name);
+    return 1;
+}
+
+/* Someone else created the segment. Wait for them to finish decoding, then
+ * map the pixels. */
+static int map_shared(shared_image *si, const char *filename) {
+    struct shared_header *hdr = (struct shared_header *) si->header;
+
+    lock_header(si->fd, F_UNLCK);
+
+    while (hdr->state == STATE_DECODING) {
+        if (kill(hdr->decoder, 0) == -1 && errno == ESRCH) {
+            fprintf(stderr, "Process %d died decoding %s; decoding it here instead\n", (int) hdr->decoder, filename);
+            abandon_segment(si);
+            return decode_private(si, filename);
+        }
+        usleep(2000);
+    }
+    __sync_synchronize();
+    if (hdr->state != STATE_READY) {
+        release_segment(si);
+        return decode_private(si, filename);
+    }
+
+    si->width = hdr->width;
+    si->height = hdr->height;
+    si->map_size = HEADER_SIZE + (size_t) si->width * si->height * 3;
+    si->map = (unsigned char *) mmap(NULL, si->map_size, PROT_READ, MAP_SHARED, si->fd, 0);
+    if (si->map == MAP_FAILED) {
+        perror("Couldn't map shared image");
+        si->map = NULL;
+        release_segment(si);
+        return decode_private(si, filename);
+    }
+    si->pixels = si->map + HEADER_SIZE;
+    if (shared_verbose)
+        fprintf(stderr, "Mapped %s, decoded by process %d\n", filename, (int) hdr->decoder);
+    return 1;
+}
+
+/* Get the decoded pixels for filename, one way or another. Returns 0 if the
+ * image couldn't be read at all. */
+int shared_image_load(shared_image *si, const char *filename) {
+    struct shared_header *hdr;
+    struct stat st;
+
+    memset(si, 0, sizeof(shared_image));
+    si->fd = -1;
+    if (stat(filename, &st) == -1) {
+        perror("Couldn't stat image file");
+        return 0;
+    }
+    snprintf(si->name, sizeof(si->name), "/lg-pano-%u-%016llx", (unsigned int) getuid(), image_key(&st));
+
+    while (1) {
+        si->fd = shm_open(si->name, O_RDWR | O_CREAT, 0600);
+        if (si->fd == -1) {
+            perror("Couldn't open shared image memory");
+            return decode_private(si, filename);
+        }
+        /* Say we're using it before looking, so nobody unlinks it under us */
+        if (flock(si->fd, LOCK_SH) == -1 || !lock_header(si->fd, F_WRLCK) || fstat(si->fd, &st) == -1) {
+            perror("Couldn't lock shared image memory");
+            close(si->fd);
+            return decode_private(si, filename);
+        }
+        if (st.st_size == 0)
+            return decode_shared(si, filename);
+
+        hdr = (struct shared_header *) mmap(NULL, HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, si->fd, 0);
+        if (hdr == MAP_FAILED || hdr->magic != SHARED_MAGIC) {
+            fprintf(stderr, "Shared memory %s isn't a decoded image; ignoring it\n", si->name);
+            if (hdr != MAP_FAILED)
+                munmap(hdr, HEADER_SIZE);
+            close(si->fd);
+            return decode_private(si, filename);
+        }
+        si->header = hdr;
+        if (!hdr->unlinked)
+            return map_shared(si, filename);
+
+        /* The last user let go of it while we were opening it; try again */
+        lock_header(si->fd, F_UNLCK);
+        munmap(hdr, HEADER_SIZE);
+        close(si->fd);
+        si->header = NULL;
+    }
+}
+
+void shared_image_release(shared_image *si) {
+    if (si->header) {
+        release_segment(si);
+    }
+    else {
+        free(si->pixels);
+        si->pixels = NULL;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _shared_image_h_
+#define _shared_image_h_
+
+#include <stddef.h>
+
+/* Decoded images shared between lg-pano processes on the same host, through
+ * POSIX shared memory. Segments are named after the file's device, inode,
+ * size and modification time, so every process showing the same file finds
+ * the same one. The first process to ask decodes the image into it, and the
+ * rest wait for that and map the pixels read only. Each process holds the
+ * segment flock()ed shared while the image is on its screen, and whoever
+ * lets go and finds nobody else holding it unlinks the segment. The kernel
+ * drops a process's locks however it ends, so one that's killed doesn't keep
+ * the image in memory for good: the next one to let go of it cleans up.
+ *
+ * If shared memory can't be used, or the process doing the decoding dies,
+ * the image is decoded privately instead, and pixels is just malloc()ed. */
+
+typedef struct {
+    unsigned int width, height;
+    unsigned char *pixels;          /* Packed RGB, top row first */
+    char name[64];
+    int fd;                         /* -1 when decoded privately */
+    void *header;
+    unsigned char *map;
+    size_t map_size;
+} shared_image;
+
+void shared_image_init(int verbose);
+int shared_image_load(shared_image *, const char *filename);
+void shared_image_release(shared_image *);
+
+#endif
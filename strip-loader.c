@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "strip-loader.h"
+#include "prefetch.h"
+#include "clock-sync.h"
+
+#define STRIPS_AHEAD 3      /* Strips a thread may decode before they're uploaded */
+
+struct strip_loader_s {
+    image_reader reader;
+    unsigned int strip_rows;
+    int threaded;
+    unsigned char *strips[STRIPS_AHEAD];
+    double decode_ms[STRIPS_AHEAD];
+    int total,              /* Strips in the image */
+        decoded,            /* Strips decoded so far */
+        taken;              /* Strips the main loop is done with */
+    /* The thread frees the loader if it's closed before it's finished,
+     * otherwise strip_loader_close() does */
+    int stopping, finished;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Chroma rows that go with n rows of luma, starting at row first */
+unsigned int chroma_rows(unsigned int first, unsigned int n) {
+    return n ? (first + n - 1) / 2 - first / 2 + 1 : 0;
+}
+
+/* Decode the next rows rows of the image into strip, filling in any the
+ * image is short of. Returns the milliseconds it took. */
+double strip_decode(image_reader *reader, unsigned char *strip, unsigned int rows) {
+    unsigned int got, first = reader->next_row, w = reader->width, cw = (w + 1) / 2, ch, cgot;
+    unsigned char *cb, *cr;
+    double start, decode_ms;
+
+    start = clock_now_ms();
+    if (!reader->planar) {
+        got = image_reader_read_rows(reader, strip, rows);
+        decode_ms = clock_now_ms() - start;
+        if (got < rows) {
+            fprintf(stderr, "Image ended %d rows early; filling with black\n", reader->height - first - got);
+            memset(strip + (size_t) got * w * 3, 0, (size_t) (rows - got) * w * 3);
+        }
+        return decode_ms;
+    }
+
+    ch = chroma_rows(first, rows);
+    cb = strip + (size_t) w * rows;
+    cr = cb + (size_t) cw * ch;
+    got = image_reader_read_planes(reader, strip, cb, cr, rows);
+    decode_ms = clock_now_ms() - start;
+    if (got < rows) {
+        fprintf(stderr, "Image ended %d rows early; filling with black\n", reader->height - first - got);
+        cgot = chroma_rows(first, got);
+        memset(strip + (size_t) got * w, 0, (size_t) (rows - got) * w);
+        memset(cb + (size_t) cgot * cw, 128, (size_t) (ch - cgot) * cw);
+        memset(cr + (size_t) cgot * cw, 128, (size_t) (ch - cgot) * cw);
+    }
+    return decode_ms;
+}
+
+/* Strips are a row of subtextures each, and subtextures are laid out from
+ * the bottom of the image up, so the top strip is the one that may be short */
+static unsigned int strip_height(const strip_loader *l, int k) {
+    return k == 0 ? l->reader.height - (l->total - 1) * l->strip_rows : l->strip_rows;
+}
+
+static void free_loader(strip_loader *l) {
+    int i;
+
+    image_reader_close(&l->reader);
+    for (i = 0; i < STRIPS_AHEAD; i++)
+        free(l->strips[i]);
+    if (l->threaded) {
+        pthread_mutex_destroy(&l->lock);
+        pthread_cond_destroy(&l->cond);
+    }
+    free(l);
+}
+
+static void *loader_main(void *arg) {
+    strip_loader *l = (strip_loader *) arg;
+    double ms;
+    int k;
+
+    pthread_mutex_lock(&l->lock);
+    for (k = 0; k < l->total; k++) {
+        while (k - l->taken == STRIPS_AHEAD && !l->stopping)
+            pthread_cond_wait(&l->cond, &l->lock);
+        if (l->stopping)
+            break;
+        pthread_mutex_unlock(&l->lock);
+        ms = strip_decode(&l->reader, l->strips[k % STRIPS_AHEAD], strip_height(l, k));
+        pthread_mutex_lock(&l->lock);
+        l->decode_ms[k % STRIPS_AHEAD] = ms;
+        l->decoded++;
+    }
+    prefetch_decode_end();
+    l->finished = 1;
+    if (l->stopping) {
+        pthread_mutex_unlock(&l->lock);
+        free_loader(l);
+        return NULL;
+    }
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+
+/* Start decoding the image reader has open, strip_rows rows to a strip. The
+ * loader takes the reader over, and closes it when it's closed itself. */
+strip_loader *strip_loader_open(image_reader *reader, unsigned int strip_rows, int threaded) {
+    strip_loader *l;
+    int i;
+
+    l = (strip_loader *) calloc(1, sizeof(strip_loader));
+    if (!l) {
+        perror("Out of memory starting image loader");
+        exit(1);
+    }
+    l->reader = *reader;
+    l->strip_rows = strip_rows;
+    l->total = (reader->height + strip_rows - 1) / strip_rows;
+    for (i = 0; i < (threaded ? STRIPS_AHEAD : 1); i++) {
+        l->strips[i] = (unsigned char *) malloc((size_t) reader->width * strip_rows * 3);
+        if (!l->strips[i]) {
+            perror("Out of memory trying to allocate texture strip");
+            exit(-1);
+        }
+    }
+    if (!threaded)
+        return l;
+
+    l->threaded = 1;
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->cond, NULL);
+    prefetch_decode_begin();
+    if (pthread_create(&l->thread, NULL, loader_main, l) != 0) {
+        perror("Couldn't start image loader thread; decoding between frames instead");
+        prefetch_decode_end();
+        pthread_mutex_destroy(&l->lock);
+        pthread_cond_destroy(&l->cond);
+        l->threaded = 0;
+        return l;
+    }
+    pthread_detach(l->thread);
+    return l;
+}
+
+/* The next strip, from the top of the image down, and how long it took to
+ * decode, or NULL if a thread's still working on it or there are no more.
+ * Unthreaded, it's decoded here and now. Hand it back with
+ * strip_loader_done() once it's uploaded. */
+unsigned char *strip_loader_next(strip_loader *l, double *decode_ms) {
+    unsigned char *strip = NULL;
+
+    if (!l->threaded) {
+        if (l->taken == l->total)
+            return NULL;
+        if (l->decoded == l->taken) {
+            prefetch_decode_begin();
+            l->decode_ms[0] = strip_decode(&l->reader, l->strips[0], strip_height(l, l->taken));
+            prefetch_decode_end();
+            l->decoded++;
+        }
+        if (decode_ms)
+            *decode_ms = l->decode_ms[0];
+        return l->strips[0];
+    }
+
+    pthread_mutex_lock(&l->lock);
+    if (l->taken < l->decoded) {
+        strip = l->strips[l->taken % STRIPS_AHEAD];
+        if (decode_ms)
+            *decode_ms = l->decode_ms[l->taken % STRIPS_AHEAD];
+    }
+    pthread_mutex_unlock(&l->lock);
+    return strip;
+}
+
+void strip_loader_done(strip_loader *l) {
+    if (!l->threaded) {
+        l->taken++;
+        return;
+    }
+    pthread_mutex_lock(&l->lock);
+    l->taken++;
+    pthread_cond_signal(&l->cond);
+    pthread_mutex_unlock(&l->lock);
+}
+
+/* Stop decoding and let go of everything. Never waits for the thread; if
+ * it's in the middle of a strip, it cleans up once that's done. */
+void strip_loader_close(strip_loader *l) {
+    int finished;
+
+    if (!l->threaded) {
+        free_loader(l);
+        return;
+    }
+    pthread_mutex_lock(&l->lock);
+    l->stopping = 1;
+    finished = l->finished;
+    pthread_cond_signal(&l->cond);
+    pthread_mutex_unlock(&l->lock);
+    if (finished)
+        free_loader(l);
+}
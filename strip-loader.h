@@ -0,0 +1,27 @@
+#ifndef _strip_loader_h_
+#define _strip_loader_h_
+
+#include "image-reader.h"
+
+/* Decodes an image top to bottom in strips, each one row of subtextures
+ * tall, for the main loop to upload. Strips are laid out as the uploader
+ * wants them: full width packed RGB, or for a planar reader, the luma rows,
+ * then the Cb and the Cr rows, each half as wide.
+ *
+ * Threaded, a strip loader decodes on a thread of its own, a few strips
+ * ahead of the uploads, so the main loop only ever uploads what's ready and
+ * never waits on the decoder. Otherwise each strip is decoded when it's
+ * asked for. Readahead is paused while anything is being decoded, either
+ * way. */
+
+typedef struct strip_loader_s strip_loader;
+
+strip_loader *strip_loader_open(image_reader *, unsigned int strip_rows, int threaded);
+unsigned char *strip_loader_next(strip_loader *, double *decode_ms);
+void strip_loader_done(strip_loader *);
+void strip_loader_close(strip_loader *);
+
+unsigned int chroma_rows(unsigned int first, unsigned int n);
+double strip_decode(image_reader *, unsigned char *strip, unsigned int rows);
+
+#endif
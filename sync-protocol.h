@@ -0,0 +1,27 @@
+#ifndef _sync_protocol_h_
+#define _sync_protocol_h_
+
+/* What the master tells its slaves over UDP, one packet per change to the
+ * view, and again as a heartbeat while it's still. Fields are in host byte
+ * order, so every screen has to be the same kind of machine, and carry the
+ * layout's version, so screens running builds that disagree about it say so
+ * instead of quietly ignoring each other. Slaves drop a
+ * heartbeat that matches what they already have, and show anything with an
+ * apply_at when their estimate of the master's clock says it's due. */
+
+#define SYNC_FLAG 1234
+#define SYNC_VERSION 2     /* Bump whenever sync_struct changes */
+
+typedef struct {
+    int flag, version;
+    int img_idx;
+    int horiz_disp, vert_disp;
+    float tex_min_x, tex_max_x, tex_min_y, tex_max_y;
+    unsigned int seq;
+    unsigned int ack_port;      /* Where the master wants acknowledgements, or 0 */
+    double apply_at;            /* When to show it, by the master's clock, or 0 */
+    int heartbeat;              /* The view again, not a change to it */
+    int hud;                    /* Show the performance overlay */
+} sync_struct;
+
+#endif
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "clock-sync.h"
+#include "telemetry.h"
+
+#define SENT_RING 256               /* Sync packets we remember sending */
+#define NUM_BUCKETS 12              /* Under 1 ms, then doubling up to 1024 ms and over */
+#define NUM_METRICS 4
+
+const char *metric_names[NUM_METRICS] = { "network", "apply", "swap", "frame" };
+
+struct histogram_s {
+    unsigned long counts[NUM_BUCKETS];
+    double total_ms, max_ms;
+};
+
+struct node_s {
+    char host[32];
+    int xoffset;
+    struct sockaddr_in addr;
+    unsigned long acks;
+    unsigned int last_seq;
+    double clock_offset, clock_jitter, clock_residual;
+    struct histogram_s metrics[NUM_METRICS];
+    LIST_ENTRY(node_s) entries;
+};
+LIST_HEAD(nodelisthead, node_s) node_list = LIST_HEAD_INITIALIZER(node_list);
+
+struct {
+    unsigned int seq;
+    double ms;
+} sent[SENT_RING];
+unsigned int last_sent_seq = 0;
+
+int ack_socket = -1;
+int telemetry_verbose = 0;
+state_request_callback state_request_cb = NULL;
+
+/* Open the socket acknowledgements come back to */
+int telemetry_init(unsigned int port, int verbose) {
+    struct sockaddr_in addr;
+
+    telemetry_verbose = verbose;
+    ack_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ack_socket == -1) {
+        perror("Couldn't open acknowledgement socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(ack_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("Couldn't bind acknowledgement socket");
+        close(ack_socket);
+        ack_socket = -1;
+        return -1;
+    }
+    if (verbose)
+        fprintf(stderr, "Listening for slave acknowledgements on port %u\n", port);
+    return ack_socket;
+}
+
+/* Note when sync packet seq went out, so its round trip can be timed */
+void telemetry_sent(unsigned int seq) {
+    sent[seq % SENT_RING].seq = seq;
+    sent[seq % SENT_RING].ms = clock_now_ms();
+    last_sent_seq = seq;
+}
+
+static void record(struct histogram_s *h, double ms) {
+    int b = 0;
+
+    if (ms < 0)
+        ms = 0;
+    while (b < NUM_BUCKETS - 1 && ms >= (1 << b))
+        b++;
+    h->counts[b]++;
+    h->total_ms += ms;
+    if (ms > h->max_ms)
+        h->max_ms = ms;
+}
+
+static struct node_s *find_node(const sync_ack *ack, const struct sockaddr_in *from) {
+    struct node_s *n;
+
+    LIST_FOREACH(n, &node_list, entries) {
+        if (n->xoffset == ack->xoffset && !strncmp(n->host, ack->host, sizeof(n->host)) &&
+            n->addr.sin_addr.s_addr == from->sin_addr.s_addr)
+            return n;
+    }
+    n = (struct node_s *) calloc(1, sizeof(struct node_s));
+    if (!n) {
+        perror("Out of memory tracking a new slave");
+        return NULL;
+    }
+    memcpy(n->host, ack->host, sizeof(n->host));
+    n->host[sizeof(n->host) - 1] = '\0';
+    n->xoffset = ack->xoffset;
+    n->addr = *from;
+    LIST_INSERT_HEAD(&node_list, n, entries);
+    if (telemetry_verbose)
+        fprintf(stderr, "First acknowledgement from %s, xoffset %d, at %s\n", n->host, n->xoffset, inet_ntoa(from->sin_addr));
+    return n;
+}
+
+void telemetry_on_state_request(state_request_callback cb) {
+    state_request_cb = cb;
+}
+
+/* Take in whatever acknowledgements have arrived, and answer any clock
+ * pings and state requests, without waiting */
+void telemetry_receive(void) {
+    union {
+        sync_ack ack;
+        clock_ping ping;
+        state_request request;
+    } data;
+    sync_ack *ack = &data.ack;
+    struct sockaddr_in from;
+    socklen_t len;
+    ssize_t got;
+    struct node_s *n;
+    double now, apply_ms, swap_ms;
+
+    if (ack_socket == -1)
+        return;
+    while (1) {
+        len = sizeof(from);
+        got = recvfrom(ack_socket, &data, sizeof(data), MSG_DONTWAIT, (struct sockaddr *) &from, &len);
+        if (got < (ssize_t) sizeof(int))
+            return;
+        now = clock_now_ms();
+        if (data.ping.flag == PING_FLAG && got == (ssize_t) sizeof(clock_ping)) {
+            clock_sync_answer(ack_socket, &data.ping, &from, now);
+            continue;
+        }
+        if (data.request.flag == STATE_REQUEST_FLAG && got == (ssize_t) sizeof(state_request)) {
+            if (telemetry_verbose)
+                fprintf(stderr, "State requested by %s:%d, xoffset %d\n",
+                    inet_ntoa(from.sin_addr), ntohs(from.sin_port), data.request.xoffset);
+            if (state_request_cb)
+                state_request_cb(ack_socket, &from);
+            continue;
+        }
+        if (got != (ssize_t) sizeof(sync_ack) || ack->flag != ACK_FLAG || (n = find_node(ack, &from)) == NULL)
+            continue;
+        apply_ms = ack->recv_to_apply_us / 1000.0;
+        swap_ms = ack->apply_to_swap_us / 1000.0;
+        n->acks++;
+        n->last_seq = ack->seq;
+        n->clock_offset = ack->clock_offset_ms;
+        n->clock_jitter = ack->clock_jitter_us / 1000.0;
+        n->clock_residual = ack->clock_residual_us / 1000.0;
+        if (sent[ack->seq % SENT_RING].seq == ack->seq)
+            record(&n->metrics[0], now - sent[ack->seq % SENT_RING].ms - apply_ms - swap_ms);
+        record(&n->metrics[1], apply_ms);
+        record(&n->metrics[2], swap_ms);
+        record(&n->metrics[3], ack->frame_us / 1000.0);
+    }
+}
+
+/* Print each node's histograms: counts of times under 1 ms, under 2, under
+ * 4, and so on, with the mean and worst */
+void telemetry_dump(FILE *out) {
+    struct node_s *n;
+    struct histogram_s *h;
+    unsigned long total;
+    char label[16];
+    int m, b;
+
+    telemetry_receive();
+    if (LIST_EMPTY(&node_list)) {
+        fprintf(out, "No acknowledgements from slaves yet\n");
+        return;
+    }
+    LIST_FOREACH(n, &node_list, entries) {
+        fprintf(out, "Slave %s, xoffset %d, at %s: %lu acknowledgements, newest for %u of %u\n",
+            n->host, n->xoffset, inet_ntoa(n->addr.sin_addr), n->acks, n->last_seq, last_sent_seq);
+        fprintf(out, "  Our clock is %+0.2f ms from its, give or take %0.2f; jitter %0.2f ms\n",
+            n->clock_offset, n->clock_residual, n->clock_jitter);
+        fprintf(out, "  ms      ");
+        for (b = 0; b < NUM_BUCKETS - 1; b++) {
+            snprintf(label, sizeof(label), "<%d", 1 << b);
+            fprintf(out, " %6s", label);
+        }
+        fprintf(out, "   more     mean     max\n");
+        for (m = 0; m < NUM_METRICS; m++) {
+            h = &n->metrics[m];
+            fprintf(out, "  %-8s", metric_names[m]);
+            total = 0;
+            for (b = 0; b < NUM_BUCKETS; b++) {
+                fprintf(out, " %6lu", h->counts[b]);
+                total += h->counts[b];
+            }
+            fprintf(out, " %8.1f %7.1f\n", total ? h->total_ms / total : 0, h->max_ms);
+        }
+    }
+}
+
+/* Tell the master we've got sync packet seq on screen, and how long it took */
+void telemetry_ack(int sock, uint32_t master_addr, unsigned int port, unsigned int seq, int xoffset,
+                   double recv_ms, double apply_ms, double swap_ms, double frame_ms) {
+    static char host[32] = "";
+    struct sockaddr_in addr;
+    sync_ack ack;
+    double offset, jitter, residual;
+
+    if (!host[0] && gethostname(host, sizeof(host) - 1) != 0)
+        strcpy(host, "unknown");
+
+    memset(&ack, 0, sizeof(ack));
+    ack.flag = ACK_FLAG;
+    ack.seq = seq;
+    ack.xoffset = xoffset;
+    memcpy(ack.host, host, sizeof(ack.host));
+    ack.recv_to_apply_us = (apply_ms - recv_ms) * 1000;
+    ack.apply_to_swap_us = (swap_ms - apply_ms) * 1000;
+    ack.frame_us = frame_ms * 1000;
+    clock_sync_stats(&offset, &jitter, &residual);
+    ack.clock_offset_ms = offset;
+    ack.clock_jitter_us = jitter * 1000;
+    ack.clock_residual_us = residual * 1000;
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = master_addr;
+    addr.sin_port = htons(port);
+    if (sendto(sock, &ack, sizeof(ack), 0, (struct sockaddr *) &addr, sizeof(addr)) != (ssize_t) sizeof(ack) &&
+        telemetry_verbose)
+        perror("Couldn't send acknowledgement to master");
+}
@@ -0,0 +1,58 @@
+#ifndef _telemetry_h_
+#define _telemetry_h_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* Slaves acknowledge sync packets once the frame showing them has been
+ * swapped, saying how long they took over it, and the master keeps
+ * histograms of those times for each node, along with the round trip. The
+ * round trip less the slave's own times is the network's share, so a screen
+ * that lags can be blamed on the network, on loading, or on drawing.
+ *
+ * The master also answers slaves' clock pings on the acknowledgement port,
+ * and slaves say in each acknowledgement what they make of their clock.
+ *
+ * Acknowledgements go to the address sync packets came from, at the port
+ * named in them, and like sync packets, are in host byte order.
+ *
+ * Slaves that have just started can ask for the current view on the same
+ * port, rather than wait for the next heartbeat; whoever registered with
+ * telemetry_on_state_request() answers them. */
+
+#define ACK_FLAG 4323        /* Was 4321 while the clock offset was an int */
+#define STATE_REQUEST_FLAG 4322
+
+typedef struct {
+    int flag;
+    unsigned int seq;                   /* Newest sync packet applied */
+    int xoffset;                        /* Tells screens on one host apart */
+    char host[32];
+    unsigned int recv_to_apply_us,      /* Read off the socket, to in the render globals */
+                 apply_to_swap_us,      /* From there, to on screen */
+                 frame_us;              /* Time taken to draw that frame */
+    unsigned int clock_jitter_us, clock_residual_us;
+    double clock_offset_ms;             /* The master's clock, less ours. Both count
+                                         * from boot, so this can be hours. */
+} sync_ack;
+
+typedef struct {
+    int flag;
+    int xoffset;
+} state_request;
+
+typedef void (*state_request_callback)(int sock, const struct sockaddr_in *from);
+
+/* The master's side */
+int telemetry_init(unsigned int port, int verbose);
+void telemetry_sent(unsigned int seq);
+void telemetry_receive(void);
+void telemetry_on_state_request(state_request_callback);
+void telemetry_dump(FILE *);
+
+/* The slaves' */
+void telemetry_ack(int sock, uint32_t master_addr, unsigned int port, unsigned int seq, int xoffset,
+                   double recv_ms, double apply_ms, double swap_ms, double frame_ms);
+
+#endif
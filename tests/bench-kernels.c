@@ -0,0 +1,119 @@
+/* Times the specialized kernels in pixel-kernels.cc against the generic
+ * versions they replace, on subtexture-sized tiles, and checks that they
+ * give the same answers. Run by make bench. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../downsample.h"
+#include "../pixel-kernels.h"
+
+#define STRIDE 4096         /* Tiles are cut from an image this wide */
+
+static double now_ms(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/* How the tile server and the subtexture code copied and converted before:
+ * a row at a time, channel offsets looked up at run time */
+static void generic_copy(const unsigned char *src, unsigned int stride, unsigned int w, unsigned int h,
+                         const int *src_order, int src_bytes, const int *dst_order, int dst_bytes, unsigned char *dst) {
+    unsigned int x, y;
+    int c;
+
+    for (y = 0; y < h; y++) {
+        if (src_bytes == dst_bytes && !memcmp(src_order, dst_order, sizeof(int) * 3)) {
+            memcpy(dst + (size_t) y * w * dst_bytes, src + (size_t) y * stride * src_bytes, (size_t) w * src_bytes);
+            continue;
+        }
+        for (x = 0; x < w; x++) {
+            for (c = 0; c < 3; c++)
+                dst[((size_t) y * w + x) * dst_bytes + dst_order[c]] = src[((size_t) y * stride + x) * src_bytes + src_order[c]];
+            if (dst_bytes == 4)
+                dst[((size_t) y * w + x) * dst_bytes + 3] = 255;
+        }
+    }
+}
+
+static int reps_for(unsigned int w) {
+    return (int) (400000000UL / ((unsigned long) w * w)) + 1;
+}
+
+int main(void) {
+    static const unsigned int widths[] = { 256, 512, 1000, 1024, 2048 };
+    static const int rgb[3] = { 0, 1, 2 }, bgr[3] = { 2, 1, 0 };
+    unsigned char *image, *a, *b;
+    unsigned int w, i;
+    size_t n;
+    double start, generic_ms, kernel_ms;
+    int r, reps, failures = 0;
+
+    n = (size_t) STRIDE * 2048 * 3;
+    image = (unsigned char *) malloc(n);
+    a = (unsigned char *) malloc((size_t) 2048 * 2048 * 4);
+    b = (unsigned char *) malloc((size_t) 2048 * 2048 * 4);
+    if (!image || !a || !b) {
+        perror("Out of memory");
+        exit(1);
+    }
+    srand(1);
+    for (i = 0; i < n; i++)
+        image[i] = rand();
+
+    printf("%-26s %6s %12s %12s %8s\n", "kernel", "tile", "generic ms", "special ms", "speedup");
+    for (i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+        w = widths[i];
+        reps = reps_for(w);
+
+        start = now_ms();
+        for (r = 0; r < reps; r++)
+            downsample_rgb(image, w, w, STRIDE, a);
+        generic_ms = (now_ms() - start) / reps;
+        start = now_ms();
+        for (r = 0; r < reps; r++)
+            pixel_downsample(PIXEL_RGB8, image, w, w, STRIDE, b);
+        kernel_ms = (now_ms() - start) / reps;
+        if (memcmp(a, b, (size_t) ((w + 1) / 2) * ((w + 1) / 2) * 3)) {
+            printf("MISMATCH downsampling %u x %u\n", w, w);
+            failures++;
+        }
+        printf("%-26s %6u %12.3f %12.3f %7.2fx\n", "downsample RGB8", w, generic_ms, kernel_ms, generic_ms / kernel_ms);
+
+        start = now_ms();
+        for (r = 0; r < reps; r++)
+            generic_copy(image, STRIDE, w, w, rgb, 3, rgb, 3, a);
+        generic_ms = (now_ms() - start) / reps;
+        start = now_ms();
+        for (r = 0; r < reps; r++)
+            pixel_copy_tile(PIXEL_RGB8, image, STRIDE, w, w, PIXEL_RGB8, b);
+        kernel_ms = (now_ms() - start) / reps;
+        if (memcmp(a, b, (size_t) w * w * 3)) {
+            printf("MISMATCH copying %u x %u\n", w, w);
+            failures++;
+        }
+        printf("%-26s %6u %12.3f %12.3f %7.2fx\n", "copy RGB8", w, generic_ms, kernel_ms, generic_ms / kernel_ms);
+
+        start = now_ms();
+        for (r = 0; r < reps; r++)
+            generic_copy(image, STRIDE, w, w, rgb, 3, bgr, 4, a);
+        generic_ms = (now_ms() - start) / reps;
+        start = now_ms();
+        for (r = 0; r < reps; r++)
+            pixel_copy_tile(PIXEL_RGB8, image, STRIDE, w, w, PIXEL_BGRA8, b);
+        kernel_ms = (now_ms() - start) / reps;
+        if (memcmp(a, b, (size_t) w * w * 4)) {
+            printf("MISMATCH converting %u x %u\n", w, w);
+            failures++;
+        }
+        printf("%-26s %6u %12.3f %12.3f %7.2fx\n", "convert RGB8 to BGRA8", w, generic_ms, kernel_ms, generic_ms / kernel_ms);
+    }
+
+    free(image);
+    free(a);
+    free(b);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,69 @@
+/* Writes a synthetic JPEG of any size for make check, a row at a time, so
+ * even the largest ones need little memory. The pattern is a gradient with
+ * a grid every 256 pixels, so misplaced subtextures are easy to spot. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <jpeglib.h>
+
+int main(int argc, char *argv[]) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row_pointer[1];
+    unsigned char *row;
+    unsigned int width, height, x, y;
+    FILE *out;
+
+    if (argc != 4) {
+        fprintf(stderr, "USAGE: %s width height file.jpg\n", argv[0]);
+        exit(1);
+    }
+    width = atoi(argv[1]);
+    height = atoi(argv[2]);
+    if (width == 0 || height == 0 || width > JPEG_MAX_DIMENSION || height > JPEG_MAX_DIMENSION) {
+        fprintf(stderr, "Can't make a %s x %s JPEG\n", argv[1], argv[2]);
+        exit(1);
+    }
+    out = fopen(argv[3], "wb");
+    if (!out) {
+        perror("Couldn't open output file");
+        exit(1);
+    }
+    row = (unsigned char *) malloc((size_t) width * 3);
+    if (!row) {
+        perror("Out of memory allocating a row");
+        exit(1);
+    }
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, out);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 75, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    row_pointer[0] = row;
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            if (x % 256 == 0 || y % 256 == 0) {
+                row[x * 3] = row[x * 3 + 1] = row[x * 3 + 2] = 0;
+            }
+            else {
+                row[x * 3] = (unsigned long) x * 255 / width;
+                row[x * 3 + 1] = (unsigned long) y * 255 / height;
+                row[x * 3 + 2] = 128;
+            }
+        }
+        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    fclose(out);
+    free(row);
+    return 0;
+}
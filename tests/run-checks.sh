@@ -0,0 +1,111 @@
+#!/bin/sh
+# Loads synthetic images of every size in tests/sizes through lg-pano
+# --selftest, on software GL, and fails if any image isn't completely
+# covered by textures of the right sizes, or if loading it takes longer or
+# uses more memory than its budget. Run by make check.
+#
+#   LG_PANO             lg-pano binary to test (./lg-pano)
+#   CHECK_SIZES         list of images and budgets (tests/sizes)
+#   CHECK_DIR           where generated images are kept between runs
+#   CHECK_BUDGET_SCALE  multiplies every time and memory budget (1)
+#   CHECK_RESULTS       where to record each image's results (check-results.txt)
+
+LG_PANO=${LG_PANO:-./lg-pano}
+GEN_JPEG=${GEN_JPEG:-tests/gen-jpeg}
+CHECK_SIZES=${CHECK_SIZES:-tests/sizes}
+CHECK_DIR=${CHECK_DIR:-${TMPDIR:-/tmp}/lg-pano-check}
+CHECK_BUDGET_SCALE=${CHECK_BUDGET_SCALE:-1}
+CHECK_RESULTS=${CHECK_RESULTS:-check-results.txt}
+
+# Mesa's software rasterizer, so results don't depend on the GPU
+LIBGL_ALWAYS_SOFTWARE=1
+export LIBGL_ALWAYS_SOFTWARE
+
+run_headless() {
+    if [ -n "$DISPLAY" ]; then
+        "$@"
+    else
+        xvfb-run -a -s "-screen 0 1024x768x24" "$@"
+    fi
+}
+
+if [ -z "$DISPLAY" ] && ! command -v xvfb-run > /dev/null 2>&1; then
+    echo "make check needs an X display, or xvfb-run to make one" >&2
+    exit 1
+fi
+mkdir -p "$CHECK_DIR" || exit 1
+
+image_for() {
+    file="$CHECK_DIR/$1x$2.jpg"
+    if [ ! -s "$file" ]; then
+        "$GEN_JPEG" "$1" "$2" "$file.tmp" && mv "$file.tmp" "$file" || return 1
+    fi
+    echo "$file"
+}
+
+# Find the largest texture size, for the sizes given relative to it
+file=$(image_for 1 1) || exit 1
+max=$(run_headless "$LG_PANO" --selftest --width=64 --height=64 "$file" 2> /dev/null |
+      sed -n 's/.*max_texture=\([0-9]*\).*/\1/p')
+if [ -z "$max" ]; then
+    echo "Couldn't run $LG_PANO --selftest" >&2
+    exit 1
+fi
+echo "GL_MAX_TEXTURE_SIZE is $max"
+
+: > "$CHECK_RESULTS"
+passed=0
+failed=0
+while read -r width height max_ms max_rss_mb opts; do
+    case "$width" in
+        ''|'#'*) continue ;;
+    esac
+    width=$(( $(echo "$width" | sed "s/max/$max/") ))
+    height=$(( $(echo "$height" | sed "s/max/$max/") ))
+    label="${width}x${height}${opts:+ $opts}"
+
+    if ! file=$(image_for "$width" "$height"); then
+        echo "FAIL $label: couldn't generate the image"
+        failed=$((failed + 1))
+        continue
+    fi
+    # opts is deliberately split into words
+    result=$(run_headless "$LG_PANO" --selftest --width=640 --height=480 $opts "$file" 2> "$CHECK_DIR/last.log" |
+             grep '^selftest:')
+    echo "$label $result" >> "$CHECK_RESULTS"
+    if [ -z "$result" ]; then
+        echo "FAIL $label: lg-pano died; see $CHECK_DIR/last.log"
+        failed=$((failed + 1))
+        continue
+    fi
+
+    verdict=$(echo "$result" | awk -v max_ms="$max_ms" -v max_rss_mb="$max_rss_mb" -v scale="$CHECK_BUDGET_SCALE" '{
+        for (i = 1; i <= NF; i++) {
+            split($i, kv, "=")
+            v[kv[1]] = kv[2]
+        }
+        rss_mb = v["peak_rss_kb"] / 1024
+        if (v["coverage"] != "ok")
+            printf "FAIL: textures don'"'"'t cover the image"
+        else if (v["load_ms"] > max_ms * scale)
+            printf "FAIL: took %d ms, over the %d ms budget", v["load_ms"], max_ms * scale
+        else if (rss_mb > max_rss_mb * scale)
+            printf "FAIL: peak RSS %d MB, over the %d MB budget", rss_mb, max_rss_mb * scale
+        else
+            printf "ok: %d ms, peak RSS %d MB, %d textures", v["load_ms"], rss_mb, v["textures"]
+    }')
+    case "$verdict" in
+        ok*)
+            echo "PASS $label: ${verdict#ok: }"
+            passed=$((passed + 1))
+            ;;
+        *)
+            echo "FAIL $label: ${verdict#FAIL: }"
+            sed 's/^/    /' "$CHECK_DIR/last.log" | grep -v 'zoom factor' | tail -5
+            failed=$((failed + 1))
+            ;;
+    esac
+done < "$CHECK_SIZES"
+
+echo "$passed passed, $failed failed; results in $CHECK_RESULTS"
+[ "$failed" -eq 0 ]
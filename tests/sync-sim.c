@@ -0,0 +1,617 @@
+/* Runs a master and several slaves in one process, each on its own thread,
+ * sending the real sync packets to each other over loopback UDP, and
+ * measures how far the slaves' screens stray from the master's. Nothing is
+ * drawn: each node runs lg-pano's own rules, from view-schedule.c, for which
+ * packets to take and when to show them, and records what it would have on
+ * screen each frame. Loading
+ * an image just takes --decode milliseconds, during which that node's screen
+ * is stuck. Packets go through a relay thread that can lose, delay and
+ * reorder them, so sync changes can be tried against a bad network without
+ * a wall of machines. Run by make sim.
+ *
+ * The master pans across each image for the first 60% of --switch seconds,
+ * sits still for the rest, sending heartbeats, and moves on to the next. At
+ * the end it prints how far, in pixels, the worst slave was from the master
+ * on each frame they showed the same image, how many frames some slave was
+ * on a different image, and the skew between the first and last screen to
+ * show each new image. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../sync-protocol.h"
+#include "../view-schedule.h"
+
+#define MOVING 0.6          /* Fraction of each image's time spent panning */
+
+struct {
+    int slaves;
+    float seconds, fps;
+    float loss;             /* Percent of packets dropped */
+    float delay, jitter;    /* ms every packet takes, and up to this much more */
+    float lead;             /* ms ahead to schedule changes, like --synclead */
+    float clock_error;      /* Slaves' clock estimates are off by up to this many ms */
+    float decode, slow;     /* ms to load an image; extra for the first slave */
+    float heartbeat;        /* Seconds, like --heartbeat */
+    float switch_s, speed;  /* Seconds per image; pixels a second while panning */
+    char *frames;           /* File to write every node's every frame to */
+    unsigned int seed;
+} sim = {
+    4,      /* slaves */
+    10, 60, /* seconds, frames per second */
+    0,      /* loss */
+    0.5, 0, /* delay, jitter */
+    0,      /* lead */
+    0,      /* clock error */
+    50, 0,  /* decode, slow */
+    1,      /* heartbeat */
+    2, 600, /* switch, speed */
+    NULL,   /* frames */
+    1       /* seed */
+};
+
+typedef struct {
+    double t;                   /* When the frame was shown, ms after the start */
+    int img_idx, horiz_disp, vert_disp;
+} frame_rec;
+
+/* A screen: node 0 is the master, the rest are slaves */
+typedef struct {
+    int index, sock;
+    struct sockaddr_in addr;
+    double clock_error, decode_ms;
+    view_state shown, loading;  /* shown.img_idx is -1 until something is */
+    double busy_until;          /* Loading an image until then, 0 if not */
+    view_schedule schedule;
+    view_state control;         /* The view as last received, as in lg-pano */
+    unsigned long packets, taken;
+    frame_rec *frames;
+    pthread_t thread;
+} node;
+
+typedef struct {
+    double due;
+    node *to;
+    sync_struct sync;
+} in_flight;
+
+node *nodes;
+int num_nodes, num_frames;
+double start_ms, end_ms, frame_ms;
+volatile int stopping = 0;
+
+/* The network: packets wait here, in order of when they're due */
+in_flight *queue;
+int queued = 0, queue_size = 0;
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond;
+unsigned int net_seed;
+unsigned long sent = 0, dropped = 0;
+int relay_sock;
+
+double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+struct timespec ms_timespec(double ms) {
+    struct timespec ts;
+
+    ts.tv_sec = (time_t) (ms / 1000);
+    ts.tv_nsec = (long) ((ms - ts.tv_sec * 1000.0) * 1000000);
+    return ts;
+}
+
+void sleep_until(double ms) {
+    struct timespec ts;
+    double now = now_ms();
+
+    if (ms <= now)
+        return;
+    ts = ms_timespec(ms - now);
+    nanosleep(&ts, NULL);
+}
+
+double uniform(unsigned int *seed) {
+    return rand_r(seed) / (RAND_MAX + 1.0);
+}
+
+void usage(const char *pname) {
+    printf("%s [options]\n"
+"\t--slaves=##      Slaves to run alongside the master. Default 4.\n"
+"\t--seconds=##     How long to run for. Default 10.\n"
+"\t--fps=##         Frames a second each screen draws. Default 60.\n"
+"\t--loss=##        Percent of sync packets the network drops. Default 0.\n"
+"\t--delay=##       Milliseconds every packet spends on the network. Default 0.5.\n"
+"\t--jitter=##      Up to this many more milliseconds, at random, so packets sent\n"
+"\t                 closer together than this can arrive out of order. Default 0.\n"
+"\t--lead=##        Milliseconds ahead to schedule changes, like lg-pano --synclead.\n"
+"\t--clockerror=##  Slaves' estimates of the master's clock are off by up to this\n"
+"\t                 many milliseconds, either way. Only matters with --lead.\n"
+"\t--decode=##      Milliseconds every screen takes to load an image. Default 50.\n"
+"\t--slow=##        Milliseconds more the first slave takes. Default 0.\n"
+"\t--heartbeat=##   Seconds between heartbeats while still, 0 for none. Default 1.\n"
+"\t--switch=##      Seconds the master spends on each image. Default 2.\n"
+"\t--speed=##       Pixels a second the master pans at. Default 600.\n"
+"\t--frames=file    Write what every screen showed on every frame to file.\n"
+"\t--seed=##        Seed for the network's and clocks' randomness. Default 1.\n",
+        pname);
+}
+
+void get_options(int argc, char * const argv[]) {
+    static struct option long_options[] = {
+        { "slaves",     required_argument,  NULL, 'n' },
+        { "seconds",    required_argument,  NULL, 't' },
+        { "fps",        required_argument,  NULL, 'f' },
+        { "loss",       required_argument,  NULL, 'l' },
+        { "delay",      required_argument,  NULL, 'd' },
+        { "jitter",     required_argument,  NULL, 'j' },
+        { "lead",       required_argument,  NULL, 'a' },
+        { "clockerror", required_argument,  NULL, 'c' },
+        { "decode",     required_argument,  NULL, 'D' },
+        { "slow",       required_argument,  NULL, 'S' },
+        { "heartbeat",  required_argument,  NULL, 'b' },
+        { "switch",     required_argument,  NULL, 's' },
+        { "speed",      required_argument,  NULL, 'p' },
+        { "frames",     required_argument,  NULL, 'o' },
+        { "seed",       required_argument,  NULL, 'r' },
+        { "help",       no_argument,        NULL, 'h' },
+        { 0, 0, 0, 0 }
+    };
+    int c;
+
+    while ((c = getopt_long(argc, argv, "n:t:f:l:d:j:a:c:D:S:b:s:p:o:r:h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'n': sim.slaves = atoi(optarg); break;
+            case 't': sim.seconds = atof(optarg); break;
+            case 'f': sim.fps = atof(optarg); break;
+            case 'l': sim.loss = atof(optarg); break;
+            case 'd': sim.delay = atof(optarg); break;
+            case 'j': sim.jitter = atof(optarg); break;
+            case 'a': sim.lead = atof(optarg); break;
+            case 'c': sim.clock_error = atof(optarg); break;
+            case 'D': sim.decode = atof(optarg); break;
+            case 'S': sim.slow = atof(optarg); break;
+            case 'b': sim.heartbeat = atof(optarg); break;
+            case 's': sim.switch_s = atof(optarg); break;
+            case 'p': sim.speed = atof(optarg); break;
+            case 'o': sim.frames = optarg; break;
+            case 'r': sim.seed = atoi(optarg); break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (sim.slaves < 1 || sim.seconds <= 0 || sim.fps <= 0 || sim.switch_s <= 0) {
+        fprintf(stderr, "Need at least one slave, and positive --seconds, --fps and --switch\n");
+        exit(1);
+    }
+}
+
+/* Put a packet on the network, for the relay to deliver when it's due */
+void transport_send(node *to, const sync_struct *sync) {
+    in_flight p;
+    int i;
+
+    pthread_mutex_lock(&queue_lock);
+    sent++;
+    if (uniform(&net_seed) * 100 < sim.loss) {
+        dropped++;
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+    p.due = now_ms() + sim.delay + uniform(&net_seed) * sim.jitter;
+    p.to = to;
+    p.sync = *sync;
+    if (queued == queue_size) {
+        queue_size = queue_size ? queue_size * 2 : 64;
+        queue = (in_flight *) realloc(queue, queue_size * sizeof(in_flight));
+        if (!queue) {
+            perror("Out of memory");
+            exit(1);
+        }
+    }
+    for (i = queued; i > 0 && queue[i - 1].due > p.due; i--)
+        queue[i] = queue[i - 1];
+    queue[i] = p;
+    queued++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void *relay_main(void *arg) {
+    struct timespec ts;
+    in_flight p;
+    double now;
+
+    (void) arg;
+    pthread_mutex_lock(&queue_lock);
+    while (!stopping) {
+        now = now_ms();
+        if (queued == 0 || queue[0].due > now) {
+            ts = ms_timespec(queued ? queue[0].due : now + 10);
+            pthread_cond_timedwait(&queue_cond, &queue_lock, &ts);
+            continue;
+        }
+        p = queue[0];
+        memmove(queue, queue + 1, --queued * sizeof(in_flight));
+        pthread_mutex_unlock(&queue_lock);
+        if (sendto(relay_sock, &p.sync, sizeof(p.sync), 0, (struct sockaddr *) &p.to->addr, sizeof(p.to->addr)) !=
+            (ssize_t) sizeof(p.sync))
+            perror("Couldn't relay sync packet");
+        pthread_mutex_lock(&queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+/* A slave's udp_handler() and next_due_view(). The master's clock is ours,
+ * so the slave's estimate of the offset to it is just its error. */
+void take_sync(node *n, const sync_struct *data, double now) {
+    n->packets++;
+    if (data->flag != SYNC_FLAG || data->version != SYNC_VERSION) {
+        fprintf(stderr, "Wrong flag value\n");
+        return;
+    }
+    if (!sync_take(&n->control, data, now, &n->clock_error))
+        return;
+    n->taken++;
+    view_schedule_add(&n->schedule, &n->control);
+}
+
+/* Draw a frame: show whatever's due, unless we're stuck loading an image */
+void draw_frame(node *n, double now) {
+    frame_rec *r;
+    view_state v;
+    int f;
+
+    if (n->busy_until && now >= n->busy_until) {
+        n->shown = n->loading;
+        n->busy_until = 0;
+    }
+    if (!n->busy_until && view_schedule_next(&n->schedule, now, &v)) {
+        if (v.img_idx != n->shown.img_idx && n->decode_ms > 0) {
+            n->loading = v;
+            n->busy_until = now + n->decode_ms;
+        }
+        else
+            n->shown = v;
+    }
+
+    f = (int) ((now - start_ms) / frame_ms);
+    if (f < 0 || f >= num_frames)
+        return;
+    r = &n->frames[f];
+    r->t = now - start_ms;
+    r->img_idx = n->shown.img_idx;
+    r->horiz_disp = (int) n->shown.horiz_disp;
+    r->vert_disp = (int) n->shown.vert_disp;
+}
+
+/* Where the master's script says to look, at t ms from the start */
+void script(double t, view_state *v) {
+    double period = sim.switch_s * 1000, into;
+
+    v->img_idx = (int) (t / period);
+    into = fmod(t, period);
+    if (into > period * MOVING)
+        into = period * MOVING;
+    v->horiz_disp = (int) (sim.speed * into / 1000);
+    v->vert_disp = (int) v->horiz_disp / 2;
+}
+
+void send_all(const sync_struct *sync) {
+    int i;
+
+    for (i = 1; i < num_nodes; i++)
+        transport_send(&nodes[i], sync);
+}
+
+void *master_main(void *arg) {
+    node *n = (node *) arg;
+    sync_struct sync;
+    view_state control, want;
+    double now, next = start_ms, last_sync_ms = 0;
+    unsigned int seq = 0;
+
+    memset(&control, 0, sizeof(control));
+    memset(&want, 0, sizeof(want));
+    control.img_idx = -1;
+    sleep_until(start_ms);
+    while ((now = now_ms()) < end_ms) {
+        script(now - start_ms, &want);
+        memset(&sync, 0, sizeof(sync));
+        sync.flag = SYNC_FLAG;
+        sync.version = SYNC_VERSION;
+        sync.img_idx = want.img_idx;
+        sync.horiz_disp = want.horiz_disp;
+        sync.vert_disp = want.vert_disp;
+        sync.tex_max_x = sync.tex_max_y = 1;
+        if (want.img_idx != control.img_idx || want.horiz_disp != control.horiz_disp ||
+            want.vert_disp != control.vert_disp) {
+            control = want;
+            control.apply_ms = sim.lead ? now + sim.lead : 0;
+            sync.seq = ++seq;
+            sync.apply_at = control.apply_ms;
+            send_all(&sync);
+            view_schedule_add(&n->schedule, &control);
+            last_sync_ms = now;
+        }
+        else if (sim.heartbeat && now - last_sync_ms >= sim.heartbeat * 1000) {
+            sync.seq = seq;
+            sync.heartbeat = 1;
+            send_all(&sync);
+            last_sync_ms = now;
+        }
+
+        draw_frame(n, now);
+        next += frame_ms;
+        if (next < now)
+            next = now + frame_ms - fmod(now - start_ms, frame_ms);
+        sleep_until(next);
+    }
+    return NULL;
+}
+
+void *slave_main(void *arg) {
+    node *n = (node *) arg;
+    struct pollfd pfd;
+    struct timespec ts;
+    sync_struct sync;
+    unsigned int seed = sim.seed * 7919 + n->index;
+    double now, next;
+
+    /* Screens aren't genlocked, so each starts its frames at its own phase */
+    next = start_ms + uniform(&seed) * frame_ms;
+    pfd.fd = n->sock;
+    pfd.events = POLLIN;
+    while ((now = now_ms()) < end_ms) {
+        ts = ms_timespec(next > now ? next - now : 0);
+        if (ppoll(&pfd, 1, &ts, NULL) > 0) {
+            now = now_ms();
+            while (recv(n->sock, &sync, sizeof(sync), MSG_DONTWAIT) == (ssize_t) sizeof(sync))
+                take_sync(n, &sync, now);
+        }
+        now = now_ms();
+        if (now >= next) {
+            draw_frame(n, now);
+            next += frame_ms;
+            if (next < now)
+                next = now + frame_ms - fmod(now - next, frame_ms);
+        }
+    }
+    return NULL;
+}
+
+void setup_nodes(void) {
+    unsigned int seed = sim.seed;
+    socklen_t len;
+    int i, f;
+
+    num_nodes = sim.slaves + 1;
+    num_frames = (int) (sim.seconds * sim.fps);
+    nodes = (node *) calloc(num_nodes, sizeof(node));
+    if (!nodes) {
+        perror("Out of memory");
+        exit(1);
+    }
+    for (i = 0; i < num_nodes; i++) {
+        node *n = &nodes[i];
+
+        n->index = i;
+        n->shown.img_idx = -1;
+        n->control.img_idx = -1;
+        n->decode_ms = sim.decode + (i == 1 ? sim.slow : 0);
+        if (i > 0)
+            n->clock_error = (uniform(&seed) * 2 - 1) * sim.clock_error;
+        n->frames = (frame_rec *) malloc(num_frames * sizeof(frame_rec));
+        if (!n->frames) {
+            perror("Out of memory");
+            exit(1);
+        }
+        for (f = 0; f < num_frames; f++)
+            n->frames[f].img_idx = -2;     /* No frame drawn in this slot */
+        if (i == 0)
+            continue;
+
+        n->sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (n->sock < 0) {
+            perror("Couldn't open a slave's socket");
+            exit(1);
+        }
+        n->addr.sin_family = AF_INET;
+        n->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        n->addr.sin_port = 0;
+        len = sizeof(n->addr);
+        if (bind(n->sock, (struct sockaddr *) &n->addr, sizeof(n->addr)) < 0 ||
+            getsockname(n->sock, (struct sockaddr *) &n->addr, &len) < 0) {
+            perror("Couldn't bind a slave's socket");
+            exit(1);
+        }
+    }
+    relay_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (relay_sock < 0) {
+        perror("Couldn't open the relay's socket");
+        exit(1);
+    }
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Mean, 95th percentile and worst of n values, which get sorted */
+void print_spread(const char *what, double *v, int n) {
+    double sum = 0;
+    int i;
+
+    if (n == 0) {
+        printf("%-26s none\n", what);
+        return;
+    }
+    qsort(v, n, sizeof(double), compare_doubles);
+    for (i = 0; i < n; i++)
+        sum += v[i];
+    printf("%-26s mean %7.2f  p95 %7.2f  max %7.2f\n", what, sum / n, v[(int) (0.95 * (n - 1))], v[n - 1]);
+}
+
+/* The most recent frame a node drew at or before frame f, or NULL */
+frame_rec *frame_at(node *n, int f) {
+    for (; f >= 0; f--) {
+        if (n->frames[f].img_idx != -2)
+            return &n->frames[f];
+    }
+    return NULL;
+}
+
+void report(void) {
+    FILE *out = NULL;
+    double *divergence, *skew, *lag, d, first, last;
+    int f, i, k, compared = 0, wrong = 0, num_switches, num_skew = 0, num_lag, missed = 0, wrong_here;
+    frame_rec *m, *s;
+
+    if (sim.frames) {
+        out = fopen(sim.frames, "w");
+        if (!out)
+            perror("Couldn't write frames file");
+        else
+            fprintf(out, "frame,ms,node,img_idx,horiz_disp,vert_disp,divergence\n");
+    }
+
+    /* Each frame, the worst slave's distance from the master, in pixels */
+    divergence = (double *) malloc(num_frames * sizeof(double));
+    for (f = 0; f < num_frames; f++) {
+        m = frame_at(&nodes[0], f);
+        if (!m || m->img_idx < 0)
+            continue;
+        d = 0;
+        wrong_here = 0;
+        for (i = 1; i < num_nodes; i++) {
+            s = frame_at(&nodes[i], f);
+            if (!s || s->img_idx != m->img_idx)
+                wrong_here = 1;
+            else if (hypot(s->horiz_disp - m->horiz_disp, s->vert_disp - m->vert_disp) > d)
+                d = hypot(s->horiz_disp - m->horiz_disp, s->vert_disp - m->vert_disp);
+        }
+        if (wrong_here)
+            wrong++;
+        else
+            divergence[compared++] = d;
+        if (out) {
+            for (i = 0; i < num_nodes; i++) {
+                s = frame_at(&nodes[i], f);
+                if (!s)
+                    continue;
+                fprintf(out, "%d,%.2f,%d,%d,%d,%d,%.2f\n", f, s->t, i, s->img_idx, s->horiz_disp, s->vert_disp,
+                        s->img_idx == m->img_idx ? hypot(s->horiz_disp - m->horiz_disp, s->vert_disp - m->vert_disp) : -1.0);
+            }
+        }
+    }
+    if (out)
+        fclose(out);
+
+    /* When each screen first showed each image after the first */
+    num_switches = (int) (sim.seconds / sim.switch_s - 0.001);
+    skew = (double *) malloc((num_switches + 1) * sizeof(double));
+    lag = (double *) malloc(((num_switches + 1) * num_nodes + 1) * sizeof(double));
+    num_lag = 0;
+    for (k = 1; k <= num_switches; k++) {
+        double master_t = -1;
+
+        first = 1e30;
+        last = -1;
+        for (i = 0; i < num_nodes; i++) {
+            for (f = 0; f < num_frames && nodes[i].frames[f].img_idx != k; f++)
+                ;
+            if (f == num_frames) {
+                missed++;
+                continue;
+            }
+            d = nodes[i].frames[f].t;
+            if (i == 0)
+                master_t = d;
+            else if (master_t >= 0)
+                lag[num_lag++] = d - master_t;
+            if (d < first)
+                first = d;
+            if (d > last)
+                last = d;
+        }
+        if (last >= 0)
+            skew[num_skew++] = last - first;
+    }
+
+    printf("%d slaves, %d frames at %g fps; loss %g%%, delay %g + up to %g ms, lead %g ms, clock error up to %g ms\n",
+           sim.slaves, num_frames, sim.fps, sim.loss, sim.delay, sim.jitter, sim.lead, sim.clock_error);
+    printf("Sent %lu packets, dropped %lu\n", sent, dropped);
+    for (i = 1; i < num_nodes; i++)
+        printf("  slave %d: received %lu, took %lu\n", i, nodes[i].packets, nodes[i].taken);
+    print_spread("View divergence (px)", divergence, compared);
+    printf("%-26s %d of %d (%.1f%%)\n", "Frames on a wrong image", wrong, compared + wrong,
+           compared + wrong ? 100.0 * wrong / (compared + wrong) : 0.0);
+    print_spread("Image switch skew (ms)", skew, num_skew);
+    print_spread("Slaves behind master (ms)", lag, num_lag);
+    if (missed)
+        printf("%d times a screen never showed an image it should have\n", missed);
+    free(divergence);
+    free(skew);
+    free(lag);
+}
+
+int main(int argc, char *argv[]) {
+    pthread_condattr_t attr;
+    pthread_t relay;
+    int i;
+
+    get_options(argc, argv);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue_cond, &attr);
+    net_seed = sim.seed;
+    frame_ms = 1000 / sim.fps;
+    setup_nodes();
+
+    /* Give every thread a moment to get going before the first frame */
+    start_ms = now_ms() + 50;
+    end_ms = start_ms + sim.seconds * 1000;
+    if (pthread_create(&relay, NULL, relay_main, NULL) != 0) {
+        perror("Couldn't start the relay thread");
+        exit(1);
+    }
+    for (i = 0; i < num_nodes; i++) {
+        if (pthread_create(&nodes[i].thread, NULL, i ? slave_main : master_main, &nodes[i]) != 0) {
+            perror("Couldn't start a node's thread");
+            exit(1);
+        }
+    }
+    for (i = 0; i < num_nodes; i++)
+        pthread_join(nodes[i].thread, NULL);
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    pthread_join(relay, NULL);
+
+    report();
+    return 0;
+}
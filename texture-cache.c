@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "texture-cache.h"
+
+TAILQ_HEAD(texsetlisthead, texture_set_s) texset_list = TAILQ_HEAD_INITIALIZER(texset_list);
+size_t texcache_budget = 0,     /* 0 means no limit */
+       texcache_total = 0;
+int texcache_verbose = 0;
+
+void texcache_init(size_t budget, int verbose) {
+    texcache_budget = budget;
+    texcache_verbose = verbose;
+}
+
+void texcache_free(texture_set *set) {
+    TAILQ_REMOVE(&texset_list, set, entries);
+    glDeleteTextures(set->num_textures, set->names);
+    if (set->chroma)
+        glDeleteTextures(2 * set->num_textures, set->chroma);
+    texcache_total -= set->bytes;
+    if (texcache_verbose)
+        fprintf(stderr, "Released textures for image %d (%lu bytes)\n", set->img_idx, (unsigned long) set->bytes);
+    free(set->names);
+    free(set->chroma);
+    free(set->tile_bytes);
+    free(set->tile_whole);
+    free(set->tile_drawn);
+    free(set);
+}
+
+/* Returns whatever textures for an image are still resident. Some of its
+ * tiles may have been evicted, or never loaded. */
+texture_set *texcache_lookup(int img_idx) {
+    texture_set *set;
+
+    TAILQ_FOREACH(set, &texset_list, entries) {
+        if (set->img_idx == img_idx)
+            break;
+    }
+    return set;
+}
+
+/* An image was taken out of the list; drop its textures, and renumber the
+ * ones for images after it to match */
+void texcache_renumber(int removed) {
+    texture_set *set, *next;
+
+    for (set = TAILQ_FIRST(&texset_list); set; set = next) {
+        next = TAILQ_NEXT(set, entries);
+        if (set->img_idx == removed)
+            texcache_free(set);
+        else if (set->img_idx > removed)
+            set->img_idx--;
+    }
+}
+
+/* An image was put into the list at inserted; renumber the ones for images
+ * from there on to match */
+void texcache_insert(int inserted) {
+    texture_set *set;
+
+    TAILQ_FOREACH(set, &texset_list, entries) {
+        if (set->img_idx >= inserted)
+            set->img_idx++;
+    }
+}
+
+/* The image list was reordered; remap[old index] is each image's new index,
+ * or -1 if it's gone */
+void texcache_remap(const int *remap) {
+    texture_set *set, *next;
+
+    for (set = TAILQ_FIRST(&texset_list); set; set = next) {
+        next = TAILQ_NEXT(set, entries);
+        if (remap[set->img_idx] == -1)
+            texcache_free(set);
+        else
+            set->img_idx = remap[set->img_idx];
+    }
+}
+
+texture_set *texcache_new(int img_idx, int num_textures) {
+    texture_set *set;
+
+    set = (texture_set *) calloc(1, sizeof(texture_set));
+    if (set) {
+        set->names = (GLuint *) calloc(num_textures, sizeof(GLuint));
+        set->tile_bytes = (size_t *) calloc(num_textures, sizeof(size_t));
+        set->tile_whole = (unsigned char *) calloc(num_textures, 1);
+        set->tile_drawn = (unsigned long *) calloc(num_textures, sizeof(unsigned long));
+    }
+    if (!set || !set->names || !set->tile_bytes || !set->tile_whole || !set->tile_drawn) {
+        perror("Out of memory allocating texture set");
+        exit(1);
+    }
+    set->img_idx = img_idx;
+    set->num_textures = num_textures;
+    glGenTextures(num_textures, set->names);
+    TAILQ_INSERT_TAIL(&texset_list, set, entries);
+    return set;
+}
+
+/* Give each tile a pair of chroma textures, for images uploaded as YCbCr
+ * planes. The set's tile_bytes count all three planes. */
+void texcache_add_chroma(texture_set *set) {
+    set->chroma = (GLuint *) calloc(2 * set->num_textures, sizeof(GLuint));
+    if (!set->chroma) {
+        perror("Out of memory allocating texture set");
+        exit(1);
+    }
+    glGenTextures(2 * set->num_textures, set->chroma);
+}
+
+/* The pinned set belongs to the image on screen, and is never evicted */
+void texcache_pin(texture_set *set) {
+    texture_set *s;
+
+    TAILQ_FOREACH(s, &texset_list, entries)
+        s->pinned = (s == set);
+}
+
+/* A held set isn't evicted either, so an image can be loaded ahead of time
+ * without being put on screen */
+void texcache_hold(texture_set *set, int held) {
+    set->held = held;
+}
+
+/* Delete least recently drawn textures until we're back under budget */
+static void texcache_evict(void) {
+    texture_set *set, *victim_set;
+    int i, victim = 0;
+    unsigned long oldest;
+
+    while (texcache_budget && texcache_total > texcache_budget) {
+        victim_set = NULL;
+        oldest = 0;
+        TAILQ_FOREACH(set, &texset_list, entries) {
+            if (set->pinned || set->held)
+                continue;
+            for (i = 0; i < set->num_textures; i++) {
+                if (set->tile_bytes[i] && (!victim_set || set->tile_drawn[i] < oldest)) {
+                    victim_set = set;
+                    victim = i;
+                    oldest = set->tile_drawn[i];
+                }
+            }
+        }
+        if (!victim_set) {
+            if (texcache_verbose)
+                fprintf(stderr, "Current image alone needs %lu bytes of textures, over the %lu byte budget\n",
+                    (unsigned long) texcache_total, (unsigned long) texcache_budget);
+            return;
+        }
+
+        glDeleteTextures(1, &victim_set->names[victim]);
+        victim_set->names[victim] = 0;
+        if (victim_set->chroma) {
+            glDeleteTextures(2, &victim_set->chroma[2 * victim]);
+            victim_set->chroma[2 * victim] = victim_set->chroma[2 * victim + 1] = 0;
+        }
+        victim_set->bytes -= victim_set->tile_bytes[victim];
+        texcache_total -= victim_set->tile_bytes[victim];
+        victim_set->tile_bytes[victim] = 0;
+        victim_set->tile_whole[victim] = 0;
+        victim_set->resident--;
+        if (victim_set->resident == 0)
+            texcache_free(victim_set);
+    }
+}
+
+/* Record how much memory a texture just uploaded for this set is using */
+void texcache_account(texture_set *set, int tile, size_t bytes) {
+    if (set->tile_bytes[tile] == 0)
+        set->resident++;
+    set->bytes += bytes - set->tile_bytes[tile];
+    texcache_total += bytes - set->tile_bytes[tile];
+    set->tile_bytes[tile] = bytes;
+    texcache_evict();
+}
+
+void texcache_drawn(texture_set *set, int tile, unsigned long frame) {
+    set->tile_drawn[tile] = frame;
+}
+
+size_t texcache_bytes(void) {
+    return texcache_total;
+}
+
+int texcache_count(void) {
+    texture_set *set;
+    int n = 0;
+
+    TAILQ_FOREACH(set, &texset_list, entries)
+        n += set->resident;
+    return n;
+}
@@ -0,0 +1,43 @@
+#ifndef _texture_cache_h_
+#define _texture_cache_h_
+
+#include <GL/gl.h>
+#include <sys/queue.h>
+
+/* Owns every texture object lg-pano creates. Textures are kept per image, so
+ * flipping back to a recently viewed image doesn't have to decode it again,
+ * and the least recently drawn ones are deleted whenever the total goes over
+ * the VRAM budget. */
+
+typedef struct texture_set_s {
+    int img_idx;
+    unsigned int width, height;
+    int subtextured, cols, rows;
+    int num_textures;
+    GLuint *names;
+    GLuint *chroma;                 /* Cb and Cr for each tile, when names holds luma */
+    size_t *tile_bytes;             /* 0 if the tile isn't resident */
+    unsigned char *tile_whole;      /* Uploaded whole, not just folded in from finer tiles */
+    unsigned long *tile_drawn;      /* Frame each tile was last drawn in */
+    size_t bytes;
+    int resident, pinned;
+    int held;                       /* Being preloaded, or waiting to be shown */
+    TAILQ_ENTRY(texture_set_s) entries;
+} texture_set;
+
+void texcache_init(size_t budget, int verbose);
+texture_set *texcache_lookup(int img_idx);
+texture_set *texcache_new(int img_idx, int num_textures);
+void texcache_add_chroma(texture_set *);
+void texcache_free(texture_set *);
+void texcache_renumber(int removed);
+void texcache_insert(int inserted);
+void texcache_remap(const int *remap);
+void texcache_pin(texture_set *);
+void texcache_hold(texture_set *, int);
+void texcache_account(texture_set *, int tile, size_t bytes);
+void texcache_drawn(texture_set *, int tile, unsigned long frame);
+size_t texcache_bytes(void);
+int texcache_count(void);
+
+#endif
@@ -0,0 +1,439 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <GL/gl.h>
+#include "image-reader.h"
+#include "thumbnails.h"
+
+#define ATLAS_SIZE 2048
+#define ATLAS_COLS (ATLAS_SIZE / THUMB_W)
+#define CELLS_PER_ATLAS (ATLAS_COLS * (ATLAS_SIZE / THUMB_H))
+#define MAX_ATLASES 8               /* 1024 thumbnails, 96 MB of textures */
+#define MAX_THREADS 8
+#define HASH_BUCKETS 4096
+#define STRIP_ROWS 16
+#define UPLOADS_PER_CALL 16         /* So a burst of them doesn't stall a frame */
+
+/* Thumbnail states, as seen by the worker threads */
+#define T_IDLE 0                    /* Not queued, not in an atlas */
+#define T_QUEUED 1
+#define T_WORKING 2
+#define T_DONE 3                    /* Pixels waiting to be uploaded */
+#define T_RESIDENT 4
+#define T_FAILED 5
+
+struct thumb_s {
+    char *filename;
+    int state;
+    unsigned int w, h;
+    unsigned char *pixels;          /* Between being made and being uploaded */
+    int cell;                       /* Atlas * CELLS_PER_ATLAS + cell, or -1 */
+    unsigned long drawn;            /* Frame it was last drawn in */
+    struct thumb_s *next;           /* In its hash bucket */
+    TAILQ_ENTRY(thumb_s) entries;   /* In the work queue, or the done queue */
+};
+TAILQ_HEAD(thumbqueue, thumb_s);
+
+/* Entries are never freed, so the workers can hold on to one while it's
+ * T_WORKING without the lock. Everything else about them is under it. */
+pthread_mutex_t thumb_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t thumb_cond = PTHREAD_COND_INITIALIZER;
+struct thumbqueue thumb_work = TAILQ_HEAD_INITIALIZER(thumb_work);
+struct thumbqueue thumb_done = TAILQ_HEAD_INITIALIZER(thumb_done);
+struct thumb_s *thumb_hash[HASH_BUCKETS];
+int thumb_threads = 0, thumb_started = 0, thumb_verbose = 0;
+char thumb_dir[PATH_MAX];           /* Empty if there's nowhere to keep them */
+
+/* Main thread only */
+GLuint atlases[MAX_ATLASES];
+int num_atlases = 0;
+struct thumb_s *cells[MAX_ATLASES * CELLS_PER_ATLAS];
+
+static unsigned long long fnv64(const char *s) {
+    unsigned long long hash = 14695981039346656037ULL;
+
+    for (; *s; s++)
+        hash = (hash ^ (unsigned char) *s) * 1099511628211ULL;
+    return hash;
+}
+
+static void cache_file(const char *filename, char *path, size_t len) {
+    char real[PATH_MAX];
+
+    if (!realpath(filename, real))
+        snprintf(real, sizeof(real), "%s", filename);
+    snprintf(path, len, "%s/%016llx", thumb_dir, fnv64(real));
+}
+
+/* Read back a thumbnail saved on an earlier run, if the image hasn't
+ * changed since */
+static unsigned char *load_cached(const char *filename, const struct stat *st, unsigned int *w, unsigned int *h) {
+    char path[PATH_MAX + 32];
+    unsigned char *pixels;
+    long long mtime, size;
+    FILE *f;
+
+    if (!thumb_dir[0])
+        return NULL;
+    cache_file(filename, path, sizeof(path));
+    f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    if (fscanf(f, "lg-pano thumbnail %lld %lld %u %u", &mtime, &size, w, h) != 4 || fgetc(f) != '\n' ||
+        mtime != (long long) st->st_mtime || size != (long long) st->st_size ||
+        *w == 0 || *w > THUMB_W || *h == 0 || *h > THUMB_H) {
+        fclose(f);
+        return NULL;
+    }
+    pixels = (unsigned char *) malloc((size_t) *w * *h * 3);
+    if (pixels && fread(pixels, 3, (size_t) *w * *h, f) != (size_t) *w * *h) {
+        free(pixels);
+        pixels = NULL;
+    }
+    fclose(f);
+    return pixels;
+}
+
+static void save_cached(const char *filename, const struct stat *st, const unsigned char *pixels,
+                        unsigned int w, unsigned int h) {
+    char path[PATH_MAX + 32], tmp[PATH_MAX + 64];
+    FILE *f;
+
+    if (!thumb_dir[0])
+        return;
+    cache_file(filename, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%lu.tmp", path, (unsigned long) pthread_self());
+    f = fopen(tmp, "wb");
+    if (!f)
+        return;
+    fprintf(f, "lg-pano thumbnail %lld %lld %u %u\n", (long long) st->st_mtime, (long long) st->st_size, w, h);
+    if (fwrite(pixels, 3, (size_t) w * h, f) != (size_t) w * h || fclose(f) != 0 || rename(tmp, path) != 0) {
+        if (thumb_verbose)
+            fprintf(stderr, "Couldn't save thumbnail %s: %s\n", path, strerror(errno));
+        remove(tmp);
+    }
+}
+
+/* Decode an image, as small as libjpeg, or a pyramidal TIFF, will give it
+ * to us while still being bigger than the thumbnail, and box filter it down
+ * the rest of the way, a strip at a time */
+static unsigned char *make_thumbnail(const char *filename, unsigned int *tw, unsigned int *th) {
+    image_reader r;
+    unsigned char *strip = NULL, *out = NULL, *row;
+    unsigned long *sums = NULL;
+    unsigned int *col_of = NULL, *col_count = NULL;
+    unsigned int denom = 1, x, y, n, i, c, ty, rows_in = 0, cur_ty = 0;
+
+    if (!image_reader_open(&r, filename))
+        return NULL;
+    while (denom < 8 && r.width / (denom * 2) >= THUMB_W && r.height / (denom * 2) >= THUMB_H)
+        denom *= 2;
+    if (denom > 1 && r.type == READER_JPEG) {
+        image_reader_close(&r);
+        if (!image_reader_open_scaled(&r, filename, denom) && !image_reader_open(&r, filename))
+            return NULL;
+    }
+    else if (r.type == READER_TIFF) {
+        /* Pyramids go well past an eighth */
+        while (r.width / (denom * 2) >= THUMB_W && r.height / (denom * 2) >= THUMB_H)
+            denom *= 2;
+        while (denom > 1 && !image_reader_select_level(&r, denom))
+            denom /= 2;
+    }
+
+    /* Fit it in THUMB_W x THUMB_H, keeping its shape */
+    if ((unsigned long) r.width * THUMB_H > (unsigned long) r.height * THUMB_W) {
+        *tw = r.width < THUMB_W ? r.width : THUMB_W;
+        *th = (unsigned int) ((unsigned long) r.height * *tw / r.width);
+    }
+    else {
+        *th = r.height < THUMB_H ? r.height : THUMB_H;
+        *tw = (unsigned int) ((unsigned long) r.width * *th / r.height);
+    }
+    if (*tw == 0)
+        *tw = 1;
+    if (*th == 0)
+        *th = 1;
+
+    strip = (unsigned char *) malloc((size_t) r.width * 3 * STRIP_ROWS);
+    out = (unsigned char *) calloc((size_t) *tw * *th, 3);
+    sums = (unsigned long *) calloc((size_t) *tw * 3, sizeof(unsigned long));
+    col_of = (unsigned int *) malloc(sizeof(unsigned int) * r.width);
+    col_count = (unsigned int *) calloc(*tw, sizeof(unsigned int));
+    if (!strip || !out || !sums || !col_of || !col_count) {
+        perror("Out of memory making thumbnail");
+        free(out);
+        out = NULL;
+        goto done;
+    }
+    for (x = 0; x < r.width; x++) {
+        col_of[x] = (unsigned int) ((unsigned long) x * *tw / r.width);
+        col_count[col_of[x]]++;
+    }
+
+    for (y = 0; y < r.height; y += n) {
+        n = image_reader_read_rows(&r, strip, STRIP_ROWS);
+        if (n == 0)
+            break;
+        for (i = 0; i < n; i++) {
+            ty = (unsigned int) ((unsigned long) (y + i) * *th / r.height);
+            if (ty != cur_ty) {
+                for (x = 0; x < *tw * 3; x++) {
+                    out[(size_t) cur_ty * *tw * 3 + x] = sums[x] / ((unsigned long) col_count[x / 3] * rows_in);
+                    sums[x] = 0;
+                }
+                cur_ty = ty;
+                rows_in = 0;
+            }
+            row = strip + (size_t) i * r.width * 3;
+            for (x = 0; x < r.width; x++) {
+                for (c = 0; c < 3; c++)
+                    sums[col_of[x] * 3 + c] += row[x * 3 + c];
+            }
+            rows_in++;
+        }
+    }
+    if (y == 0) {
+        free(out);
+        out = NULL;
+    }
+    else if (rows_in) {
+        for (x = 0; x < *tw * 3; x++)
+            out[(size_t) cur_ty * *tw * 3 + x] = sums[x] / ((unsigned long) col_count[x / 3] * rows_in);
+    }
+
+done:
+    image_reader_close(&r);
+    free(strip);
+    free(sums);
+    free(col_of);
+    free(col_count);
+    return out;
+}
+
+static void *thumb_main(void *arg) {
+    struct thumb_s *t;
+    struct stat st;
+    unsigned char *pixels;
+    unsigned int w = 0, h = 0;
+
+    pthread_mutex_lock(&thumb_lock);
+    while (1) {
+        while (TAILQ_EMPTY(&thumb_work))
+            pthread_cond_wait(&thumb_cond, &thumb_lock);
+        t = TAILQ_FIRST(&thumb_work);
+        TAILQ_REMOVE(&thumb_work, t, entries);
+        t->state = T_WORKING;
+        pthread_mutex_unlock(&thumb_lock);
+
+        pixels = NULL;
+        if (stat(t->filename, &st) == 0) {
+            pixels = load_cached(t->filename, &st, &w, &h);
+            if (!pixels) {
+                pixels = make_thumbnail(t->filename, &w, &h);
+                if (pixels)
+                    save_cached(t->filename, &st, pixels, w, h);
+                if (thumb_verbose)
+                    fprintf(stderr, "%s thumbnail for %s\n", pixels ? "Made" : "Couldn't make", t->filename);
+            }
+        }
+
+        pthread_mutex_lock(&thumb_lock);
+        if (pixels) {
+            t->pixels = pixels;
+            t->w = w;
+            t->h = h;
+            t->state = T_DONE;
+            TAILQ_INSERT_TAIL(&thumb_done, t, entries);
+        }
+        else
+            t->state = T_FAILED;
+    }
+    return NULL;
+}
+
+/* Where to keep thumbnails, made if need be */
+static void find_thumb_dir(void) {
+    const char *base = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    char dir[PATH_MAX];
+
+    thumb_dir[0] = '\0';
+    if (base && *base)
+        snprintf(dir, sizeof(dir), "%s", base);
+    else if (home && *home)
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+        return;
+    mkdir(dir, 0755);
+    strncat(dir, "/lg-pano", sizeof(dir) - strlen(dir) - 1);
+    mkdir(dir, 0755);
+    strncat(dir, "/thumbs", sizeof(dir) - strlen(dir) - 1);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("Couldn't make thumbnail cache directory");
+        return;
+    }
+    snprintf(thumb_dir, sizeof(thumb_dir), "%s", dir);
+}
+
+/* Threads aren't started until the first thumbnail is asked for */
+void thumbnails_init(int threads, int verbose) {
+    thumb_threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+    thumb_verbose = verbose;
+}
+
+static void start_threads(void) {
+    pthread_t thread;
+    int i;
+
+    thumb_started = 1;
+    find_thumb_dir();
+    for (i = 0; i < thumb_threads; i++) {
+        if (pthread_create(&thread, NULL, thumb_main, NULL) != 0) {
+            perror("Couldn't start thumbnail thread");
+            break;
+        }
+        pthread_detach(thread);
+    }
+    if (thumb_verbose)
+        fprintf(stderr, "Started %d thumbnail threads, caching in %s\n", i, thumb_dir[0] ? thumb_dir : "(nowhere)");
+}
+
+static struct thumb_s *find_thumb(const char *filename) {
+    unsigned long long hash = fnv64(filename) % HASH_BUCKETS;
+    struct thumb_s *t;
+
+    for (t = thumb_hash[hash]; t; t = t->next) {
+        if (!strcmp(t->filename, filename))
+            return t;
+    }
+    t = (struct thumb_s *) calloc(1, sizeof(struct thumb_s));
+    if (!t)
+        return NULL;
+    t->filename = strdup(filename);
+    if (!t->filename) {
+        free(t);
+        return NULL;
+    }
+    t->cell = -1;
+    t->next = thumb_hash[hash];
+    thumb_hash[hash] = t;
+    return t;
+}
+
+/* Look up filename's thumbnail, filling in r if it's in an atlas, and asking
+ * for it to be made if it isn't. Urgent requests go to the front of the
+ * queue, ahead of everything asked for so far. Returns a THUMB_ state. */
+int thumbnails_get(const char *filename, int urgent, unsigned long frame, thumb_rect *r) {
+    struct thumb_s *t;
+    int state, cell;
+
+    if (!thumb_started)
+        start_threads();
+    pthread_mutex_lock(&thumb_lock);
+    t = find_thumb(filename);
+    if (!t) {
+        pthread_mutex_unlock(&thumb_lock);
+        return THUMB_FAILED;
+    }
+    if (t->state == T_IDLE || (urgent && t->state == T_QUEUED)) {
+        if (t->state == T_QUEUED)
+            TAILQ_REMOVE(&thumb_work, t, entries);
+        if (urgent)
+            TAILQ_INSERT_HEAD(&thumb_work, t, entries);
+        else
+            TAILQ_INSERT_TAIL(&thumb_work, t, entries);
+        t->state = T_QUEUED;
+        pthread_cond_signal(&thumb_cond);
+    }
+    state = t->state;
+    if (state == T_RESIDENT) {
+        t->drawn = frame;
+        cell = t->cell % CELLS_PER_ATLAS;
+        r->atlas = t->cell / CELLS_PER_ATLAS;
+        r->texture = atlases[r->atlas];
+        r->w = t->w;
+        r->h = t->h;
+        /* Half a texel in, so filtering doesn't pick up the neighbours */
+        r->s0 = ((cell % ATLAS_COLS) * THUMB_W + 0.5) / ATLAS_SIZE;
+        r->t0 = ((cell / ATLAS_COLS) * THUMB_H + 0.5) / ATLAS_SIZE;
+        r->s1 = ((cell % ATLAS_COLS) * THUMB_W + t->w - 0.5) / ATLAS_SIZE;
+        r->t1 = ((cell / ATLAS_COLS) * THUMB_H + t->h - 0.5) / ATLAS_SIZE;
+    }
+    pthread_mutex_unlock(&thumb_lock);
+
+    if (state == T_RESIDENT)
+        return THUMB_RESIDENT;
+    return state == T_FAILED ? THUMB_FAILED : THUMB_WAITING;
+}
+
+/* A free cell, from a new atlas if need be, or else the one drawn longest
+ * ago, as long as that wasn't in the last frame. Called with the lock held. */
+static int free_cell(unsigned long frame) {
+    struct thumb_s *oldest = NULL;
+    int i;
+
+    for (i = 0; i < num_atlases * CELLS_PER_ATLAS; i++) {
+        if (!cells[i])
+            return i;
+    }
+    if (num_atlases < MAX_ATLASES) {
+        glGenTextures(1, &atlases[num_atlases]);
+        glBindTexture(GL_TEXTURE_2D, atlases[num_atlases]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, ATLAS_SIZE, ATLAS_SIZE, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        if (thumb_verbose)
+            fprintf(stderr, "Thumbnail atlas %d created\n", num_atlases);
+        return num_atlases++ * CELLS_PER_ATLAS;
+    }
+    for (i = 0; i < MAX_ATLASES * CELLS_PER_ATLAS; i++) {
+        if (cells[i]->drawn + 1 < frame && (!oldest || cells[i]->drawn < oldest->drawn))
+            oldest = cells[i];
+    }
+    if (!oldest)
+        return -1;
+    i = oldest->cell;
+    oldest->cell = -1;
+    oldest->state = T_IDLE;
+    cells[i] = NULL;
+    return i;
+}
+
+/* Copy finished thumbnails into the atlases. Returns how many, so the
+ * caller knows to draw again. */
+int thumbnails_upload(unsigned long frame) {
+    struct thumb_s *t;
+    int count = 0, cell;
+
+    if (!thumb_started)
+        return 0;
+    pthread_mutex_lock(&thumb_lock);
+    while (count < UPLOADS_PER_CALL && (t = TAILQ_FIRST(&thumb_done)) != NULL) {
+        cell = free_cell(frame);
+        if (cell == -1)
+            break;
+        TAILQ_REMOVE(&thumb_done, t, entries);
+        glBindTexture(GL_TEXTURE_2D, atlases[cell / CELLS_PER_ATLAS]);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, (cell % CELLS_PER_ATLAS % ATLAS_COLS) * THUMB_W,
+                        (cell % CELLS_PER_ATLAS / ATLAS_COLS) * THUMB_H, t->w, t->h,
+                        GL_RGB, GL_UNSIGNED_BYTE, t->pixels);
+        free(t->pixels);
+        t->pixels = NULL;
+        t->cell = cell;
+        t->state = T_RESIDENT;
+        t->drawn = frame;
+        cells[cell] = t;
+        count++;
+    }
+    pthread_mutex_unlock(&thumb_lock);
+    return count;
+}
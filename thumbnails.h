@@ -0,0 +1,35 @@
+#ifndef _thumbnails_h_
+#define _thumbnails_h_
+
+#include <GL/gl.h>
+
+/* Small copies of every image, for the overview grid. Thumbnails are made on
+ * a pool of background threads, and packed into a few large atlas textures,
+ * so a screenful of them draws with one texture bind per atlas. Each one is
+ * also saved under $XDG_CACHE_HOME/lg-pano/thumbs (~/.cache/lg-pano/thumbs by
+ * default), keyed by the image's path, and checked against its size and
+ * modification time, so later runs only have to read them back.
+ *
+ * When the atlases are full, the thumbnails drawn longest ago give up their
+ * cells, and get read back from disk if they're wanted again. Everything but
+ * the worker threads runs on the main thread, which owns the GL context. */
+
+#define THUMB_W 256                 /* Thumbnails fit in this, keeping their shape */
+#define THUMB_H 128
+
+#define THUMB_WAITING 0             /* Not made yet, or not in an atlas */
+#define THUMB_RESIDENT 1
+#define THUMB_FAILED 2              /* Couldn't read the image */
+
+typedef struct {
+    GLuint texture;
+    int atlas;
+    unsigned int w, h;
+    float s0, t0, s1, t1;
+} thumb_rect;
+
+void thumbnails_init(int threads, int verbose);
+int thumbnails_get(const char *filename, int urgent, unsigned long frame, thumb_rect *);
+int thumbnails_upload(unsigned long frame);
+
+#endif
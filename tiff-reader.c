@@ -0,0 +1,560 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <jpeglib.h>
+#include <zlib.h>
+#include "tiff-reader.h"
+
+#define MAX_DIRS 64                 /* Directories looked at, in multi-page files */
+#define MAX_TILE_PIXELS (1 << 26)   /* Single strip images bigger than this go to GraphicsMagick */
+
+#define TAG_SUBFILE_TYPE 254
+#define TAG_WIDTH 256
+#define TAG_LENGTH 257
+#define TAG_BITS 258
+#define TAG_COMPRESSION 259
+#define TAG_PHOTOMETRIC 262
+#define TAG_STRIP_OFFSETS 273
+#define TAG_SAMPLES 277
+#define TAG_ROWS_PER_STRIP 278
+#define TAG_STRIP_BYTES 279
+#define TAG_PLANAR 284
+#define TAG_PREDICTOR 317
+#define TAG_TILE_WIDTH 322
+#define TAG_TILE_LENGTH 323
+#define TAG_TILE_OFFSETS 324
+#define TAG_TILE_BYTES 325
+#define TAG_SUB_IFDS 330
+#define TAG_JPEG_TABLES 347
+
+#define COMPRESS_NONE 1
+#define COMPRESS_LZW 5
+#define COMPRESS_JPEG 7
+#define COMPRESS_DEFLATE 8
+#define COMPRESS_DEFLATE_OLD 32946
+
+#define PHOTO_WHITE_IS_ZERO 0
+#define PHOTO_BLACK_IS_ZERO 1
+#define PHOTO_RGB 2
+#define PHOTO_YCBCR 6
+
+#define SUBFILE_MASK 4              /* Transparency masks aren't images */
+
+/* Where a tag's values are in the file */
+typedef struct {
+    int type;
+    uint64_t count, at;
+} tiff_array;
+
+typedef struct {
+    unsigned int width, height;
+    unsigned int tile_w, tile_h;    /* Strips are tiles as wide as the image */
+    unsigned int across, down;
+    int compression, photometric, samples, predictor;
+    tiff_array offsets, bytes;
+    unsigned char *jpeg_tables;     /* Shared by every JPEG tile */
+    size_t jpeg_tables_len;
+} tiff_dir;
+
+struct tiff_file_s {
+    int fd;
+    int big_endian, big;            /* big: BigTIFF, with 64-bit offsets */
+    tiff_dir levels[TIFF_MAX_LEVELS];   /* levels[k] is 1/2^k size, if its width isn't 0 */
+
+    /* The row of tiles last read from, decoded, since a strip of rows often
+     * starts partway down the row of tiles the last strip ended in */
+    int band_level;
+    unsigned int band_row, band_across;
+    unsigned char **band;
+};
+
+struct tiff_jpeg_error {
+    struct jpeg_error_mgr pub;
+    jmp_buf env;
+};
+
+int tiff_is_tiff(const unsigned char *magic) {
+    return (magic[0] == 'I' && magic[1] == 'I' && (magic[2] == 42 || magic[2] == 43) && magic[3] == 0) ||
+           (magic[0] == 'M' && magic[1] == 'M' && magic[2] == 0 && (magic[3] == 42 || magic[3] == 43));
+}
+
+static int read_at(tiff_file *t, uint64_t at, void *buf, size_t len) {
+    return pread(t->fd, buf, len, (off_t) at) == (ssize_t) len;
+}
+
+static uint64_t get_uint(tiff_file *t, const unsigned char *p, int size) {
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < size; i++)
+        v |= (uint64_t) p[t->big_endian ? size - 1 - i : i] << (8 * i);
+    return v;
+}
+
+static int type_size(int type) {
+    switch (type) {
+        case 1: case 2: case 6: case 7:
+            return 1;
+        case 3: case 8:
+            return 2;
+        case 4: case 9: case 11: case 13:
+            return 4;
+        case 5: case 10: case 12: case 16: case 17: case 18:
+            return 8;
+    }
+    return 0;
+}
+
+/* Value i of an array of integers, or 0 if it can't be read */
+static uint64_t array_value(tiff_file *t, const tiff_array *a, uint64_t i) {
+    unsigned char buf[8];
+    int size = type_size(a->type);
+
+    if (i >= a->count || !size || !read_at(t, a->at + i * size, buf, size))
+        return 0;
+    return get_uint(t, buf, size);
+}
+
+/* Read the directory at offset into d. Returns 1 if it's an image we can
+ * decode, 0 if it isn't, and -1 if it couldn't be read at all. The next
+ * directory's offset goes in next, and any SubIFDs in subifds. */
+static int read_dir(tiff_file *t, uint64_t offset, tiff_dir *d, uint64_t *next, tiff_array *subifds) {
+    unsigned char buf[20];
+    int count_size = t->big ? 8 : 2, value_size = t->big ? 8 : 4, entry_size = t->big ? 20 : 12;
+    uint64_t count, i, at, v;
+    unsigned int subfile = 0, bits = 8, planar = 1, rows_per_strip = 0;
+    tiff_array a;
+    int size;
+
+    memset(d, 0, sizeof(*d));
+    memset(subifds, 0, sizeof(*subifds));
+    d->compression = COMPRESS_NONE;
+    d->photometric = -1;
+    d->samples = 1;
+    d->predictor = 1;
+    *next = 0;
+    if (!read_at(t, offset, buf, count_size))
+        return -1;
+    count = get_uint(t, buf, count_size);
+    if (count > 4096)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        at = offset + count_size + i * entry_size;
+        if (!read_at(t, at, buf, entry_size))
+            return -1;
+        a.type = get_uint(t, buf + 2, 2);
+        a.count = get_uint(t, buf + 4, value_size);
+        size = type_size(a.type);
+        /* Values that fit are kept in the entry itself */
+        if (size && a.count <= (uint64_t) (value_size / size))
+            a.at = at + 4 + value_size;
+        else
+            a.at = get_uint(t, buf + 4 + value_size, value_size);
+        v = array_value(t, &a, 0);
+
+        switch (get_uint(t, buf, 2)) {
+            case TAG_SUBFILE_TYPE:      subfile = v; break;
+            case TAG_WIDTH:             d->width = v; break;
+            case TAG_LENGTH:            d->height = v; break;
+            case TAG_BITS:              bits = v; break;
+            case TAG_COMPRESSION:       d->compression = v; break;
+            case TAG_PHOTOMETRIC:       d->photometric = v; break;
+            case TAG_SAMPLES:           d->samples = v; break;
+            case TAG_ROWS_PER_STRIP:    rows_per_strip = v; break;
+            case TAG_PLANAR:            planar = v; break;
+            case TAG_PREDICTOR:         d->predictor = v; break;
+            case TAG_TILE_WIDTH:        d->tile_w = v; break;
+            case TAG_TILE_LENGTH:       d->tile_h = v; break;
+            case TAG_STRIP_OFFSETS:
+            case TAG_TILE_OFFSETS:      d->offsets = a; break;
+            case TAG_STRIP_BYTES:
+            case TAG_TILE_BYTES:        d->bytes = a; break;
+            case TAG_SUB_IFDS:          *subifds = a; break;
+            case TAG_JPEG_TABLES:
+                if (size == 1 && a.count > 0 && a.count < 65536 && !d->jpeg_tables) {
+                    d->jpeg_tables = (unsigned char *) malloc(a.count);
+                    if (d->jpeg_tables && read_at(t, a.at, d->jpeg_tables, a.count))
+                        d->jpeg_tables_len = a.count;
+                }
+                break;
+        }
+    }
+    at = offset + count_size + count * entry_size;
+    if (read_at(t, at, buf, value_size))
+        *next = get_uint(t, buf, value_size);
+
+    if (d->photometric == -1)
+        d->photometric = (d->samples == 1) ? PHOTO_BLACK_IS_ZERO : PHOTO_RGB;
+    if (!d->tile_w) {
+        d->tile_w = d->width;
+        d->tile_h = (rows_per_strip && rows_per_strip < d->height) ? rows_per_strip : d->height;
+    }
+    if (d->width && d->height && d->tile_w && d->tile_h) {
+        d->across = (d->width + d->tile_w - 1) / d->tile_w;
+        d->down = (d->height + d->tile_h - 1) / d->tile_h;
+    }
+
+    if (!d->across || !d->down || (subfile & SUBFILE_MASK) || bits != 8 || planar != 1 ||
+            (uint64_t) d->tile_w * d->tile_h > MAX_TILE_PIXELS ||
+            d->offsets.count < (uint64_t) d->across * d->down || d->bytes.count < (uint64_t) d->across * d->down ||
+            (d->predictor != 1 && d->predictor != 2))
+        goto unusable;
+    switch (d->compression) {
+        case COMPRESS_NONE: case COMPRESS_LZW: case COMPRESS_JPEG: case COMPRESS_DEFLATE: case COMPRESS_DEFLATE_OLD:
+            break;
+        default:
+            goto unusable;
+    }
+    if (d->samples == 1 && (d->photometric == PHOTO_WHITE_IS_ZERO || d->photometric == PHOTO_BLACK_IS_ZERO))
+        return 1;
+    if ((d->samples == 3 || d->samples == 4) && d->photometric == PHOTO_RGB)
+        return 1;
+    if (d->samples == 3 && d->photometric == PHOTO_YCBCR && d->compression == COMPRESS_JPEG)
+        return 1;
+
+unusable:
+    free(d->jpeg_tables);
+    d->jpeg_tables = NULL;
+    return 0;
+}
+
+/* File a reduced resolution copy under the level it's the size of, if it's
+ * the full image halved some number of times, give or take rounding */
+static void add_level(tiff_file *t, tiff_dir *d) {
+    uint64_t w, h;
+    int k;
+
+    for (k = 1; k < TIFF_MAX_LEVELS; k++) {
+        w = ((uint64_t) t->levels[0].width + (1ULL << k) - 1) >> k;
+        h = ((uint64_t) t->levels[0].height + (1ULL << k) - 1) >> k;
+        if (d->width + 1 >= w && d->width <= w + 1 && d->height + 1 >= h && d->height <= h + 1) {
+            if (t->levels[k].width)
+                break;
+            t->levels[k] = *d;
+            return;
+        }
+    }
+    free(d->jpeg_tables);
+}
+
+/* Read the file's header and directories, and nothing else. NULL if it
+ * isn't a TIFF, or its first image isn't one we can decode. */
+tiff_file *tiff_open(const char *filename) {
+    unsigned char buf[16];
+    tiff_file *t;
+    tiff_dir d;
+    tiff_array subifds, unused;
+    uint64_t offset, next, unused_next, i;
+    int n, ret;
+
+    t = (tiff_file *) calloc(1, sizeof(tiff_file));
+    if (!t) {
+        perror("Couldn't allocate TIFF reader");
+        return NULL;
+    }
+    t->band_level = -1;
+    t->fd = open(filename, O_RDONLY);
+    if (t->fd < 0 || !read_at(t, 0, buf, 16) || !tiff_is_tiff(buf))
+        goto fail;
+    t->big_endian = (buf[0] == 'M');
+    t->big = (get_uint(t, buf + 2, 2) == 43);
+    if (t->big && get_uint(t, buf + 4, 2) != 8)
+        goto fail;
+    offset = t->big ? get_uint(t, buf + 8, 8) : get_uint(t, buf + 4, 4);
+
+    for (n = 0; offset && n < MAX_DIRS; n++) {
+        ret = read_dir(t, offset, &d, &next, &subifds);
+        if (ret == -1)
+            break;
+        if (n == 0) {
+            if (ret == 0)
+                goto fail;
+            t->levels[0] = d;
+            for (i = 0; i < subifds.count && i < MAX_DIRS; i++) {
+                if (read_dir(t, array_value(t, &subifds, i), &d, &unused_next, &unused) == 1)
+                    add_level(t, &d);
+            }
+        }
+        else if (ret == 1) {
+            add_level(t, &d);
+        }
+        offset = next;
+    }
+    return t;
+
+fail:
+    tiff_close(t);
+    return NULL;
+}
+
+/* Which level is 1/denom the size of the full image, each way, and how big
+ * we make it out to be: the full size divided by denom and rounded up,
+ * however the file rounded it. -1 if the file has no such level. */
+int tiff_level(tiff_file *t, unsigned int denom, unsigned int *w, unsigned int *h) {
+    int k = 0;
+
+    while (k < TIFF_MAX_LEVELS - 1 && (1U << k) < denom)
+        k++;
+    if ((1U << k) != denom || !t->levels[k].width)
+        return -1;
+    *w = (unsigned int) (((uint64_t) t->levels[0].width + denom - 1) / denom);
+    *h = (unsigned int) (((uint64_t) t->levels[0].height + denom - 1) / denom);
+    return k;
+}
+
+/* TIFF's LZW: MSB first codes, growing a bit one code early */
+static int lzw_decode(const unsigned char *in, size_t len, unsigned char *out, size_t out_len) {
+    static const int clear = 256, end = 257;
+    unsigned short prefix[4096], length[4096];
+    unsigned char suffix[4096], first[4096];
+    uint64_t bits = 0, bit_count = (uint64_t) len * 8;
+    size_t pos = 0;
+    int width = 9, next = 258, prev = -1, code, c, k, i;
+
+    for (i = 0; i < 256; i++) {
+        suffix[i] = first[i] = i;
+        length[i] = 1;
+    }
+    while (bits + width <= bit_count && pos < out_len) {
+        code = 0;
+        for (i = 0; i < width; i++, bits++)
+            code = (code << 1) | ((in[bits / 8] >> (7 - bits % 8)) & 1);
+        if (code == end)
+            break;
+        if (code == clear) {
+            width = 9;
+            next = 258;
+            prev = -1;
+            continue;
+        }
+        if (prev == -1) {
+            if (code > 255)
+                return 0;
+            out[pos++] = code;
+            prev = code;
+            continue;
+        }
+        if (code > next || next >= 4096)
+            return 0;
+        if (code == next) {
+            /* The string we're about to add: the last one, and its first byte */
+            prefix[next] = prev;
+            suffix[next] = first[prev];
+        }
+        else {
+            prefix[next] = prev;
+            suffix[next] = first[code];
+        }
+        first[next] = first[prev];
+        length[next] = length[prev] + 1;
+        next++;
+
+        for (c = code, k = length[code] - 1; k >= 0; k--) {
+            if (pos + k < out_len)
+                out[pos + k] = suffix[c];
+            c = prefix[c];
+        }
+        pos += length[code];
+        prev = code;
+        if (next >= (1 << width) - 1 && width < 12)
+            width++;
+    }
+    return 1;
+}
+
+static void jpeg_longjmp(j_common_ptr cinfo) {
+    longjmp(((struct tiff_jpeg_error *) cinfo->err)->env, 1);
+}
+
+/* Decode a JPEG tile to RGB, after the tables it shares with the others */
+static int decode_jpeg(tiff_dir *d, unsigned char *data, size_t len, unsigned char *out) {
+    struct jpeg_decompress_struct cinfo;
+    struct tiff_jpeg_error jerr;
+    JSAMPROW row;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_longjmp;
+    if (setjmp(jerr.env)) {
+        jpeg_destroy_decompress(&cinfo);
+        return 0;
+    }
+    jpeg_create_decompress(&cinfo);
+    if (d->jpeg_tables) {
+        jpeg_mem_src(&cinfo, d->jpeg_tables, d->jpeg_tables_len);
+        jpeg_read_header(&cinfo, FALSE);
+    }
+    jpeg_mem_src(&cinfo, data, len);
+    jpeg_read_header(&cinfo, TRUE);
+    /* Nothing in the stream says it's RGB; the TIFF does */
+    if (d->photometric == PHOTO_RGB)
+        cinfo.jpeg_color_space = JCS_RGB;
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    if (cinfo.output_width > d->tile_w)
+        jpeg_longjmp((j_common_ptr) &cinfo);
+    while (cinfo.output_scanline < cinfo.output_height && cinfo.output_scanline < d->tile_h) {
+        row = out + (size_t) cinfo.output_scanline * d->tile_w * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_destroy_decompress(&cinfo);
+    return 1;
+}
+
+/* Decode tile i of d into out, tile_w by tile_h RGB pixels. Returns 0,
+ * leaving whatever it couldn't decode black, if anything went wrong. */
+static int decode_tile(tiff_file *t, tiff_dir *d, unsigned int i, unsigned char *out) {
+    uint64_t offset = array_value(t, &d->offsets, i), len = array_value(t, &d->bytes, i);
+    size_t row_bytes = (size_t) d->tile_w * d->samples, raw_len = row_bytes * d->tile_h, p;
+    unsigned char *data, *raw, *s;
+    unsigned int y;
+    uLongf n = raw_len;
+    int ok = 1, ret;
+
+    memset(out, 0, (size_t) d->tile_w * d->tile_h * 3);
+    /* Sparse files leave out tiles nobody wrote */
+    if (!offset || !len)
+        return 1;
+    /* LZW can take up to a byte and a half a byte */
+    if (len > raw_len * 2 + 65536)
+        return 0;
+    data = (unsigned char *) malloc(len);
+    if (!data || !read_at(t, offset, data, len)) {
+        free(data);
+        return 0;
+    }
+    if (d->compression == COMPRESS_JPEG) {
+        ok = decode_jpeg(d, data, len, out);
+        free(data);
+        return ok;
+    }
+
+    raw = (unsigned char *) calloc(1, raw_len);
+    if (!raw) {
+        free(data);
+        return 0;
+    }
+    switch (d->compression) {
+        case COMPRESS_NONE:
+            memcpy(raw, data, len < raw_len ? len : raw_len);
+            break;
+        case COMPRESS_LZW:
+            ok = lzw_decode(data, len, raw, raw_len);
+            break;
+        default:
+            /* The last strip may be short, and say so by ending early */
+            ret = uncompress(raw, &n, data, len);
+            ok = (ret == Z_OK || ret == Z_BUF_ERROR);
+            break;
+    }
+    free(data);
+
+    if (d->predictor == 2) {
+        for (y = 0; y < d->tile_h; y++) {
+            s = raw + y * row_bytes;
+            for (p = d->samples; p < row_bytes; p++)
+                s[p] += s[p - d->samples];
+        }
+    }
+    for (p = 0; p < (size_t) d->tile_w * d->tile_h; p++) {
+        s = raw + p * d->samples;
+        if (d->samples == 1) {
+            out[p * 3] = out[p * 3 + 1] = out[p * 3 + 2] = (d->photometric == PHOTO_WHITE_IS_ZERO) ? 255 - s[0] : s[0];
+        }
+        else {
+            out[p * 3] = s[0];
+            out[p * 3 + 1] = s[1];
+            out[p * 3 + 2] = s[2];
+        }
+    }
+    free(raw);
+    return ok;
+}
+
+/* A tile of the band, decoding it if it's not there yet. Moving to
+ * another row of tiles drops the last one's. */
+static unsigned char *band_tile(tiff_file *t, int level, unsigned int col, unsigned int row) {
+    tiff_dir *d = &t->levels[level];
+    unsigned int i;
+
+    if (t->band_level != level || t->band_row != row) {
+        for (i = 0; i < t->band_across; i++)
+            free(t->band[i]);
+        free(t->band);
+        t->band = (unsigned char **) calloc(d->across, sizeof(unsigned char *));
+        if (!t->band) {
+            t->band_level = -1;
+            t->band_across = 0;
+            return NULL;
+        }
+        t->band_level = level;
+        t->band_row = row;
+        t->band_across = d->across;
+    }
+    if (!t->band[col]) {
+        t->band[col] = (unsigned char *) malloc((size_t) d->tile_w * d->tile_h * 3);
+        if (!t->band[col])
+            return NULL;
+        if (!decode_tile(t, d, row * d->across + col, t->band[col]))
+            fprintf(stderr, "Couldn't decode tile %u, %u of TIFF level %d; leaving it black\n", col, row, level);
+    }
+    return t->band[col];
+}
+
+/* Copy w by h RGB pixels at x, y of a level into buf, decoding only the
+ * tiles they're in. Anything past the edges is black. Returns 0 if we ran
+ * out of memory. */
+int tiff_read(tiff_file *t, int level, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+              unsigned char *buf) {
+    tiff_dir *d = &t->levels[level];
+    unsigned int row, col, x0, x1, y0, y1, r;
+    unsigned char *tile;
+
+    if (x + w > d->width || y + h > d->height)
+        memset(buf, 0, (size_t) w * h * 3);
+    for (row = y / d->tile_h; row < d->down && row * d->tile_h < y + h; row++) {
+        y0 = (row * d->tile_h > y) ? row * d->tile_h : y;
+        y1 = (row + 1) * d->tile_h;
+        if (y1 > y + h)
+            y1 = y + h;
+        if (y1 > d->height)
+            y1 = d->height;
+        for (col = x / d->tile_w; col < d->across && col * d->tile_w < x + w; col++) {
+            x0 = (col * d->tile_w > x) ? col * d->tile_w : x;
+            x1 = (col + 1) * d->tile_w;
+            if (x1 > x + w)
+                x1 = x + w;
+            if (x1 > d->width)
+                x1 = d->width;
+            tile = band_tile(t, level, col, row);
+            if (!tile) {
+                perror("Out of memory decoding TIFF tiles");
+                return 0;
+            }
+            for (r = y0; r < y1; r++)
+                memcpy(buf + ((size_t) (r - y) * w + (x0 - x)) * 3,
+                       tile + ((size_t) (r - row * d->tile_h) * d->tile_w + (x0 - col * d->tile_w)) * 3,
+                       (size_t) (x1 - x0) * 3);
+        }
+    }
+    return 1;
+}
+
+void tiff_close(tiff_file *t) {
+    unsigned int i;
+    int k;
+
+    for (i = 0; i < t->band_across; i++)
+        free(t->band[i]);
+    free(t->band);
+    for (k = 0; k < TIFF_MAX_LEVELS; k++)
+        free(t->levels[k].jpeg_tables);
+    if (t->fd >= 0)
+        close(t->fd);
+    free(t);
+}
@@ -0,0 +1,29 @@
+#ifndef _tiff_reader_h_
+#define _tiff_reader_h_
+
+/* Reads tiled and stripped TIFF and BigTIFF files ourselves, a tile at a
+ * time, so a region of an image far larger than memory costs only the tiles
+ * it touches. Opening one reads nothing but its directories; tile offsets
+ * are looked up as the tiles are wanted. Pyramidal files, with reduced
+ * resolution copies as later directories or as SubIFDs of the first, get a
+ * level for each copy that's the full image halved some number of times.
+ * A level a row or column short of that, from rounding down, reads black
+ * there.
+ *
+ * 8-bit grayscale, RGB and RGBA (whose alpha is dropped) are understood,
+ * uncompressed or compressed with LZW, Deflate or JPEG; anything else
+ * fails tiff_open(), and can go to GraphicsMagick instead. Each tiff_file
+ * belongs to one thread. */
+
+#define TIFF_MAX_LEVELS 32
+
+typedef struct tiff_file_s tiff_file;
+
+int tiff_is_tiff(const unsigned char *magic);
+tiff_file *tiff_open(const char *filename);
+int tiff_level(tiff_file *, unsigned int denom, unsigned int *w, unsigned int *h);
+int tiff_read(tiff_file *, int level, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+              unsigned char *buf);
+void tiff_close(tiff_file *);
+
+#endif
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "tile-protocol.h"
+#include "tile-client.h"
+
+#define CLIENT_TIMEOUT 10          /* Seconds to wait for the server */
+
+/* Tiles as they came off the wire, most recently used first */
+struct cached_tile_s {
+    int img_idx;
+    unsigned int x, y, w, h;
+    unsigned int encoding;
+    size_t length;
+    unsigned char *data;
+    TAILQ_ENTRY(cached_tile_s) entries;
+};
+TAILQ_HEAD(tilecachehead, cached_tile_s) tile_cache = TAILQ_HEAD_INITIALIZER(tile_cache);
+size_t tile_cache_budget = 0, tile_cache_total = 0;
+
+char client_host[256];
+unsigned int client_port;
+int client_socket = -1;
+int client_verbose = 0;
+
+static int client_connect(void) {
+    struct sockaddr_in addr;
+    struct hostent *server;
+    struct timeval tv;
+    int one = 1;
+
+    server = gethostbyname(client_host);
+    if (server == NULL) {
+        fprintf(stderr, "Couldn't figure out tile server host %s\n", client_host);
+        return 0;
+    }
+    client_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (client_socket == -1) {
+        perror("Couldn't open tile client socket");
+        return 0;
+    }
+    tv.tv_sec = CLIENT_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    memcpy(&addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    addr.sin_port = htons(client_port);
+    if (connect(client_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("Couldn't connect to tile server");
+        close(client_socket);
+        client_socket = -1;
+        return 0;
+    }
+    if (client_verbose)
+        fprintf(stderr, "Connected to tile server %s:%u\n", client_host, client_port);
+    return 1;
+}
+
+int tile_client_init(const char *host, unsigned int port, size_t cache_budget, int verbose) {
+    strncpy(client_host, host, sizeof(client_host) - 1);
+    client_port = port;
+    tile_cache_budget = cache_budget;
+    client_verbose = verbose;
+    return client_connect();
+}
+
+/* Send a request and read the reply, reconnecting once if the connection
+ * has gone away. *data gets a malloc()ed copy of the payload, if any. */
+static int transact(struct tile_request *req, struct tile_reply *reply, unsigned char **data) {
+    int attempt;
+
+    *data = NULL;
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (client_socket == -1 && !client_connect())
+            return 0;
+        if (tile_write_full(client_socket, req, sizeof(*req)) &&
+            tile_read_full(client_socket, reply, sizeof(*reply)) &&
+            ntohl(reply->magic) == TILE_MAGIC) {
+            reply->status = ntohl(reply->status);
+            reply->width = ntohl(reply->width);
+            reply->height = ntohl(reply->height);
+            reply->encoding = ntohl(reply->encoding);
+            reply->length = ntohl(reply->length);
+            if (reply->length == 0)
+                return 1;
+            if (reply->length <= (uint32_t) TILE_MAX_PIXELS * 3 + 1024 &&
+                (*data = (unsigned char *) malloc(reply->length)) != NULL &&
+                tile_read_full(client_socket, *data, reply->length))
+                return 1;
+            free(*data);
+            *data = NULL;
+        }
+        fprintf(stderr, "Lost connection to tile server\n");
+        close(client_socket);
+        client_socket = -1;
+    }
+    return 0;
+}
+
+static void fill_request(struct tile_request *req, uint32_t type, int img_idx) {
+    memset(req, 0, sizeof(*req));
+    req->magic = htonl(TILE_MAGIC);
+    req->type = htonl(type);
+    req->img_idx = htonl(img_idx);
+    req->accept = htonl(1 << TILE_ZLIB);
+}
+
+int tile_client_info(int img_idx, unsigned int *width, unsigned int *height) {
+    struct tile_request req;
+    struct tile_reply reply;
+    unsigned char *data;
+
+    fill_request(&req, TILE_INFO, img_idx);
+    if (!transact(&req, &reply, &data))
+        return 0;
+    free(data);
+    if (reply.status != TILE_OK) {
+        fprintf(stderr, "Tile server doesn't have image %d\n", img_idx);
+        return 0;
+    }
+    *width = reply.width;
+    *height = reply.height;
+    return 1;
+}
+
+static void cache_drop(struct cached_tile_s *t) {
+    TAILQ_REMOVE(&tile_cache, t, entries);
+    tile_cache_total -= t->length;
+    free(t->data);
+    free(t);
+}
+
+static void cache_add(int img_idx, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+                      unsigned int encoding, unsigned char *data, size_t length) {
+    struct cached_tile_s *t;
+
+    if (length > tile_cache_budget) {
+        free(data);
+        return;
+    }
+    t = (struct cached_tile_s *) malloc(sizeof(struct cached_tile_s));
+    if (!t) {
+        free(data);
+        return;
+    }
+    t->img_idx = img_idx;
+    t->x = x; t->y = y; t->w = w; t->h = h;
+    t->encoding = encoding;
+    t->data = data;
+    t->length = length;
+    TAILQ_INSERT_HEAD(&tile_cache, t, entries);
+    tile_cache_total += length;
+    while (tile_cache_total > tile_cache_budget)
+        cache_drop(TAILQ_LAST(&tile_cache, tilecachehead));
+}
+
+static int unpack(unsigned int encoding, const unsigned char *data, size_t length, unsigned char *buf, size_t raw_len) {
+    uLongf out_len = raw_len;
+
+    if (encoding == TILE_RAW && length == raw_len) {
+        memcpy(buf, data, raw_len);
+        return 1;
+    }
+    if (encoding == TILE_ZLIB && uncompress(buf, &out_len, data, length) == Z_OK && out_len == raw_len)
+        return 1;
+    fprintf(stderr, "Tile server sent a tile we couldn't make sense of\n");
+    return 0;
+}
+
+/* Get the w by h pixels at x, y of image img_idx into buf, packed RGB, from
+ * the cache if we have them */
+int tile_client_fetch(int img_idx, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned char *buf) {
+    struct tile_request req;
+    struct tile_reply reply;
+    struct cached_tile_s *t;
+    unsigned char *data;
+    size_t raw_len = (size_t) w * h * 3;
+
+    TAILQ_FOREACH(t, &tile_cache, entries) {
+        if (t->img_idx == img_idx && t->x == x && t->y == y && t->w == w && t->h == h) {
+            TAILQ_REMOVE(&tile_cache, t, entries);
+            TAILQ_INSERT_HEAD(&tile_cache, t, entries);
+            return unpack(t->encoding, t->data, t->length, buf, raw_len);
+        }
+    }
+
+    fill_request(&req, TILE_GET, img_idx);
+    req.x = htonl(x);
+    req.y = htonl(y);
+    req.w = htonl(w);
+    req.h = htonl(h);
+    if (!transact(&req, &reply, &data))
+        return 0;
+    if (reply.status != TILE_OK || !data || !unpack(reply.encoding, data, reply.length, buf, raw_len)) {
+        fprintf(stderr, "Tile server couldn't give us %ux%u at %u,%u of image %d\n", w, h, x, y, img_idx);
+        free(data);
+        return 0;
+    }
+    if (client_verbose > 1)
+        fprintf(stderr, "Fetched %ux%u at %u,%u of image %d: %u bytes\n", w, h, x, y, img_idx, reply.length);
+    cache_add(img_idx, x, y, w, h, reply.encoding, data, reply.length);
+    return 1;
+}
+
+/* Image indexes have changed, or images have, so nothing cached can be
+ * trusted any more */
+void tile_client_flush(void) {
+    while (!TAILQ_EMPTY(&tile_cache))
+        cache_drop(TAILQ_FIRST(&tile_cache));
+}
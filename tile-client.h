@@ -0,0 +1,15 @@
+#ifndef _tile_client_h_
+#define _tile_client_h_
+
+#include <stddef.h>
+
+/* Fetches tiles from a tile server, and keeps the most recently used ones,
+ * as received, up to a memory budget, so tiles the texture cache evicts can
+ * be uploaded again without another round trip. */
+
+int tile_client_init(const char *host, unsigned int port, size_t cache_budget, int verbose);
+int tile_client_info(int img_idx, unsigned int *width, unsigned int *height);
+int tile_client_fetch(int img_idx, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned char *buf);
+void tile_client_flush(void);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _tile_protocol_h_
+#define _tile_protocol_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* What lg-pano's tile server and its clients say to each other over TCP.
+ * Each request gets exactly one reply, in order, on the same connection.
+ * Every field is a 32 bit integer in network byte order.
+ *
+ * TILE_INFO asks for an image's size. TILE_GET asks for a rectangle of the
+ * full resolution image, in image pixel coordinates with row 0 at the top,
+ * and the reply carries its pixels as packed RGB, top row first, either raw
+ * or compressed with zlib, in `length` bytes following the reply. Images are
+ * identified by their index in the list, so both ends need the same list. */
+
+#define TILE_MAGIC 0x6c677470
+
+#define TILE_INFO 1
+#define TILE_GET 2
+
+#define TILE_OK 0
+#define TILE_NO_IMAGE 1
+#define TILE_BAD_REQUEST 2
+
+#define TILE_RAW 0
+#define TILE_ZLIB 1
+
+#define TILE_MAX_PIXELS (4096 * 4096)
+
+struct tile_request {
+    uint32_t magic, type;
+    int32_t img_idx;
+    uint32_t x, y, w, h;
+    uint32_t accept;                /* Bitmask of encodings, 1 << TILE_ZLIB etc. */
+};
+
+struct tile_reply {
+    uint32_t magic, status;
+    uint32_t width, height;         /* The whole image's size */
+    uint32_t encoding, length;
+};
+
+int tile_read_full(int fd, void *buf, size_t len);
+int tile_write_full(int fd, const void *buf, size_t len);
+
+#endif
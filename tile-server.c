@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "catalog.h"
+#include "shared-image.h"
+#include "tile-protocol.h"
+#include "tile-server.h"
+#include "pixel-kernels.h"
+
+#define MAX_CLIENTS 64
+
+pthread_t server_thread;
+int server_socket = -1;
+int server_compress = 0, server_verbose = 0;
+
+/* The image tiles are being served from */
+shared_image served;
+char *served_name;
+struct stat served_stat;
+
+int tile_read_full(int fd, void *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        buf = (char *) buf + n;
+        len -= n;
+    }
+    return 1;
+}
+
+int tile_write_full(int fd, const void *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        buf = (const char *) buf + n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* Make sure image img_idx is the one decoded, as it is now on disk */
+static int serve_image(int img_idx) {
+    struct stat st;
+    char *filename;
+
+    filename = catalog_filename(img_idx);
+    if (!filename)
+        return 0;
+    if (stat(filename, &st) == -1) {
+        perror("Couldn't stat image to serve");
+        free(filename);
+        return 0;
+    }
+    if (served_name && !strcmp(served_name, filename) && st.st_ino == served_stat.st_ino &&
+        st.st_size == served_stat.st_size && st.st_mtime == served_stat.st_mtime) {
+        free(filename);
+        return 1;
+    }
+
+    shared_image_release(&served);
+    free(served_name);
+    served_name = NULL;
+    if (!shared_image_load(&served, filename)) {
+        fprintf(stderr, "Tile server couldn't load image %s\n", filename);
+        free(filename);
+        return 0;
+    }
+    if (server_verbose)
+        fprintf(stderr, "Serving tiles of image %d, %s\n", img_idx, filename);
+    served_name = filename;
+    served_stat = st;
+    return 1;
+}
+
+static int send_reply(int fd, uint32_t status, uint32_t encoding, const void *data, size_t length) {
+    struct tile_reply reply;
+
+    reply.magic = htonl(TILE_MAGIC);
+    reply.status = htonl(status);
+    reply.width = htonl(status == TILE_OK ? served.width : 0);
+    reply.height = htonl(status == TILE_OK ? served.height : 0);
+    reply.encoding = htonl(encoding);
+    reply.length = htonl(length);
+    return tile_write_full(fd, &reply, sizeof(reply)) && (length == 0 || tile_write_full(fd, data, length));
+}
+
+static int send_tile(int fd, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned int accept) {
+    unsigned char *raw, *packed;
+    uLongf packed_len;
+    size_t raw_len = (size_t) w * h * 3;
+    int ret;
+
+    raw = (unsigned char *) malloc(raw_len);
+    if (!raw) {
+        perror("Out of memory serving tile");
+        return send_reply(fd, TILE_BAD_REQUEST, TILE_RAW, NULL, 0);
+    }
+    pixel_copy_tile(PIXEL_RGB8, served.pixels + ((size_t) y * served.width + x) * 3, served.width, w, h, PIXEL_RGB8, raw);
+
+    if (server_compress && (accept & (1 << TILE_ZLIB))) {
+        packed_len = compressBound(raw_len);
+        packed = (unsigned char *) malloc(packed_len);
+        if (packed && compress2(packed, &packed_len, raw, raw_len, 1) == Z_OK && packed_len < raw_len) {
+            ret = send_reply(fd, TILE_OK, TILE_ZLIB, packed, packed_len);
+            free(packed);
+            free(raw);
+            return ret;
+        }
+        free(packed);
+    }
+    ret = send_reply(fd, TILE_OK, TILE_RAW, raw, raw_len);
+    free(raw);
+    return ret;
+}
+
+/* Answer one request. Returns 0 if the connection should be dropped. */
+static int handle_request(int fd) {
+    struct tile_request req;
+    unsigned int x, y, w, h;
+
+    if (!tile_read_full(fd, &req, sizeof(req)))
+        return 0;
+    if (ntohl(req.magic) != TILE_MAGIC) {
+        fprintf(stderr, "Tile server got a request with a bad magic number; dropping the connection\n");
+        return 0;
+    }
+    if (!serve_image((int) ntohl(req.img_idx)))
+        return send_reply(fd, TILE_NO_IMAGE, TILE_RAW, NULL, 0);
+
+    switch (ntohl(req.type)) {
+        case TILE_INFO:
+            return send_reply(fd, TILE_OK, TILE_RAW, NULL, 0);
+        case TILE_GET:
+            x = ntohl(req.x);
+            y = ntohl(req.y);
+            w = ntohl(req.w);
+            h = ntohl(req.h);
+            if (w == 0 || h == 0 || x >= served.width || y >= served.height ||
+                w > served.width - x || h > served.height - y || (size_t) w * h > TILE_MAX_PIXELS)
+                return send_reply(fd, TILE_BAD_REQUEST, TILE_RAW, NULL, 0);
+            if (server_verbose > 1)
+                fprintf(stderr, "Serving tile %u,%u %ux%u of image %d\n", x, y, w, h, (int) ntohl(req.img_idx));
+            return send_tile(fd, x, y, w, h, ntohl(req.accept));
+        default:
+            return send_reply(fd, TILE_BAD_REQUEST, TILE_RAW, NULL, 0);
+    }
+}
+
+/* One thread serves every client, one request at a time. There are only
+ * ever a handful of slaves, and they mostly want the same image at once. */
+static void *server_main(void *arg) {
+    struct pollfd fds[MAX_CLIENTS + 1];
+    int nfds = 1, i, fd, one = 1;
+
+    fds[0].fd = server_socket;
+    fds[0].events = POLLIN;
+    while (1) {
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno != EINTR)
+                perror("Tile server poll");
+            continue;
+        }
+        for (i = nfds - 1; i >= 1; i--) {
+            if (fds[i].revents && !handle_request(fds[i].fd)) {
+                close(fds[i].fd);
+                fds[i] = fds[--nfds];
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            fd = accept(server_socket, NULL, NULL);
+            if (fd == -1) {
+                perror("Tile server couldn't accept connection");
+            }
+            else if (nfds > MAX_CLIENTS) {
+                fprintf(stderr, "Tile server already has %d clients; refusing another\n", MAX_CLIENTS);
+                close(fd);
+            }
+            else {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                fds[nfds].fd = fd;
+                fds[nfds].events = POLLIN;
+                nfds++;
+                if (server_verbose)
+                    fprintf(stderr, "Tile server has a new client\n");
+            }
+        }
+    }
+    return NULL;
+}
+
+int tile_server_start(unsigned int port, int compress, int verbose) {
+    struct sockaddr_in addr;
+    int so_reuseaddr = 1;
+
+    server_compress = compress;
+    server_verbose = verbose;
+
+    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_socket == -1) {
+        perror("Couldn't open tile server socket");
+        return 0;
+    }
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &so_reuseaddr, sizeof so_reuseaddr);
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(server_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(server_socket, 16) < 0) {
+        perror("Couldn't start tile server");
+        close(server_socket);
+        server_socket = -1;
+        return 0;
+    }
+    if (pthread_create(&server_thread, NULL, server_main, NULL) != 0) {
+        perror("Couldn't start tile server thread");
+        close(server_socket);
+        server_socket = -1;
+        return 0;
+    }
+    if (verbose)
+        fprintf(stderr, "Serving tiles on port %u\n", port);
+    return 1;
+}
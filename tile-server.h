@@ -0,0 +1,11 @@
+#ifndef _tile_server_h_
+#define _tile_server_h_
+
+/* Serves decoded tiles of the images in the list over TCP, so that slaves
+ * don't have to decode, or even have, the image files. Runs on its own
+ * thread, and keeps the most recently requested image decoded, through
+ * shared-image, so it's shared with a master running --sharedecode. */
+
+int tile_server_start(unsigned int port, int compress, int verbose);
+
+#endif
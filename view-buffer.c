@@ -0,0 +1,24 @@
+#include "view-buffer.h"
+
+#define SLOT_MASK 3
+#define FRESH 4             /* Set in middle when it holds an untaken snapshot */
+
+view_state view_slots[3];
+int view_back = 0,          /* Only the producer uses this */
+    view_front = 1,         /* Only the consumer uses this */
+    view_middle = 2;        /* Swapped atomically by both */
+
+void view_buffer_publish(const view_state *v) {
+    view_slots[view_back] = *v;
+    view_back = __atomic_exchange_n(&view_middle, view_back | FRESH, __ATOMIC_ACQ_REL) & SLOT_MASK;
+}
+
+/* Copies the newest snapshot into v and returns 1, or returns 0 if nothing
+ * has been published since last time */
+int view_buffer_latest(view_state *v) {
+    if (!(__atomic_load_n(&view_middle, __ATOMIC_ACQUIRE) & FRESH))
+        return 0;
+    view_front = __atomic_exchange_n(&view_middle, view_front, __ATOMIC_ACQ_REL) & SLOT_MASK;
+    *v = view_slots[view_front];
+    return 1;
+}
@@ -0,0 +1,31 @@
+#ifndef _view_buffer_h_
+#define _view_buffer_h_
+
+#include <stdint.h>
+
+/* Hands snapshots of the view from the thread that works out where we're
+ * looking to the one that draws it, without either ever waiting on the
+ * other. It's a triple buffer: the producer fills its own slot and swaps it
+ * for the middle one, and the consumer swaps the middle one for its own
+ * whenever it's been refreshed, so each side always has a slot the other
+ * can't touch. Only one thread may publish, and only one may take. */
+
+typedef struct {
+    int img_idx;
+    float horiz_disp, vert_disp, zoom_factor;
+    float tex_min_x, tex_min_y, tex_max_x, tex_max_y;
+    unsigned long serial;
+    /* On slaves, which sync packet this came from, for acknowledging it */
+    unsigned int seq, ack_port;
+    int heartbeat;                  /* Came from a heartbeat, so seq is old news */
+    int hud;                        /* Show the performance overlay */
+    uint32_t master_addr;           /* Network byte order */
+    double recv_ms;
+    double apply_ms;                /* When to show it, by our clock; 0 for now */
+    unsigned int generation;        /* Renumberings of the image list it knows about */
+} view_state;
+
+void view_buffer_publish(const view_state *);
+int view_buffer_latest(view_state *);
+
+#endif
@@ -0,0 +1,75 @@
+#include <string.h>
+#include "view-schedule.h"
+
+/* Bring v, the view as last received, up to date with a sync packet that
+ * arrived at now, by our clock. offset is the master's clock less ours, or
+ * NULL if we don't know it yet, in which case a change is shown as soon as
+ * it arrives. Returns 0, leaving v alone, for a heartbeat with nothing new
+ * in it: a heartbeat only matters if we missed something. Then it's taken
+ * like any other update, but keeps the number of a change made a while ago,
+ * so it isn't acknowledged again. */
+int sync_take(view_state *v, const sync_struct *s, double now, const double *offset) {
+    if (s->heartbeat && s->img_idx == v->img_idx &&
+        s->horiz_disp == v->horiz_disp && s->vert_disp == v->vert_disp &&
+        s->tex_min_x == v->tex_min_x && s->tex_min_y == v->tex_min_y &&
+        s->tex_max_x == v->tex_max_x && s->tex_max_y == v->tex_max_y &&
+        s->hud == v->hud)
+        return 0;
+
+    v->img_idx = s->img_idx;
+    v->horiz_disp = s->horiz_disp;
+    v->vert_disp = s->vert_disp;
+    v->tex_min_x = s->tex_min_x;
+    v->tex_min_y = s->tex_min_y;
+    v->tex_max_x = s->tex_max_x;
+    v->tex_max_y = s->tex_max_y;
+    v->seq = s->seq;
+    v->ack_port = s->ack_port;
+    v->heartbeat = s->heartbeat;
+    v->hud = s->hud;
+    v->recv_ms = now;
+    v->apply_ms = 0;
+    if (s->apply_at && offset) {
+        v->apply_ms = s->apply_at - *offset;
+        if (v->apply_ms > now + MAX_LEAD_MS)
+            v->apply_ms = now + MAX_LEAD_MS;
+    }
+    return 1;
+}
+
+/* Hold on to a view until it's due. If too many are waiting, the oldest is
+ * dropped; a newer one will be due by the time it would have been. */
+void view_schedule_add(view_schedule *s, const view_state *v) {
+    if (s->count == MAX_SCHEDULED) {
+        memmove(s->views, s->views + 1, (MAX_SCHEDULED - 1) * sizeof(view_state));
+        s->count--;
+    }
+    s->views[s->count++] = *v;
+}
+
+/* Copies the newest view that's due by now into v, forgets it and anything
+ * older, and returns 1; or returns 0 if nothing is due yet */
+int view_schedule_next(view_schedule *s, double now, view_state *v) {
+    int i, due = -1;
+
+    for (i = 0; i < s->count; i++) {
+        if (s->views[i].apply_ms <= now)
+            due = i;
+    }
+    if (due == -1)
+        return 0;
+    *v = s->views[due];
+    s->count -= due + 1;
+    memmove(s->views, s->views + due + 1, s->count * sizeof(view_state));
+    return 1;
+}
+
+/* Put back a view view_schedule_next() handed out, that can't be shown
+ * yet, so it's due again next time unless something newer is */
+void view_schedule_hold(view_schedule *s, const view_state *v) {
+    if (s->count == MAX_SCHEDULED)
+        return;
+    memmove(s->views + 1, s->views, s->count * sizeof(view_state));
+    s->views[0] = *v;
+    s->count++;
+}
@@ -0,0 +1,26 @@
+#ifndef _view_schedule_h_
+#define _view_schedule_h_
+
+#include "view-buffer.h"
+#include "sync-protocol.h"
+
+/* The rules a slave follows with the sync packets it gets: which ones change
+ * its view, and when each is due to go on screen. Kept apart from the
+ * sockets and the drawing, so tests/sync-sim runs the same rules as
+ * lg-pano, on many slaves in one process. */
+
+#define MAX_SCHEDULED 16    /* Views we'll hold on to until they're due */
+#define MAX_LEAD_MS 1000    /* Anything due later than this is a bad clock estimate */
+
+typedef struct {
+    view_state views[MAX_SCHEDULED];    /* Oldest first */
+    int count;
+} view_schedule;
+
+int sync_take(view_state *, const sync_struct *, double now, const double *offset);
+
+void view_schedule_add(view_schedule *, const view_state *);
+int view_schedule_next(view_schedule *, double now, view_state *);
+void view_schedule_hold(view_schedule *, const view_state *);
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <GL/gl.h>
+#include <SDL/SDL.h>
+#include "ycbcr.h"
+
+#ifndef GL_FRAGMENT_SHADER
+#define GL_FRAGMENT_SHADER 0x8B30
+#define GL_COMPILE_STATUS 0x8B81
+#define GL_LINK_STATUS 0x8B82
+#endif
+#ifndef GL_TEXTURE0
+#define GL_TEXTURE0 0x84C0
+#define GL_TEXTURE1 0x84C1
+#define GL_TEXTURE2 0x84C2
+#endif
+
+/* Full range BT.601, as JFIF uses, tinted by the current color like the
+ * fixed function path */
+static const char *fragment_source =
+    "uniform sampler2D y, cb, cr;\n"
+    "void main() {\n"
+    "    float l = texture2D(y, gl_TexCoord[0].st).r;\n"
+    "    float u = texture2D(cb, gl_TexCoord[0].st).r - 128.0 / 255.0;\n"
+    "    float v = texture2D(cr, gl_TexCoord[0].st).r - 128.0 / 255.0;\n"
+    "    gl_FragColor = gl_Color * vec4(l + 1.402 * v, l - 0.344136 * u - 0.714136 * v, l + 1.772 * u, 1.0);\n"
+    "}\n";
+
+/* Shaders aren't in GL 1.x headers, so we look them up */
+typedef GLuint (*create_shader_fn)(GLenum);
+typedef void (*shader_source_fn)(GLuint, GLsizei, const char **, const GLint *);
+typedef void (*compile_shader_fn)(GLuint);
+typedef void (*get_iv_fn)(GLuint, GLenum, GLint *);
+typedef void (*get_info_log_fn)(GLuint, GLsizei, GLsizei *, char *);
+typedef GLuint (*create_program_fn)(void);
+typedef void (*attach_shader_fn)(GLuint, GLuint);
+typedef void (*link_program_fn)(GLuint);
+typedef void (*use_program_fn)(GLuint);
+typedef GLint (*get_uniform_location_fn)(GLuint, const char *);
+typedef void (*uniform1i_fn)(GLint, GLint);
+typedef void (*active_texture_fn)(GLenum);
+
+static create_shader_fn create_shader;
+static shader_source_fn shader_source;
+static compile_shader_fn compile_shader;
+static get_iv_fn get_shaderiv, get_programiv;
+static get_info_log_fn get_shader_info_log, get_program_info_log;
+static create_program_fn create_program;
+static attach_shader_fn attach_shader;
+static link_program_fn link_program;
+static use_program_fn use_program;
+static get_uniform_location_fn get_uniform_location;
+static uniform1i_fn uniform1i;
+static active_texture_fn active_texture;
+static GLuint program = 0;
+
+static int load_shader_functions(void) {
+    create_shader = (create_shader_fn) SDL_GL_GetProcAddress("glCreateShader");
+    shader_source = (shader_source_fn) SDL_GL_GetProcAddress("glShaderSource");
+    compile_shader = (compile_shader_fn) SDL_GL_GetProcAddress("glCompileShader");
+    get_shaderiv = (get_iv_fn) SDL_GL_GetProcAddress("glGetShaderiv");
+    get_programiv = (get_iv_fn) SDL_GL_GetProcAddress("glGetProgramiv");
+    get_shader_info_log = (get_info_log_fn) SDL_GL_GetProcAddress("glGetShaderInfoLog");
+    get_program_info_log = (get_info_log_fn) SDL_GL_GetProcAddress("glGetProgramInfoLog");
+    create_program = (create_program_fn) SDL_GL_GetProcAddress("glCreateProgram");
+    attach_shader = (attach_shader_fn) SDL_GL_GetProcAddress("glAttachShader");
+    link_program = (link_program_fn) SDL_GL_GetProcAddress("glLinkProgram");
+    use_program = (use_program_fn) SDL_GL_GetProcAddress("glUseProgram");
+    get_uniform_location = (get_uniform_location_fn) SDL_GL_GetProcAddress("glGetUniformLocation");
+    uniform1i = (uniform1i_fn) SDL_GL_GetProcAddress("glUniform1i");
+    active_texture = (active_texture_fn) SDL_GL_GetProcAddress("glActiveTexture");
+    return create_shader && shader_source && compile_shader && get_shaderiv && get_programiv &&
+        get_shader_info_log && get_program_info_log && create_program && attach_shader &&
+        link_program && use_program && get_uniform_location && uniform1i && active_texture;
+}
+
+/* Compile and link the shader. Returns 0, after saying why, if the GL
+ * can't run it, and the caller should upload RGB as usual. */
+int ycbcr_init(int verbose) {
+    const char *version = (const char *) glGetString(GL_VERSION);
+    GLuint shader;
+    GLint ok;
+    char log[1024];
+
+    if (!version || atof(version) < 2.0 || !load_shader_functions()) {
+        fprintf(stderr, "OpenGL %s can't run shaders; uploading RGB instead of YCbCr\n", version ? version : "(unknown)");
+        return 0;
+    }
+
+    shader = create_shader(GL_FRAGMENT_SHADER);
+    shader_source(shader, 1, &fragment_source, NULL);
+    compile_shader(shader);
+    get_shaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        get_shader_info_log(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Couldn't compile the YCbCr shader; uploading RGB instead:\n%s\n", log);
+        return 0;
+    }
+    program = create_program();
+    attach_shader(program, shader);
+    link_program(program);
+    get_programiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        get_program_info_log(program, sizeof(log), NULL, log);
+        fprintf(stderr, "Couldn't link the YCbCr shader; uploading RGB instead:\n%s\n", log);
+        program = 0;
+        return 0;
+    }
+
+    use_program(program);
+    uniform1i(get_uniform_location(program, "y"), 0);
+    uniform1i(get_uniform_location(program, "cb"), 1);
+    uniform1i(get_uniform_location(program, "cr"), 2);
+    use_program(0);
+    if (verbose)
+        fprintf(stderr, "Converting YCbCr to RGB on the GPU\n");
+    return 1;
+}
+
+void ycbcr_begin(void) {
+    use_program(program);
+}
+
+/* Bind a tile's planes. Unit 0 is left active, for everything else. */
+void ycbcr_bind(GLuint y, GLuint cb, GLuint cr) {
+    active_texture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, cr);
+    active_texture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, cb);
+    active_texture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, y);
+}
+
+void ycbcr_end(void) {
+    use_program(0);
+}
@@ -0,0 +1,18 @@
+#ifndef _ycbcr_h_
+#define _ycbcr_h_
+
+#include <GL/gl.h>
+
+/* Draws textures uploaded as the luma and chroma planes libjpeg decodes,
+ * converting them to RGB in a fragment shader, so the CPU skips upsampling
+ * and color conversion and half as many bytes cross the bus. Needs GLSL,
+ * from OpenGL 2.0; ycbcr_init() says whether we have it. Each tile's three
+ * planes are bound to texture units 0, 1 and 2, and share its texture
+ * coordinates. Main thread only. */
+
+int ycbcr_init(int verbose);
+void ycbcr_begin(void);
+void ycbcr_bind(GLuint y, GLuint cb, GLuint cr);
+void ycbcr_end(void);
+
+#endif